@@ -0,0 +1,43 @@
+#!/bin/bash
+# Throughput of thin_send | thin_recv without LVM: a file as source, its
+# extents from bench/extent_gen, another file as target.
+#
+# BENCH_DIR	where the files go (default: $TMPDIR or /tmp)
+# BENCH_MB	size of the source file in MiB (default: 512)
+# BENCH_OPTS	thin_send/thin_recv option sets to compare, separated by ';'
+
+set -o errexit
+set -o pipefail
+
+dir=$(mktemp -d "${BENCH_DIR:-${TMPDIR:-/tmp}}/thin-bench.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+mb=${BENCH_MB:-512}
+block_sectors=128
+nr_blocks=$((mb * 2048 / block_sectors))
+IFS=';' read -r -a opt_sets <<< "${BENCH_OPTS:-;--readers 4 --writers 4;--checksum}"
+
+# incompressible, zero blocks would be sent as CMD_ZERO with --detect-zeroes
+head -c ${mb}M /dev/urandom > "$dir/source"
+
+json_done() {
+	sed -n "s/.*\"$1\": { \"planned\": [0-9]*, \"done\": \([0-9]*\) }.*/\1/p" "$2"
+}
+
+printf "%-11s %-28s %10s %12s\n" profile options MB/s chunks/s
+for profile in fragmented ranges mixed; do
+	./bench/extent_gen $profile $nr_blocks $block_sectors > "$dir/extents"
+	for opts in "${opt_sets[@]}"; do
+		rm -f "$dir/target"
+		start=$(date +%s%N)
+		# shellcheck disable=SC2086
+		./thin_send $opts --extents "$dir/extents" "$dir/source" |
+			./thin_recv $opts --stats-json "$dir/stats.json" --file "$dir/target"
+		ns=$(($(date +%s%N) - start))
+
+		bytes=$(json_done data_bytes "$dir/stats.json")
+		chunks=$(json_done extents "$dir/stats.json")
+		awk -v p=$profile -v o="${opts:-(default)}" -v b="$bytes" -v c="$chunks" -v ns=$ns \
+			'BEGIN { printf "%-11s %-28s %10.1f %12.0f\n", p, o, b / 1048576 / (ns / 1e9), c / (ns / 1e9) }'
+	done
+done
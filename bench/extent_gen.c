@@ -0,0 +1,144 @@
+/*
+ * Generates thin_dump or thin_delta output with a given extent
+ * distribution, for thin_send --extents.
+ *
+ * usage: extent_gen profile nr_blocks [block_sectors [seed]]
+ *
+ * fragmented: thin_dump of a volume written randomly, mostly single
+ *             mappings of short runs with gaps in between
+ * ranges:     thin_dump of a volume written sequentially, long range
+ *             mappings
+ * mixed:      thin_delta of two snapshots, with changed, new and
+ *             unmapped runs
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/* xorshift64, the same sequence for the same seed everywhere */
+static unsigned long rnd(unsigned long n)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state % n;
+}
+
+static unsigned long min_ul(unsigned long a, unsigned long b)
+{
+	return a < b ? a : b;
+}
+
+static void dump_header(unsigned long block_sectors, unsigned long nr_blocks, unsigned long mapped)
+{
+	printf("<superblock uuid=\"\" time=\"1\" transaction=\"2\" flags=\"0\" version=\"2\" "
+	       "data_block_size=\"%lu\" nr_data_blocks=\"%lu\">\n", block_sectors, nr_blocks);
+	printf("  <device dev_id=\"1\" mapped_blocks=\"%lu\" transaction=\"0\" "
+	       "creation_time=\"0\" snap_time=\"1\">\n", mapped);
+}
+
+static void dump_footer(void)
+{
+	printf("  </device>\n</superblock>\n");
+}
+
+static void fragmented(unsigned long nr_blocks, unsigned long block_sectors)
+{
+	unsigned long origin = 0, data = 0;
+
+	dump_header(block_sectors, nr_blocks, nr_blocks / 3);
+	for (origin = rnd(4); origin < nr_blocks; origin += 1 + rnd(6)) {
+		/* runs of a few blocks, allocated where the pool had space */
+		unsigned long run = min_ul(1 + rnd(3), nr_blocks - origin);
+
+		data += 1 + rnd(16);
+		if (run == 1 || rnd(4)) {
+			unsigned long end = origin + run;
+
+			for (; origin < end; origin++, data += 2)
+				printf("    <single_mapping origin_block=\"%lu\" data_block=\"%lu\" "
+				       "time=\"0\"/>\n", origin, data);
+		} else {
+			printf("    <range_mapping origin_begin=\"%lu\" data_begin=\"%lu\" "
+			       "length=\"%lu\" time=\"0\"/>\n", origin, data, run);
+			origin += run;
+			data += run;
+		}
+	}
+	dump_footer();
+}
+
+static void ranges(unsigned long nr_blocks, unsigned long block_sectors)
+{
+	unsigned long origin, data = 0;
+
+	dump_header(block_sectors, nr_blocks, nr_blocks * 3 / 4);
+	for (origin = 0; origin < nr_blocks; ) {
+		unsigned long run = min_ul(256 + rnd(3840), nr_blocks - origin);
+
+		printf("    <range_mapping origin_begin=\"%lu\" data_begin=\"%lu\" "
+		       "length=\"%lu\" time=\"0\"/>\n", origin, data, run);
+		origin += run + rnd(1024);
+		data += run;
+	}
+	dump_footer();
+}
+
+static void mixed(unsigned long nr_blocks, unsigned long block_sectors)
+{
+	unsigned long begin, run;
+
+	printf("<superblock uuid=\"\" time=\"1\" transaction=\"2\" "
+	       "data_block_size=\"%lu\" nr_data_blocks=\"%lu\">\n", block_sectors, nr_blocks);
+	printf("  <diff left=\"1\" right=\"2\">\n");
+	for (begin = rnd(8); begin < nr_blocks; begin += run + rnd(32)) {
+		unsigned long kind = rnd(100);
+		const char *tag;
+
+		run = min_ul(1 + rnd(64), nr_blocks - begin);
+		if (kind < 40)
+			tag = "same";
+		else if (kind < 65)
+			tag = "different";
+		else if (kind < 85)
+			tag = "right_only";
+		else
+			tag = "left_only";
+		printf("    <%s begin=\"%lu\" length=\"%lu\"/>\n", tag, begin, run);
+	}
+	printf("  </diff>\n</superblock>\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_blocks, block_sectors = 128;
+
+	if (argc < 3 || argc > 5) {
+		fprintf(stderr, "usage: %s fragmented|ranges|mixed nr_blocks [block_sectors [seed]]\n",
+			argv[0]);
+		return 1;
+	}
+	nr_blocks = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		block_sectors = strtoul(argv[3], NULL, 0);
+	if (argc > 4)
+		rng_state ^= strtoull(argv[4], NULL, 0) * 0x9e3779b97f4a7c15ULL;
+	if (!block_sectors) {
+		fprintf(stderr, "block_sectors must not be 0\n");
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "fragmented"))
+		fragmented(nr_blocks, block_sectors);
+	else if (!strcmp(argv[1], "ranges"))
+		ranges(nr_blocks, block_sectors);
+	else if (!strcmp(argv[1], "mixed"))
+		mixed(nr_blocks, block_sectors);
+	else {
+		fprintf(stderr, "unknown profile %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
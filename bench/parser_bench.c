@@ -0,0 +1,154 @@
+/*
+ * Compares the hand-written metadata tokenizer with the flex scanner it
+ * replaced, on a generated thin_dump output with many mappings.
+ *
+ * usage: parser_bench [number of mappings]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../thin_delta_scanner.h"
+
+struct result {
+	unsigned long long tokens;
+	unsigned long long sum;
+	double seconds;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void generate(FILE *f, unsigned long n)
+{
+	unsigned long i, origin = 0, data = 1000;
+
+	fprintf(f, "<superblock uuid=\"\" time=\"1\" transaction=\"2\" flags=\"0\" version=\"2\" "
+		"data_block_size=\"128\" nr_data_blocks=\"0\">\n");
+	fprintf(f, "  <device dev_id=\"1\" mapped_blocks=\"%lu\" transaction=\"0\" "
+		"creation_time=\"0\" snap_time=\"1\">\n", n);
+	for (i = 0; i < n; i++) {
+		/* fragmented pools are mostly single mappings */
+		if (i % 8 == 0) {
+			fprintf(f, "    <range_mapping origin_begin=\"%lu\" data_begin=\"%lu\" "
+				"length=\"%lu\" time=\"0\"/>\n", origin, data, i % 13 + 2);
+			origin += i % 13 + 2;
+			data += i % 13 + 2;
+		} else {
+			fprintf(f, "    <single_mapping origin_block=\"%lu\" data_block=\"%lu\" "
+				"time=\"0\"/>\n", origin, data);
+			origin++;
+			data += 3;
+		}
+		origin += i % 5;
+	}
+	fprintf(f, "  </device>\n</superblock>\n");
+}
+
+static struct result run_flex(const char *file)
+{
+	struct result r = { 0, };
+	double start = now();
+	int token;
+
+	yyin = fopen(file, "r");
+	if (!yyin) {
+		perror(file);
+		exit(10);
+	}
+	while ((token = yylex())) {
+		r.tokens++;
+		if (token == TK_VALUE && str_value)
+			r.sum += strtoull(str_value, NULL, 10);
+	}
+	fclose(yyin);
+	r.seconds = now() - start;
+	return r;
+}
+
+static struct result run_parser(const char *file, bool through_pipe)
+{
+	struct result r = { 0, };
+	double start = now();
+	struct md_parser *md;
+	FILE *pipe = NULL;
+	uint64_t value;
+	int fd, token;
+
+	if (through_pipe) {
+		char cmd[4096];
+
+		snprintf(cmd, sizeof(cmd), "cat %s", file);
+		pipe = popen(cmd, "r");
+		fd = pipe ? fileno(pipe) : -1;
+	} else {
+		fd = open(file, O_RDONLY);
+	}
+	if (fd == -1) {
+		perror(file);
+		exit(10);
+	}
+	md = md_parser_open(fd);
+	while ((token = md_lex(md))) {
+		r.tokens++;
+		if (token == TK_VALUE && md_value_u64(md, &value))
+			r.sum += value;
+	}
+	md_parser_close(md);
+	if (pipe)
+		pclose(pipe);
+	else
+		close(fd);
+	r.seconds = now() - start;
+	return r;
+}
+
+static void report(const char *name, struct result r, long long size)
+{
+	printf("%-20s %8.3f s %8.1f MiB/s %12llu tokens\n", name, r.seconds,
+	       size / r.seconds / (1024 * 1024), r.tokens);
+}
+
+int main(int argc, char **argv)
+{
+	char file[] = "/tmp/parser_bench_XXXXXX";
+	unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 0) : 5000000;
+	struct result flex, mmapped, piped;
+	long long size;
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(file);
+	if (fd == -1 || !(f = fdopen(fd, "w"))) {
+		perror("creating tmp file");
+		exit(10);
+	}
+	generate(f, n);
+	size = ftell(f);
+	fclose(f);
+
+	flex = run_flex(file);
+	mmapped = run_parser(file, false);
+	piped = run_parser(file, true);
+	unlink(file);
+
+	printf("%lu mappings, %lld bytes\n", n, size);
+	report("flex scanner", flex, size);
+	report("md_lex (mmap)", mmapped, size);
+	report("md_lex (pipe)", piped, size);
+
+	if (flex.tokens != mmapped.tokens || flex.sum != mmapped.sum ||
+	    flex.tokens != piped.tokens || flex.sum != piped.sum) {
+		fprintf(stderr, "token streams differ\n");
+		return 1;
+	}
+	return 0;
+}
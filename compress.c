@@ -0,0 +1,145 @@
+#include <stdint.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+/* Sample size and minimal saving for compress_worthwhile() */
+#define SAMPLE_SIZE (64 * 1024)
+#define SAMPLE_MIN_SAVING_SHIFT 3	/* 1/8 */
+
+#ifdef HAVE_ZSTD
+/* Contexts are expensive to set up, keep one per thread */
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DCtx *zstd_dctx;
+#endif
+
+bool compress_supported(enum compress_algo algo)
+{
+	switch (algo) {
+	case COMPRESS_NONE:
+		return true;
+#ifdef HAVE_LZ4
+	case COMPRESS_LZ4:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+const char *compress_name(enum compress_algo algo)
+{
+	switch (algo) {
+	case COMPRESS_NONE: return "none";
+	case COMPRESS_LZ4: return "lz4";
+	case COMPRESS_ZSTD: return "zstd";
+	}
+	return "unknown";
+}
+
+size_t compress_bound(enum compress_algo algo, size_t len)
+{
+	switch (algo) {
+#ifdef HAVE_LZ4
+	case COMPRESS_LZ4:
+		return LZ4_compressBound(len);
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return ZSTD_compressBound(len);
+#endif
+	default:
+		return len;
+	}
+}
+
+size_t compress_buf(enum compress_algo algo, int level,
+		    const char *src, size_t src_len, char *dst, size_t dst_cap)
+{
+	switch (algo) {
+#ifdef HAVE_LZ4
+	case COMPRESS_LZ4: {
+		int ret;
+
+		if (src_len > LZ4_MAX_INPUT_SIZE)
+			return 0;
+		if (level > 1)
+			ret = LZ4_compress_HC(src, dst, src_len, dst_cap, level);
+		else
+			ret = LZ4_compress_default(src, dst, src_len, dst_cap);
+		return ret > 0 ? ret : 0;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD: {
+		size_t ret;
+
+		if (!zstd_cctx) {
+			zstd_cctx = ZSTD_createCCtx();
+			if (!zstd_cctx)
+				return 0;
+		}
+		ret = ZSTD_compressCCtx(zstd_cctx, dst, dst_cap, src, src_len, level);
+		return ZSTD_isError(ret) ? 0 : ret;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+int decompress_buf(enum compress_algo algo,
+		   const char *src, size_t src_len, char *dst, size_t dst_len)
+{
+	switch (algo) {
+#ifdef HAVE_LZ4
+	case COMPRESS_LZ4: {
+		int ret;
+
+		if (src_len > INT32_MAX || dst_len > INT32_MAX)
+			return -1;
+		ret = LZ4_decompress_safe(src, dst, src_len, dst_len);
+		return ret >= 0 && (size_t)ret == dst_len ? 0 : -1;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD: {
+		size_t ret;
+
+		if (!zstd_dctx) {
+			zstd_dctx = ZSTD_createDCtx();
+			if (!zstd_dctx)
+				return -1;
+		}
+		ret = ZSTD_decompressDCtx(zstd_dctx, dst, dst_len, src, src_len);
+		return !ZSTD_isError(ret) && ret == dst_len ? 0 : -1;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+bool compress_worthwhile(enum compress_algo algo, const char *src, size_t len)
+{
+	char sample[SAMPLE_SIZE + SAMPLE_SIZE / 2];
+	size_t sample_len = len < SAMPLE_SIZE ? len : SAMPLE_SIZE;
+	size_t out;
+
+	/* Take the sample from the middle, the start is often a header */
+	src += (len - sample_len) / 2;
+	out = compress_buf(algo, 1, src, sample_len, sample, sizeof(sample));
+
+	return out && out < sample_len - (sample_len >> SAMPLE_MIN_SAVING_SHIFT);
+}
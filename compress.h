@@ -0,0 +1,33 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum compress_algo {
+	/* defines the binary format */
+	COMPRESS_NONE = 0,
+	COMPRESS_LZ4 = 1,
+	COMPRESS_ZSTD = 2,
+};
+
+/* false if this binary was built without the library */
+extern bool compress_supported(enum compress_algo algo);
+extern const char *compress_name(enum compress_algo algo);
+extern size_t compress_bound(enum compress_algo algo, size_t len);
+
+/*
+ * Compress a sample of the buffer with the fastest setting;
+ * false if it does not shrink enough to be worth compressing all of it.
+ */
+extern bool compress_worthwhile(enum compress_algo algo, const char *src, size_t len);
+
+/* Returns the compressed size, 0 if it does not fit into dst_cap */
+extern size_t compress_buf(enum compress_algo algo, int level,
+			   const char *src, size_t src_len, char *dst, size_t dst_cap);
+
+/* Returns 0 if exactly dst_len bytes were restored, -1 otherwise */
+extern int decompress_buf(enum compress_algo algo,
+			  const char *src, size_t src_len, char *dst, size_t dst_len);
+
+#endif
@@ -0,0 +1,87 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_CRC32
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78	/* reversed */
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t v;
+
+	/* slicing-by-8 */
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^
+		      crc32c_table[6][(v >> 8) & 0xff] ^
+		      crc32c_table[5][(v >> 16) & 0xff] ^
+		      crc32c_table[4][(v >> 24) & 0xff] ^
+		      crc32c_table[3][(v >> 32) & 0xff] ^
+		      crc32c_table[2][(v >> 40) & 0xff] ^
+		      crc32c_table[1][(v >> 48) & 0xff] ^
+		      crc32c_table[0][v >> 56];
+	}
+	for (; len; p++, len--)
+		crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef HAVE_X86_CRC32
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t c = crc, v;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+	for (; len; p++, len--)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *buf, size_t len) = crc32c_sw;
+
+/* Picked once before main(), so threads never race on it */
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^
+					     (crc32c_table[j - 1][i] >> 8);
+
+#ifdef HAVE_X86_CRC32
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32c_impl(crc, buf, len);
+}
@@ -0,0 +1,13 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) update without pre- and post-inversion, like the
+ * kernel's crc32c(). Uses SSE4.2 if the CPU has it.
+ */
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
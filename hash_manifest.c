@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash_manifest.h"
+#include "xxh64.h"
+
+#define HASH_MANIFEST_MAGIC 0x5448494e48415348ULL	/* "THINHASH" */
+/* Each thread reads this much at a time, rounded to whole blocks */
+#define BUILD_READ_SIZE (4 * 1024 * 1024)
+#define BUILD_ALIGN 4096
+
+struct hash_manifest_header {
+	uint64_t magic;
+	uint64_t block_size;
+	uint64_t size;
+	uint64_t n_blocks;
+};
+
+struct build_ctx {
+	struct hash_manifest *m;
+	int fd;
+	uint64_t blocks_per_read;
+	pthread_mutex_t mutex;
+	uint64_t next_block;
+	int err;
+};
+
+int device_size(int fd, uint64_t *size)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb)) {
+		perror("fstat");
+		return -1;
+	}
+	if (S_ISREG(sb.st_mode)) {
+		*size = sb.st_size;
+		return 0;
+	}
+	if (ioctl(fd, BLKGETSIZE64, size)) {
+		perror("ioctl(BLKGETSIZE64)");
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t block_length(const struct hash_manifest *m, uint64_t block)
+{
+	uint64_t begin = block * m->block_size;
+
+	return m->size - begin < m->block_size ? m->size - begin : m->block_size;
+}
+
+static int pread_full(int fd, char *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = EIO;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static void *build_thread(void *arg)
+{
+	struct build_ctx *ctx = arg;
+	struct hash_manifest *m = ctx->m;
+	uint64_t first, n, i, len;
+	char *buf;
+
+	if (posix_memalign((void **)&buf, BUILD_ALIGN, ctx->blocks_per_read * m->block_size)) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->mutex);
+		first = ctx->next_block;
+		ctx->next_block += ctx->blocks_per_read;
+		pthread_mutex_unlock(&ctx->mutex);
+		if (first >= m->n_blocks || ctx->err)
+			break;
+
+		n = m->n_blocks - first < ctx->blocks_per_read ?
+			m->n_blocks - first : ctx->blocks_per_read;
+		len = (n - 1) * m->block_size + block_length(m, first + n - 1);
+		if (pread_full(ctx->fd, buf, len, first * m->block_size)) {
+			fprintf(stderr, "Reading at %llu failed: %m\n",
+				(unsigned long long)(first * m->block_size));
+			ctx->err = -1;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			m->hashes[first + i] = xxh64(buf + i * m->block_size,
+						     block_length(m, first + i), 0);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void hash_manifest_init(struct hash_manifest *m, uint64_t block_size, uint64_t size)
+{
+	char *zeroes;
+
+	m->block_size = block_size;
+	m->size = size;
+	m->n_blocks = (size + block_size - 1) / block_size;
+	m->hashes = calloc(m->n_blocks ? m->n_blocks : 1, sizeof(uint64_t));
+	zeroes = calloc(1, block_size);
+	if (!m->hashes || !zeroes) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	m->zero_hash = xxh64(zeroes, block_size, 0);
+	free(zeroes);
+}
+
+int hash_manifest_build(struct hash_manifest *m, int fd, uint64_t block_size, int n_threads)
+{
+	struct build_ctx ctx = { .m = m, .fd = fd, .mutex = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t *threads;
+	uint64_t size;
+	int i, err;
+
+	if (!block_size || block_size % 512) {
+		fprintf(stderr, "The block size needs to be a multiple of 512\n");
+		return -1;
+	}
+	if (device_size(fd, &size))
+		return -1;
+	hash_manifest_init(m, block_size, size);
+
+	ctx.blocks_per_read = BUILD_READ_SIZE / block_size ? BUILD_READ_SIZE / block_size : 1;
+	if (n_threads < 1)
+		n_threads = 1;
+	threads = calloc(n_threads, sizeof(*threads));
+	if (!threads) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < n_threads; i++) {
+		err = pthread_create(&threads[i], NULL, build_thread, &ctx);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(10);
+		}
+	}
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	if (ctx.err)
+		hash_manifest_free(m);
+	return ctx.err;
+}
+
+int hash_manifest_write(const struct hash_manifest *m, const char *path)
+{
+	struct hash_manifest_header header = {
+		.magic = htobe64(HASH_MANIFEST_MAGIC),
+		.block_size = htobe64(m->block_size),
+		.size = htobe64(m->size),
+		.n_blocks = htobe64(m->n_blocks),
+	};
+	uint64_t i, hash;
+	FILE *f;
+
+	f = fopen(path, "we");
+	if (!f) {
+		fprintf(stderr, "Failed to create %s: %m\n", path);
+		return -1;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	for (i = 0; i < m->n_blocks; i++) {
+		hash = htobe64(m->hashes[i]);
+		fwrite(&hash, sizeof(hash), 1, f);
+	}
+	if (ferror(f) | fclose(f)) {
+		fprintf(stderr, "Failed to write %s: %m\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int hash_manifest_read(struct hash_manifest *m, const char *path)
+{
+	struct hash_manifest_header header;
+	uint64_t block_size, size, i;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %m\n", path);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    be64toh(header.magic) != HASH_MANIFEST_MAGIC)
+		goto invalid;
+	block_size = be64toh(header.block_size);
+	size = be64toh(header.size);
+	if (!block_size || block_size % 512 ||
+	    be64toh(header.n_blocks) != (size + block_size - 1) / block_size)
+		goto invalid;
+
+	hash_manifest_init(m, block_size, size);
+	if (fread(m->hashes, sizeof(uint64_t), m->n_blocks, f) != m->n_blocks ||
+	    fgetc(f) != EOF) {
+		hash_manifest_free(m);
+		goto invalid;
+	}
+	for (i = 0; i < m->n_blocks; i++)
+		m->hashes[i] = be64toh(m->hashes[i]);
+	fclose(f);
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s is not a valid hash manifest\n", path);
+	fclose(f);
+	return -1;
+}
+
+void hash_manifest_free(struct hash_manifest *m)
+{
+	free(m->hashes);
+	m->hashes = NULL;
+}
+
+bool hash_manifest_matches(const struct hash_manifest *m, uint64_t block,
+			   const void *buf, size_t len)
+{
+	return block < m->n_blocks && len == block_length(m, block) &&
+		xxh64(buf, len, 0) == m->hashes[block];
+}
+
+bool hash_manifest_is_zero(const struct hash_manifest *m, uint64_t block, size_t len)
+{
+	bool zero;
+	char *zeroes;
+
+	if (block >= m->n_blocks || len != block_length(m, block))
+		return false;
+	if (len == m->block_size)
+		return m->hashes[block] == m->zero_hash;
+
+	/* only the last block can be shorter */
+	zeroes = calloc(1, len);
+	if (!zeroes) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	zero = xxh64(zeroes, len, 0) == m->hashes[block];
+	free(zeroes);
+	return zero;
+}
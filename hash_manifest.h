@@ -0,0 +1,36 @@
+#ifndef HASH_MANIFEST_H
+#define HASH_MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One XXH64 per block of a volume, taken on the receiving side so that
+ * thin_send can leave out the blocks the target already holds. The last
+ * block may be shorter than block_size.
+ */
+struct hash_manifest {
+	uint64_t block_size;
+	uint64_t size;
+	uint64_t n_blocks;
+	uint64_t zero_hash;	/* of a full block of zeroes */
+	uint64_t *hashes;
+};
+
+/* Size of a block device or regular file; -1 with a message on stderr */
+extern int device_size(int fd, uint64_t *size);
+
+/* Reads all of fd with n_threads threads; fd may be opened with O_DIRECT */
+extern int hash_manifest_build(struct hash_manifest *m, int fd, uint64_t block_size, int n_threads);
+extern int hash_manifest_write(const struct hash_manifest *m, const char *path);
+extern int hash_manifest_read(struct hash_manifest *m, const char *path);
+extern void hash_manifest_free(struct hash_manifest *m);
+
+/* buf holds all of the block, which starts at block * block_size */
+extern bool hash_manifest_matches(const struct hash_manifest *m, uint64_t block,
+				  const void *buf, size_t len);
+/* Whether len bytes from the start of block are known to be zero */
+extern bool hash_manifest_is_zero(const struct hash_manifest *m, uint64_t block, size_t len);
+
+#endif
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/dm-ioctl.h>
+
+#include "lv_lookup.h"
+
+#define DM_IOCTL_BUFFER_SIZE (16 * 1024)
+
+struct lookup_cache_entry {
+	char *name;
+	struct snap_info info;
+};
+
+static struct lookup_cache_entry *lookup_cache;
+static int n_lookup_cache;
+
+static char *xasprintf(const char *fmt, ...)
+{
+	va_list ap;
+	char *str;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vasprintf(&str, fmt, ap);
+	va_end(ap);
+	if (ret == -1) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	return str;
+}
+
+/* LVM doubles dashes in VG and LV names to build the device-mapper name */
+static char *dm_mangle(const char *name)
+{
+	char *out = malloc(2 * strlen(name) + 1), *o = out;
+
+	if (!out) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (; *name; name++) {
+		*o++ = *name;
+		if (*name == '-')
+			*o++ = '-';
+	}
+	*o = 0;
+	return out;
+}
+
+/* Splits a device-mapper name at the first single dash */
+static bool dm_split(const char *dm_name, char **vg, char **lv)
+{
+	const char *p;
+	char *o;
+
+	for (p = dm_name; *p; p++) {
+		if (*p != '-')
+			continue;
+		if (p[1] == '-') {
+			p++;
+			continue;
+		}
+		break;
+	}
+	if (!*p || p == dm_name || !p[1])
+		return false;
+
+	*vg = strndup(dm_name, p - dm_name);
+	*lv = strdup(p + 1);
+	for (o = *vg; o && *o; o++)
+		if (o[0] == '-' && o[1] == '-')
+			memmove(o + 1, o + 2, strlen(o + 2) + 1);
+	for (o = *lv; o && *o; o++)
+		if (o[0] == '-' && o[1] == '-')
+			memmove(o + 1, o + 2, strlen(o + 2) + 1);
+	return *vg && *lv;
+}
+
+/* Turns the accepted spellings of an LV into its VG and LV name */
+static bool parse_lv_name(const char *name, char **vg, char **lv)
+{
+	const char *slash;
+
+	if (!strncmp(name, "/dev/", 5))
+		name += 5;
+	if (!strncmp(name, "mapper/", 7))
+		return dm_split(name + 7, vg, lv);
+
+	slash = strchr(name, '/');
+	if (!slash || slash == name || !slash[1] || strchr(slash + 1, '/'))
+		return false;
+	*vg = strndup(name, slash - name);
+	*lv = strdup(slash + 1);
+	return *vg && *lv;
+}
+
+static char *read_sysfs_line(const char *path)
+{
+	char buf[256];
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f)
+		return NULL;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = 0;
+	return strdup(buf);
+}
+
+/* The single target's table (or status) of an active device into io */
+static int dm_table_status(const char *dm_name, bool table, struct dm_ioctl *io)
+{
+	int fd, ret;
+
+	if (strlen(dm_name) >= sizeof(io->name))
+		return -1;
+	fd = open("/dev/mapper/control", O_RDWR | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	memset(io, 0, sizeof(*io));
+	io->version[0] = DM_VERSION_MAJOR;
+	io->version[1] = 0;
+	io->version[2] = 0;
+	io->data_size = DM_IOCTL_BUFFER_SIZE;
+	io->data_start = sizeof(*io);
+	io->flags = table ? DM_STATUS_TABLE_FLAG : 0;
+	strcpy(io->name, dm_name);
+	ret = ioctl(fd, DM_TABLE_STATUS, io);
+	close(fd);
+
+	if (ret == -1 || io->flags & DM_BUFFER_FULL_FLAG || io->target_count != 1)
+		return -1;
+	return 0;
+}
+
+/*
+ * An active thin LV has a table with a single "thin" target, which names
+ * the pool's -tpool device and the thin id. Inactive LVs (like snapshots
+ * with the activation skip flag) have no device and need lvs.
+ */
+static bool lookup_dm(const char *vg, const char *lv, struct snap_info *info)
+{
+	char *mangled_vg = dm_mangle(vg), *mangled_lv = dm_mangle(lv);
+	char *dm_name = NULL, *pool_dm_name = NULL, *sysfs_path = NULL;
+	struct dm_target_spec *spec;
+	unsigned int major, minor;
+	struct dm_ioctl *io;
+	size_t prefix_len, len;
+	bool ok = false;
+	int thin_id;
+
+	io = calloc(1, DM_IOCTL_BUFFER_SIZE);
+	if (!io) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	dm_name = xasprintf("%s-%s", mangled_vg, mangled_lv);
+
+	if (dm_table_status(dm_name, true, io) || strncmp(io->uuid, "LVM-", 4))
+		goto out;
+	spec = (struct dm_target_spec *)((char *)io + io->data_start);
+	if (strncmp(spec->target_type, "thin", sizeof(spec->target_type)) ||
+	    sscanf((char *)(spec + 1), "%u:%u %d", &major, &minor, &thin_id) != 3)
+		goto out;
+
+	sysfs_path = xasprintf("/sys/dev/block/%u:%u/dm/name", major, minor);
+	pool_dm_name = read_sysfs_line(sysfs_path);
+	if (!pool_dm_name)
+		goto out;
+
+	/* "<vg>-<pool>-tpool" */
+	prefix_len = strlen(mangled_vg) + 1;
+	len = strlen(pool_dm_name);
+	if (len <= prefix_len + strlen("-tpool") ||
+	    strncmp(pool_dm_name, mangled_vg, prefix_len - 1) || pool_dm_name[prefix_len - 1] != '-' ||
+	    strcmp(pool_dm_name + len - strlen("-tpool"), "-tpool"))
+		goto out;
+	pool_dm_name[len - strlen("-tpool")] = 0;
+	{
+		char *pool_vg, *pool_lv;
+
+		if (!dm_split(pool_dm_name, &pool_vg, &pool_lv) || strcmp(pool_vg, vg))
+			goto out;
+		free(pool_vg);
+		info->thin_pool_name = pool_lv;
+	}
+
+	info->vg_name = strdup(vg);
+	info->lv_name = strdup(lv);
+	info->dm_path = xasprintf("/dev/mapper/%s", dm_name);
+	info->thin_id = thin_id;
+	info->active = true;
+	ok = true;
+out:
+	free(io);
+	free(dm_name);
+	free(pool_dm_name);
+	free(sysfs_path);
+	free(mangled_vg);
+	free(mangled_lv);
+	return ok;
+}
+
+/*
+ * One lvs call for all the unresolved names. A name without VG/LV split
+ * (vgs[i] NULL) takes the first line, so such names go in a call of their own.
+ */
+static void lookup_lvs(const char *const *names, int n, char **vgs, char **lvs,
+		       struct snap_info *infos, bool *resolved)
+{
+	char *cmdline, *args = strdup(""), *line = NULL, *attr;
+	size_t line_size = 0;
+	int i, matches;
+	FILE *f;
+
+	for (i = 0; i < n; i++) {
+		char *a;
+
+		if (resolved[i])
+			continue;
+		a = xasprintf("%s %s", args, names[i]);
+		free(args);
+		args = a;
+	}
+	cmdline = xasprintf("lvs --noheadings -o vg_name,lv_name,pool_lv,lv_dm_path,thin_id,attr%s",
+			    args);
+	f = popen(cmdline, "r");
+	if (!f) {
+		perror("popen failed");
+		exit(10);
+	}
+
+	while (getline(&line, &line_size, f) != -1) {
+		struct snap_info info;
+		bool used = false;
+
+		matches = sscanf(line, " %ms %ms %ms %ms %d %ms",
+				 &info.vg_name,
+				 &info.lv_name,
+				 &info.thin_pool_name,
+				 &info.dm_path,
+				 &info.thin_id,
+				 &attr);
+		if (matches != 6 || strlen(attr) < 5) {
+			fprintf(stderr, "failed to parse lvs output %d cmdline=%s\n", matches, cmdline);
+			exit(10);
+		}
+		info.active = attr[4] == 'a';
+		free(attr);
+
+		/* lvs sorts its output */
+		for (i = 0; i < n; i++) {
+			if (resolved[i])
+				continue;
+			if (vgs[i] && (strcmp(vgs[i], info.vg_name) || strcmp(lvs[i], info.lv_name)))
+				continue;
+			infos[i] = info;
+			resolved[i] = used = true;
+		}
+		if (!used) {
+			free(info.vg_name);
+			free(info.lv_name);
+			free(info.thin_pool_name);
+			free(info.dm_path);
+		}
+	}
+	pclose(f);
+
+	for (i = 0; i < n; i++) {
+		if (!resolved[i]) {
+			fprintf(stderr, "failed to parse lvs output for %s cmdline=%s\n",
+				names[i], cmdline);
+			exit(10);
+		}
+	}
+	free(line);
+	free(args);
+	free(cmdline);
+}
+
+void lookup_snaps(const char *const *names, int n, struct snap_info *infos)
+{
+	char **vgs, **lvs;
+	bool *resolved, *cached, need_lvs = false;
+	int i, j;
+
+	vgs = calloc(n, sizeof(*vgs));
+	lvs = calloc(n, sizeof(*lvs));
+	resolved = calloc(n, sizeof(*resolved));
+	cached = calloc(n, sizeof(*cached));
+	if (!vgs || !lvs || !resolved || !cached) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n_lookup_cache; j++) {
+			if (!strcmp(lookup_cache[j].name, names[i])) {
+				infos[i] = lookup_cache[j].info;
+				resolved[i] = cached[i] = true;
+				break;
+			}
+		}
+		if (resolved[i])
+			continue;
+		if (!parse_lv_name(names[i], &vgs[i], &lvs[i])) {
+			free(vgs[i]);
+			free(lvs[i]);
+			vgs[i] = lvs[i] = NULL;
+		} else {
+			resolved[i] = lookup_dm(vgs[i], lvs[i], &infos[i]);
+		}
+		if (!resolved[i] && !vgs[i])
+			lookup_lvs(&names[i], 1, &vgs[i], &lvs[i], &infos[i], &resolved[i]);
+		need_lvs |= !resolved[i];
+	}
+	if (need_lvs)
+		lookup_lvs(names, n, vgs, lvs, infos, resolved);
+
+	lookup_cache = realloc(lookup_cache, (n_lookup_cache + n) * sizeof(*lookup_cache));
+	if (!lookup_cache) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < n; i++) {
+		if (!cached[i]) {
+			lookup_cache[n_lookup_cache].name = strdup(names[i]);
+			lookup_cache[n_lookup_cache].info = infos[i];
+			n_lookup_cache++;
+		}
+		free(vgs[i]);
+		free(lvs[i]);
+	}
+	free(vgs);
+	free(lvs);
+	free(resolved);
+	free(cached);
+}
+
+char *lookup_thin_pool_dm_path(const struct snap_info *snap)
+{
+	char *mangled_vg = dm_mangle(snap->vg_name), *mangled_pool = dm_mangle(snap->thin_pool_name);
+	char *path = xasprintf("/dev/mapper/%s-%s", mangled_vg, mangled_pool);
+
+	free(mangled_vg);
+	free(mangled_pool);
+	return path;
+}
+
+int pool_transaction_id(const char *thin_pool_dm_path, uint64_t *trans_id)
+{
+	const char *pool = strrchr(thin_pool_dm_path, '/');
+	unsigned long long id;
+	struct dm_ioctl *io;
+	char *dm_name;
+	int ret = -1;
+
+	io = calloc(1, DM_IOCTL_BUFFER_SIZE);
+	if (!io) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	dm_name = xasprintf("%s-tpool", pool ? pool + 1 : thin_pool_dm_path);
+
+	/* "<transaction id> <used>/<total metadata blocks> ..." */
+	if (!dm_table_status(dm_name, false, io) &&
+	    sscanf((char *)io + io->data_start + sizeof(struct dm_target_spec), "%llu", &id) == 1) {
+		*trans_id = id;
+		ret = 0;
+	}
+	free(dm_name);
+	free(io);
+	return ret;
+}
+
+int pool_data_block_size(const char *thin_pool_dm_path, uint64_t *bytes)
+{
+	const char *pool = strrchr(thin_pool_dm_path, '/');
+	unsigned long long sectors;
+	struct dm_ioctl *io;
+	char *dm_name;
+	int ret = -1;
+
+	io = calloc(1, DM_IOCTL_BUFFER_SIZE);
+	if (!io) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	dm_name = xasprintf("%s-tpool", pool ? pool + 1 : thin_pool_dm_path);
+
+	/* "<metadata dev> <data dev> <data block size> <low water mark> ..." */
+	if (!dm_table_status(dm_name, true, io) &&
+	    sscanf((char *)io + io->data_start + sizeof(struct dm_target_spec),
+		   "%*s %*s %llu", &sectors) == 1) {
+		*bytes = sectors * 512;
+		ret = 0;
+	}
+	free(dm_name);
+	free(io);
+	return ret;
+}
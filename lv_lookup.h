@@ -0,0 +1,34 @@
+#ifndef LV_LOOKUP_H
+#define LV_LOOKUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct snap_info {
+	char *vg_name;
+	char *lv_name;
+	char *thin_pool_name;
+	char *dm_path;
+	int thin_id;
+	bool active;
+};
+
+/*
+ * Resolves thin LVs ("vg/lv", "/dev/vg/lv" or "/dev/mapper/vg-lv").
+ * Active ones are looked up in their device-mapper table, all others
+ * with a single lvs call; names in other spellings get an lvs call each.
+ * Results are cached for the rest of the run.
+ * Exits if a name can not be resolved.
+ */
+extern void lookup_snaps(const char *const *names, int n, struct snap_info *infos);
+
+/* The pool LV's device, e.g. /dev/mapper/vg-pool; callers append -tpool or _tmeta */
+extern char *lookup_thin_pool_dm_path(const struct snap_info *snap);
+
+/* From the status of the pool's -tpool device; -1 if it is not active */
+extern int pool_transaction_id(const char *thin_pool_dm_path, uint64_t *trans_id);
+
+/* From the table of the pool's -tpool device; -1 if it is not active */
+extern int pool_data_block_size(const char *thin_pool_dm_path, uint64_t *bytes);
+
+#endif
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "net.h"
+
+#define LISTEN_BACKLOG 64
+
+/* Splits addr into a copy of host (NULL if empty) and a pointer to the port */
+static void split_addr(const char *addr, char **host, const char **port)
+{
+	const char *colon = strrchr(addr, ':');
+	const char *begin = addr, *end;
+
+	if (!colon) {
+		*host = NULL;
+		*port = addr;
+		return;
+	}
+	end = colon;
+	if (*begin == '[' && end > begin && end[-1] == ']') {
+		begin++;
+		end--;
+	}
+	*port = colon + 1;
+	*host = end > begin ? strndup(begin, end - begin) : NULL;
+	if (end > begin && !*host) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+}
+
+static struct addrinfo *resolve(const char *addr, bool passive)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = passive ? AI_PASSIVE : 0,
+	};
+	struct addrinfo *res;
+	const char *port;
+	char *host;
+	int err;
+
+	split_addr(addr, &host, &port);
+	if (!*port) {
+		fprintf(stderr, "No port in \"%s\"\n", addr);
+		free(host);
+		return NULL;
+	}
+	err = getaddrinfo(host, port, &hints, &res);
+	free(host);
+	if (err) {
+		fprintf(stderr, "Cannot resolve \"%s\": %s\n", addr, gai_strerror(err));
+		return NULL;
+	}
+	return res;
+}
+
+/* Beyond net.core.[rw]mem_max only for root, with the FORCE variants */
+static void set_buffers(int fd, size_t buf_size)
+{
+	int size = buf_size;
+
+	if (!buf_size)
+		return;
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)))
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+int net_listen(const char *addr, size_t buf_size)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1, one = 1, err = 0;
+
+	res = resolve(addr, true);
+	if (!res)
+		return -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd == -1) {
+			err = errno;
+			continue;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		/* before listen(), so that accepted sockets get a large window */
+		set_buffers(fd, buf_size);
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, LISTEN_BACKLOG))
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		fprintf(stderr, "Cannot listen on \"%s\": %s\n", addr, strerror(err));
+	return fd;
+}
+
+int net_accept(int listen_fd)
+{
+	int fd;
+
+	do {
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	} while (fd == -1 && errno == EINTR);
+	if (fd == -1)
+		perror("accept()");
+	return fd;
+}
+
+int net_connect(const char *addr, size_t buf_size)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1, err = 0;
+
+	res = resolve(addr, false);
+	if (!res)
+		return -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd == -1) {
+			err = errno;
+			continue;
+		}
+		set_buffers(fd, buf_size);
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd == -1)
+		fprintf(stderr, "Cannot connect to \"%s\": %s\n", addr, strerror(err));
+	return fd;
+}
@@ -0,0 +1,16 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+
+/*
+ * TCP sockets for thin_send --connect and thin_recv --listen. Addresses
+ * are "host:port" or "[v6 address]:port"; listening, the host may be left
+ * out for all addresses. buf_size sets the send and receive buffers.
+ * All return -1 with a message on stderr.
+ */
+extern int net_listen(const char *addr, size_t buf_size);
+extern int net_accept(int listen_fd);
+extern int net_connect(const char *addr, size_t buf_size);
+
+#endif
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "report.h"
+
+static const char *const phase_names[N_PHASES] = {
+	[PHASE_LOOKUP] = "lookup",
+	[PHASE_LOCK_WAIT] = "lock_wait",
+	[PHASE_MD_SNAP_HOLD] = "metadata_snap_hold",
+	[PHASE_METADATA_TOOL] = "metadata_tool",
+	[PHASE_PARSE] = "parse",
+	[PHASE_DEVICE_READ] = "device_read",
+	[PHASE_DEVICE_WRITE] = "device_write",
+	[PHASE_STREAM_READ] = "stream_read",
+	[PHASE_STREAM_WRITE] = "stream_write",
+};
+
+/* Updated from any thread, so only touched with __atomic builtins */
+static struct {
+	uint64_t ns[N_PHASES];
+	uint64_t bytes[N_PHASES];
+	uint64_t planned_extents, planned_bytes;
+	uint64_t done_extents, done_bytes;
+	int scans;
+} counters;
+
+static uint64_t start_time;
+
+static struct {
+	const char *name;
+	unsigned int interval;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool running;
+	bool stop;
+} progress = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+uint64_t report_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The run starts when the program does, as far as we can tell */
+__attribute__((constructor))
+static void report_init(void)
+{
+	start_time = report_now();
+}
+
+void phase_add(enum phase phase, uint64_t start, uint64_t bytes)
+{
+	__atomic_add_fetch(&counters.ns[phase], report_now() - start, __ATOMIC_RELAXED);
+	if (bytes)
+		__atomic_add_fetch(&counters.bytes[phase], bytes, __ATOMIC_RELAXED);
+}
+
+void progress_plan(bool data, uint64_t bytes)
+{
+	__atomic_add_fetch(&counters.planned_extents, 1, __ATOMIC_RELAXED);
+	if (data)
+		__atomic_add_fetch(&counters.planned_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_done(bool data, uint64_t bytes)
+{
+	__atomic_add_fetch(&counters.done_extents, 1, __ATOMIC_RELAXED);
+	if (data)
+		__atomic_add_fetch(&counters.done_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void progress_scan(int delta)
+{
+	__atomic_add_fetch(&counters.scans, delta, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static const char *format_size(char *buf, size_t size, double bytes)
+{
+	static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+	unsigned int i = 0;
+
+	while (bytes >= 1024 && i < sizeof(units) / sizeof(units[0]) - 1) {
+		bytes /= 1024;
+		i++;
+	}
+	snprintf(buf, size, i ? "%.1f %s" : "%.0f %s", bytes, units[i]);
+	return buf;
+}
+
+static void print_progress(uint64_t *last_bytes, uint64_t *last_time)
+{
+	uint64_t now = report_now(), done = load(&counters.done_bytes);
+	uint64_t planned = load(&counters.planned_bytes);
+	uint64_t extents = load(&counters.done_extents);
+	uint64_t planned_extents = load(&counters.planned_extents);
+	double interval = (now - *last_time) / 1e9, elapsed = (now - start_time) / 1e9;
+	double rate = interval > 0 ? (done - *last_bytes) / interval : 0;
+	char a[32], b[32], r[32];
+	bool final = !__atomic_load_n(&counters.scans, __ATOMIC_RELAXED);
+
+	if (planned_extents) {
+		fprintf(stderr, "%s: %s of %s%s, %"PRIu64" of %"PRIu64" extents, %s/s",
+			progress.name, format_size(a, sizeof(a), done),
+			final ? "" : "at least ", format_size(b, sizeof(b), planned),
+			extents, planned_extents, format_size(r, sizeof(r), rate));
+		/* from the average so far, the current rate jumps around */
+		if (final && done && planned >= done) {
+			uint64_t eta = (planned - done) * elapsed / done;
+
+			fprintf(stderr, ", ETA %"PRIu64"m%02"PRIu64"s", eta / 60, eta % 60);
+		}
+		fputc('\n', stderr);
+	} else {
+		fprintf(stderr, "%s: %s in %"PRIu64" chunks, %s/s\n",
+			progress.name, format_size(a, sizeof(a), done), extents,
+			format_size(r, sizeof(r), rate));
+	}
+	*last_bytes = done;
+	*last_time = now;
+}
+
+static void *progress_thread(void *arg)
+{
+	uint64_t last_bytes = 0, last_time = report_now();
+	struct timespec deadline;
+
+	pthread_mutex_lock(&progress.mutex);
+	while (!progress.stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += progress.interval;
+		while (!progress.stop &&
+		       pthread_cond_timedwait(&progress.cond, &progress.mutex, &deadline) != ETIMEDOUT)
+			;
+		print_progress(&last_bytes, &last_time);
+	}
+	pthread_mutex_unlock(&progress.mutex);
+	return NULL;
+}
+
+void progress_start(const char *name, unsigned int interval)
+{
+	int err;
+
+	progress.name = name;
+	progress.interval = interval;
+	err = pthread_create(&progress.thread, NULL, progress_thread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		return;
+	}
+	progress.running = true;
+}
+
+/* The last report is the final tally */
+void progress_stop(void)
+{
+	if (!progress.running)
+		return;
+	pthread_mutex_lock(&progress.mutex);
+	progress.stop = true;
+	pthread_cond_signal(&progress.cond);
+	pthread_mutex_unlock(&progress.mutex);
+	pthread_join(progress.thread, NULL);
+	progress.running = false;
+}
+
+int report_write_json(const char *path, const char *name)
+{
+	double wall = (report_now() - start_time) / 1e9;
+	FILE *f;
+	int i;
+
+	f = fopen(path, "we");
+	if (!f) {
+		fprintf(stderr, "Failed to create %s: %m\n", path);
+		return -1;
+	}
+	fprintf(f, "{\n  \"program\": \"%s\",\n  \"wall_seconds\": %.6f,\n", name, wall);
+	fprintf(f, "  \"extents\": { \"planned\": %"PRIu64", \"done\": %"PRIu64" },\n",
+		load(&counters.planned_extents), load(&counters.done_extents));
+	fprintf(f, "  \"data_bytes\": { \"planned\": %"PRIu64", \"done\": %"PRIu64" },\n",
+		load(&counters.planned_bytes), load(&counters.done_bytes));
+	fputs("  \"phases\": {\n", f);
+	for (i = 0; i < N_PHASES; i++)
+		fprintf(f, "    \"%s\": { \"seconds\": %.6f, \"bytes\": %"PRIu64" }%s\n",
+			phase_names[i], load(&counters.ns[i]) / 1e9, load(&counters.bytes[i]),
+			i < N_PHASES - 1 ? "," : "");
+	fputs("  }\n}\n", f);
+
+	if (ferror(f) | fclose(f)) {
+		fprintf(stderr, "Failed to write %s: %m\n", path);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Where the time goes, for --stats-json. Phases that run on several
+ * threads at once add up the time of all of them. A transfer that moves
+ * data between device and stream in one splice() counts as stream time.
+ */
+enum phase {
+	PHASE_LOOKUP,		/* resolving the LVs */
+	PHASE_LOCK_WAIT,	/* for the pool's lock files */
+	PHASE_MD_SNAP_HOLD,	/* from reserving the metadata snapshot to releasing it */
+	PHASE_METADATA_TOOL,	/* thin_delta/thin_dump running */
+	PHASE_PARSE,		/* metadata into extents */
+	PHASE_DEVICE_READ,
+	PHASE_DEVICE_WRITE,
+	PHASE_STREAM_READ,
+	PHASE_STREAM_WRITE,
+	N_PHASES
+};
+
+/* CLOCK_MONOTONIC in ns, as start for phase_add() */
+extern uint64_t report_now(void);
+/* Accounts the time since start, and bytes if the phase moves data */
+extern void phase_add(enum phase phase, uint64_t start, uint64_t bytes);
+
+/*
+ * Progress in extents and in bytes of data. The sender plans the extents
+ * it parsed and marks them done as it sends them; scans in flight mean
+ * the total is not final yet.
+ */
+extern void progress_plan(bool data, uint64_t bytes);
+extern void progress_done(bool data, uint64_t bytes);
+extern void progress_scan(int delta);
+
+/* Reports on stderr every interval seconds, until progress_stop() */
+extern void progress_start(const char *name, unsigned int interval);
+extern void progress_stop(void);
+
+extern int report_write_json(const char *path, const char *name);
+
+#endif
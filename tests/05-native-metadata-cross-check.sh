@@ -0,0 +1,42 @@
+#!/bin/bash
+# the extents read from the metadata snapshot directly must match
+# what thin_delta and thin_dump report
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+
+for i in $(seq 0 19); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+
+for i in $(seq 0 9); do
+    dd if=<(echo "hi again") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+blkdiscard --offset $(( ($RANDOM % 1600) * 65536 )) --length 65536 /dev/$VG/tlv_source
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source1
+
+./thin_send --print-extents /dev/$VG/snap_source1 2> native.err > native.txt
+./thin_send --print-extents --metadata-tool /dev/$VG/snap_source1 > tool.txt
+[ -s native.txt ] && ! grep -q "falling back" native.err
+cmp native.txt tool.txt
+
+./thin_send --print-extents /dev/$VG/snap_source0 /dev/$VG/snap_source1 2> native.err > native.txt
+./thin_send --print-extents --metadata-tool /dev/$VG/snap_source0 /dev/$VG/snap_source1 > tool.txt
+[ -s native.txt ] && ! grep -q "falling back" native.err
+cmp native.txt tool.txt
+
+rm -f native.txt native.err tool.txt
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/snap_source1
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tpool
+
+exit 0
@@ -0,0 +1,50 @@
+#!/bin/bash
+# one batch stream carries a full copy and a diff to two targets
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target1 $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target2 $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+./thin_send /dev/$VG/snap_source0 | ./thin_recv /dev/$VG/tlv_target2
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi again") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source1
+
+cat > manifest <<MANIFEST
+# full copy
+$VG/snap_source1 $VG/tlv_target1
+# incremental, on top of the earlier copy
+$VG/snap_source0 $VG/snap_source1 $VG/tlv_target2
+MANIFEST
+./thin_send --batch manifest | ./thin_recv --batch
+rm manifest
+
+md5_source=($(md5sum /dev/$VG/snap_source1))
+md5_target1=($(md5sum /dev/$VG/tlv_target1))
+md5_target2=($(md5sum /dev/$VG/tlv_target2))
+
+[ "$md5_source" = "$md5_target1" ] || exit 10
+[ "$md5_source" = "$md5_target2" ] || exit 10
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/snap_source1
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target1
+lvremove --force /dev/$VG/tlv_target2
+lvremove --force /dev/$VG/tpool
+
+exit 0
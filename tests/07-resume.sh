@@ -0,0 +1,50 @@
+#!/bin/bash
+# a transfer cut short continues from the receiver's checkpoint
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 32M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 39); do
+    dd if=/dev/urandom of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+# one extent much larger than a chunk, from 64M to 72M
+dd if=/dev/urandom of=/dev/$VG/tlv_source bs=1M count=8 seek=64 oflag=direct
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+
+rm -f checkpoint
+! ./thin_send --resumable /dev/$VG/snap_source0 | head -c 1500000 |
+    ./thin_recv --checkpoint checkpoint --checkpoint-interval 256K /dev/$VG/tlv_target
+[ -s checkpoint ]
+
+./thin_send --resume $(cat checkpoint) /dev/$VG/snap_source0 |
+    ./thin_recv --checkpoint checkpoint /dev/$VG/tlv_target
+[ ! -e checkpoint ]
+
+# cut inside the large extent, the checkpoint still lands within it
+! ./thin_send --resumable /dev/$VG/snap_source0 | head -c 6000000 |
+    ./thin_recv --checkpoint checkpoint --checkpoint-interval 1M /dev/$VG/tlv_target
+offset=$(cut -d: -f2 checkpoint)
+[ "$offset" -gt $((64 << 20)) ] && [ "$offset" -lt $((72 << 20)) ]
+
+./thin_send --resume $(cat checkpoint) /dev/$VG/snap_source0 |
+    ./thin_recv --checkpoint checkpoint /dev/$VG/tlv_target
+[ ! -e checkpoint ]
+
+md5_source=($(md5sum /dev/$VG/snap_source0))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
@@ -0,0 +1,40 @@
+#!/bin/bash
+# checksummed streams apply cleanly, a corrupted one is refused unwritten
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+./thin_send --checksum /dev/$VG/snap_source0 > stream
+
+# inside the payload of the first DATA chunk, after BEGIN_STREAM and CHECKSUM
+printf '\xff' | dd of=stream bs=1 seek=200 conv=notrunc
+! ./thin_recv /dev/$VG/tlv_target < stream 2> err
+grep -q "Checksum mismatch" err
+# the corrupt chunk was refused before any of it was written
+cmp -n $((100 << 20)) /dev/$VG/tlv_target /dev/zero
+
+./thin_send --checksum /dev/$VG/snap_source0 | ./thin_recv /dev/$VG/tlv_target
+rm stream err
+
+md5_source=($(md5sum /dev/$VG/snap_source0))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
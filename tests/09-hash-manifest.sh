@@ -0,0 +1,38 @@
+#!/bin/bash
+# with the target's hash manifest, only the blocks that differ are sent
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+./thin_send /dev/$VG/tlv_source | ./thin_recv /dev/$VG/tlv_target
+
+# one block changed, one written only on the target, which the source reads as zeroes
+dd if=<(echo "changed") of=/dev/$VG/tlv_source bs=64k count=1 seek=1590 oflag=direct
+dd if=<(echo "stale") of=/dev/$VG/tlv_target bs=64k count=1 seek=1595 oflag=direct
+
+./thin_recv --hash-manifest hashes /dev/$VG/tlv_target
+full=$(./thin_send /dev/$VG/tlv_source | wc -c)
+./thin_send --hash-manifest hashes /dev/$VG/tlv_source > stream
+[ $(stat -c %s stream) -lt $((full / 2)) ] || exit 10
+./thin_recv /dev/$VG/tlv_target < stream
+rm stream hashes
+
+md5_source=($(md5sum /dev/$VG/tlv_source))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
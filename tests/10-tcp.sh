@@ -0,0 +1,36 @@
+#!/bin/bash
+# a stream striped over several TCP connections on loopback
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+
+port=$((20000 + $RANDOM % 10000))
+./thin_recv --listen 127.0.0.1:$port /dev/$VG/tlv_target &
+recv=$!
+sleep 1
+./thin_send --connect 127.0.0.1:$port --connections 4 /dev/$VG/snap_source0
+wait $recv
+
+md5_source=($(md5sum /dev/$VG/snap_source0))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
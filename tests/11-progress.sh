@@ -0,0 +1,32 @@
+#!/bin/bash
+# progress reports and the timing summary of both sides
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+./thin_send --progress=1 --stats-json send.json /dev/$VG/snap_source0 2> progress |
+    ./thin_recv --stats-json recv.json /dev/$VG/tlv_target
+
+grep -q "thin_send: .* of .* extents" progress
+grep -q '"program": "thin_send"' send.json
+grep -q '"metadata_snap_hold"' send.json
+grep -q '"stream_read"' recv.json
+rm progress send.json recv.json
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
@@ -0,0 +1,45 @@
+#!/bin/bash
+# an indexed stream file restores in parallel, and in part with --range
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_part $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+dd if=<(echo "in range") of=/dev/$VG/tlv_source bs=64k count=1 seek=20 oflag=direct
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+./thin_send --index --checksum /dev/$VG/snap_source0 > archive
+
+# a plain thin_recv skips the index
+./thin_recv /dev/$VG/tlv_target < archive
+md5_source=($(md5sum /dev/$VG/snap_source0))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+blkdiscard /dev/$VG/tlv_target
+./thin_recv --archive archive --writers 4 /dev/$VG/tlv_target
+md5_target=($(md5sum /dev/$VG/tlv_target))
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+./thin_recv --archive archive --range 1M:1M /dev/$VG/tlv_part
+cmp <(dd if=/dev/$VG/snap_source0 bs=1M skip=1 count=1) <(dd if=/dev/$VG/tlv_part bs=1M skip=1 count=1)
+grep -q "in range" /dev/$VG/tlv_part
+! cmp -s /dev/$VG/snap_source0 /dev/$VG/tlv_part
+rm archive
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tlv_part
+lvremove --force /dev/$VG/tpool
+
+exit 0
@@ -0,0 +1,48 @@
+#!/bin/bash
+# a full stream and incrementals squashed into one give the same volume
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+dd if=<(echo "overwritten") of=/dev/$VG/tlv_source bs=64k count=1 seek=10 oflag=direct
+dd if=<(echo "discarded") of=/dev/$VG/tlv_source bs=64k count=1 seek=11 oflag=direct
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source0
+./thin_send /dev/$VG/snap_source0 > stream0
+
+dd if=<(echo "written last") of=/dev/$VG/tlv_source bs=64k count=1 seek=10 oflag=direct
+blkdiscard -o $((11 * 65536)) -l 65536 /dev/$VG/tlv_source
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source1
+./thin_send /dev/$VG/snap_source0 /dev/$VG/snap_source1 > stream1
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi again") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source2
+./thin_send /dev/$VG/snap_source1 /dev/$VG/snap_source2 > stream2
+
+./thin_send --squash stream0 stream1 stream2 | ./thin_recv /dev/$VG/tlv_target
+rm stream0 stream1 stream2
+
+md5_source=($(md5sum /dev/$VG/snap_source2))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+lvremove --force /dev/$VG/snap_source0
+lvremove --force /dev/$VG/snap_source1
+lvremove --force /dev/$VG/snap_source2
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
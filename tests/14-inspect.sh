@@ -0,0 +1,34 @@
+#!/bin/bash
+# --inspect accepts a stream from a file and a pipe alike, rejects a truncated one
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source
+./thin_send --checksum /dev/$VG/snap_source > stream
+
+./thin_recv --inspect < stream > report_file
+cat stream | ./thin_recv --inspect > report_pipe
+cmp report_file report_pipe
+grep -q "^data [1-9]" report_file
+
+head -c -100 stream > stream_truncated
+if ./thin_recv --inspect < stream_truncated; then
+    exit 10
+fi
+rm stream stream_truncated report_file report_pipe
+
+lvremove --force /dev/$VG/snap_source
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tpool
+
+exit 0
@@ -0,0 +1,31 @@
+#!/bin/bash
+# receiving with --io-engine direct gives the same volume
+
+set -o errexit
+set -o pipefail
+
+[ -z "$VG" ] && exit 10
+
+lvcreate --type thin-pool -L 12M --thinpool tpool $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_source $VG
+lvcreate --type thin -V 100M --thinpool tpool -n tlv_target $VG
+
+for i in $(seq 0 4); do
+    dd if=<(echo "hi there") of=/dev/$VG/tlv_source bs=64k count=1 seek=$(($RANDOM % 1600)) oflag=direct
+done
+dd if=/dev/urandom of=/dev/$VG/tlv_source bs=4k count=300 seek=2000 oflag=direct
+
+lvcreate --snapshot /dev/$VG/tlv_source -n snap_source
+./thin_send /dev/$VG/snap_source | ./thin_recv --io-engine direct --recv-buffer 4M /dev/$VG/tlv_target
+
+md5_source=($(md5sum /dev/$VG/snap_source))
+md5_target=($(md5sum /dev/$VG/tlv_target))
+
+[ "$md5_source" = "$md5_target" ] || exit 10
+
+lvremove --force /dev/$VG/snap_source
+lvremove --force /dev/$VG/tlv_source
+lvremove --force /dev/$VG/tlv_target
+lvremove --force /dev/$VG/tpool
+
+exit 0
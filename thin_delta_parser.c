@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "thin_delta_parser.h"
+
+#define READ_BUFFER_SIZE (1024 * 1024)
+/* Longest token: a value of 20 characters plus its quotes */
+#define MAX_TOKEN_LEN 64
+#define MAX_VALUE_LEN 20
+
+struct md_parser {
+	int fd;
+	char *buf;
+	size_t buf_size;
+	const char *pos;
+	const char *end;
+	bool mapped;
+	bool eof;
+
+	const char *value;
+	size_t value_len;
+};
+
+static void refill(struct md_parser *p)
+{
+	size_t left = p->end - p->pos;
+	size_t filled;
+
+	memmove(p->buf, p->pos, left);
+	filled = left;
+	while (filled < p->buf_size) {
+		ssize_t ret = read(p->fd, p->buf + filled, p->buf_size - filled);
+
+		if (ret == 0) {
+			p->eof = true;
+			break;
+		}
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("reading metadata failed");
+			exit(10);
+		}
+		filled += ret;
+	}
+	p->pos = p->buf;
+	p->end = p->buf + filled;
+}
+
+struct md_parser *md_parser_open(int fd)
+{
+	struct md_parser *p;
+	struct stat sb;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	p->fd = fd;
+
+	if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		off_t start = lseek(fd, 0, SEEK_CUR);
+
+		if (start == -1)
+			start = 0;
+		p->buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p->buf != MAP_FAILED) {
+			madvise(p->buf, sb.st_size, MADV_SEQUENTIAL);
+			p->buf_size = sb.st_size;
+			p->pos = p->buf + start;
+			p->end = p->buf + sb.st_size;
+			p->mapped = true;
+			p->eof = true;
+			return p;
+		}
+	}
+
+	p->buf_size = READ_BUFFER_SIZE;
+	p->buf = malloc(p->buf_size);
+	if (!p->buf) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	p->pos = p->end = p->buf;
+	return p;
+}
+
+void md_parser_close(struct md_parser *p)
+{
+	if (p->mapped)
+		munmap(p->buf, p->buf_size);
+	else
+		free(p->buf);
+	free(p);
+}
+
+static inline bool is_ws(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static inline bool is_ident(char c)
+{
+	return (c >= 'a' && c <= 'z') || c == '_';
+}
+
+#define KW(s, tk) if (!memcmp(w, s, sizeof(s) - 1)) return tk
+
+static int keyword(const char *w, size_t len)
+{
+	switch (len) {
+	case 4:
+		KW("time", TK_TIME);
+		KW("diff", TK_DIFF);
+		KW("left", TK_LEFT);
+		KW("uuid", TK_UUID);
+		KW("same", TK_SAME);
+		break;
+	case 5:
+		KW("begin", TK_BEGIN);
+		KW("flags", TK_FLAGS);
+		KW("right", TK_RIGHT);
+		break;
+	case 6:
+		KW("length", TK_LENGTH);
+		KW("device", TK_DEVICE);
+		KW("dev_id", TK_DEV_ID);
+		break;
+	case 7:
+		KW("version", TK_VERSION);
+		break;
+	case 9:
+		KW("different", TK_DIFFERENT);
+		KW("left_only", TK_LEFT_ONLY);
+		KW("snap_time", TK_SNAP_TIME);
+		break;
+	case 10:
+		KW("data_block", TK_DATA_BLOCK);
+		KW("data_begin", TK_DATA_BEGIN);
+		KW("right_only", TK_RIGHT_ONLY);
+		KW("superblock", TK_SUPERBLOCK);
+		break;
+	case 11:
+		KW("transaction", TK_TRANSACTION);
+		break;
+	case 12:
+		KW("origin_block", TK_ORIGIN_BLOCK);
+		KW("origin_begin", TK_ORIGIN_BEGIN);
+		break;
+	case 13:
+		KW("range_mapping", TK_RANGE_MAPPING);
+		KW("mapped_blocks", TK_MAPPED_BLOCKS);
+		KW("creation_time", TK_CREATION_TIME);
+		break;
+	case 14:
+		KW("single_mapping", TK_SINGLE_MAPPING);
+		KW("nr_data_blocks", TK_NR_DATA_BLOCKS);
+		break;
+	case 15:
+		KW("data_block_size", TK_DATA_BLOCK_SIZE);
+		break;
+	}
+	return TK_UNEXPECTED_TOKEN;
+}
+
+#undef KW
+
+int md_lex(struct md_parser *p)
+{
+	const char *s, *e, *q;
+
+	while (true) {
+		if (p->end - p->pos < MAX_TOKEN_LEN && !p->eof)
+			refill(p);
+		s = p->pos;
+		while (s < p->end && is_ws(*s))
+			s++;
+		p->pos = s;
+		if (s == p->end && p->eof)
+			return 0;
+		if (p->end - s >= MAX_TOKEN_LEN || p->eof)
+			break;
+	}
+
+	switch (*s) {
+	case '<':
+	case '>':
+	case '=':
+	case '/':
+		p->pos = s + 1;
+		return *s;
+	case '"':
+		e = s + 1 + MAX_VALUE_LEN + 1 < p->end ? s + 1 + MAX_VALUE_LEN + 1 : p->end;
+		q = memchr(s + 1, '"', e - (s + 1));
+		if (!q || memchr(s + 1, '\n', q - (s + 1)) || memchr(s + 1, '\r', q - (s + 1)))
+			break;
+		p->value = s + 1;
+		p->value_len = q - (s + 1);
+		p->pos = q + 1;
+		return TK_VALUE;
+	default:
+		if (!is_ident(*s))
+			break;
+		for (e = s + 1; e < p->end && is_ident(*e); e++)
+			;
+		p->pos = e;
+		return keyword(s, e - s);
+	}
+
+	p->pos = s + 1;
+	return TK_UNEXPECTED_TOKEN;
+}
+
+const char *md_value(struct md_parser *p, size_t *len)
+{
+	*len = p->value_len;
+	return p->value;
+}
+
+bool md_value_u64(struct md_parser *p, uint64_t *value)
+{
+	const char *s = p->value;
+	uint64_t v = 0;
+	size_t i;
+
+	if (p->value_len == 0)
+		return false;
+	for (i = 0; i < p->value_len; i++) {
+		unsigned int d = (unsigned char)s[i] - '0';
+
+		if (d > 9 || v > (UINT64_MAX - d) / 10)
+			return false;
+		v = v * 10 + d;
+	}
+	*value = v;
+	return true;
+}
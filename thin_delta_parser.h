@@ -0,0 +1,60 @@
+#ifndef THIN_DELTA_PARSER_H
+#define THIN_DELTA_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum token {
+	TK_DIFF = 258,
+	TK_LEFT,
+	TK_UUID,
+	TK_TIME,
+	TK_SAME,
+	TK_FLAGS,
+	TK_RIGHT,
+	TK_BEGIN,
+	TK_VALUE,
+	TK_DEVICE,
+	TK_DEV_ID,
+	TK_LENGTH,
+	TK_VERSION,
+	TK_DIFFERENT,
+	TK_LEFT_ONLY,
+	TK_SNAP_TIME,
+	TK_DATA_BLOCK,
+	TK_DATA_BEGIN,
+	TK_RIGHT_ONLY,
+	TK_SUPERBLOCK,
+	TK_TRANSACTION,
+	TK_ORIGIN_BLOCK,
+	TK_ORIGIN_BEGIN,
+	TK_MAPPED_BLOCKS,
+	TK_CREATION_TIME,
+	TK_RANGE_MAPPING,
+	TK_NR_DATA_BLOCKS,
+	TK_SINGLE_MAPPING,
+	TK_DATA_BLOCK_SIZE,
+	TK_UNEXPECTED_TOKEN,
+};
+
+/*
+ * Tokenizer for the XML of thin_delta and thin_dump. Regular files are
+ * mmap()ed, pipes are read in large blocks; values are not copied.
+ */
+struct md_parser;
+
+/* Does not take ownership of fd; exits on errors */
+extern struct md_parser *md_parser_open(int fd);
+extern void md_parser_close(struct md_parser *p);
+
+/* Returns the next token, 0 at the end of input */
+extern int md_lex(struct md_parser *p);
+
+/* The value of the last TK_VALUE token, valid until the next md_lex() */
+extern const char *md_value(struct md_parser *p, size_t *len);
+
+/* false if the last TK_VALUE is not a decimal number fitting into 64 bits */
+extern bool md_value_u64(struct md_parser *p, uint64_t *value);
+
+#endif
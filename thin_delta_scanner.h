@@ -1,38 +1,11 @@
 #ifndef THIN_DELTA_SCANNER_H
 #define THIN_DELTA_SCANNER_H
 
-enum token {
-	TK_DIFF = 258,
-	TK_LEFT,
-	TK_UUID,
-	TK_TIME,
-	TK_SAME,
-	TK_FLAGS,
-	TK_RIGHT,
-	TK_BEGIN,
-	TK_VALUE,
-	TK_DEVICE,
-	TK_DEV_ID,
-	TK_LENGTH,
-	TK_VERSION,
-	TK_DIFFERENT,
-	TK_LEFT_ONLY,
-	TK_SNAP_TIME,
-	TK_DATA_BLOCK,
-	TK_DATA_BEGIN,
-	TK_RIGHT_ONLY,
-	TK_SUPERBLOCK,
-	TK_TRANSACTION,
-	TK_ORIGIN_BLOCK,
-	TK_ORIGIN_BEGIN,
-	TK_MAPPED_BLOCKS,
-	TK_CREATION_TIME,
-	TK_RANGE_MAPPING,
-	TK_NR_DATA_BLOCKS,
-	TK_SINGLE_MAPPING,
-	TK_DATA_BLOCK_SIZE,
-	TK_UNEXPECTED_TOKEN,
-};
+/*
+ * The flex scanner is no longer part of thin_send_recv, it is kept as the
+ * baseline for bench/parser_bench. Tokens are shared with the parser.
+ */
+#include "thin_delta_parser.h"
 
 extern FILE* yyin;
 extern int yylex(void);
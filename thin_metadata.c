@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "thin_metadata.h"
+
+/* The on-disk format as defined by drivers/md/dm-thin-metadata.c and persistent-data */
+#define MD_BLOCK_SIZE 4096
+#define THIN_SUPERBLOCK_MAGIC 27022010
+#define SUPERBLOCK_CSUM_XOR 160774
+#define BTREE_CSUM_XOR 121107
+#define INTERNAL_NODE 1
+#define LEAF_NODE 2
+#define MAPPING_TIME_BITS 24
+
+/* Much deeper than a btree of 2^64 entries can get */
+#define MAX_DEPTH 16
+
+struct thin_disk_superblock {
+	uint32_t csum;
+	uint32_t flags;
+	uint64_t blocknr;
+	uint8_t uuid[16];
+	uint64_t magic;
+	uint32_t version;
+	uint32_t time;
+	uint64_t trans_id;
+	uint64_t held_root;
+	uint8_t data_space_map_root[128];
+	uint8_t metadata_space_map_root[128];
+	uint64_t data_mapping_root;
+	uint64_t device_details_root;
+	uint32_t data_block_size;
+	uint32_t metadata_block_size;
+	uint64_t metadata_nr_blocks;
+	uint32_t compat_flags;
+	uint32_t compat_ro_flags;
+	uint32_t incompat_flags;
+} __attribute__((packed));
+
+struct node_header {
+	uint32_t csum;
+	uint32_t flags;
+	uint64_t blocknr;
+	uint32_t nr_entries;
+	uint32_t max_entries;
+	uint32_t value_size;
+	uint32_t padding;
+} __attribute__((packed));
+
+struct thin_metadata {
+	int fd;
+	const char *path;
+	uint64_t nr_blocks;
+	uint32_t data_block_size;
+	uint64_t trans_id;
+	uint64_t mapping_root;	/* of the held snapshot */
+};
+
+/* A node on the path from the root to the current position */
+struct frame {
+	char *node;
+	bool leaf;
+	uint32_t idx;
+	uint32_t nr;
+};
+
+struct btree_iter {
+	struct thin_metadata *md;
+	int depth;
+	bool have_last;
+	uint64_t last_key;
+	struct frame stack[MAX_DEPTH];
+};
+
+enum iter_state {
+	ITER_END,
+	ITER_LEAF,	/* at a key/value pair */
+	ITER_CHILD,	/* at a not yet visited subtree */
+};
+
+static uint32_t md_checksum(const char *block, uint32_t xor)
+{
+	/* everything but the checksum field itself */
+	return crc32c(~(uint32_t)0, block + 4, MD_BLOCK_SIZE - 4) ^ xor;
+}
+
+static int read_block(struct thin_metadata *md, uint64_t blocknr, char *buf)
+{
+	ssize_t ret;
+
+	if (md->nr_blocks && blocknr >= md->nr_blocks) {
+		fprintf(stderr, "%s: block %llu beyond the end of the metadata\n",
+			md->path, (unsigned long long)blocknr);
+		return -1;
+	}
+	do {
+		ret = pread(md->fd, buf, MD_BLOCK_SIZE, blocknr * MD_BLOCK_SIZE);
+	} while (ret == -1 && errno == EINTR);
+	if (ret != MD_BLOCK_SIZE) {
+		fprintf(stderr, "%s: reading block %llu failed: %s\n", md->path,
+			(unsigned long long)blocknr, ret == -1 ? strerror(errno) : "short read");
+		return -1;
+	}
+	return 0;
+}
+
+static int read_superblock(struct thin_metadata *md, uint64_t blocknr, char *buf)
+{
+	const struct thin_disk_superblock *sb = (const void *)buf;
+
+	if (read_block(md, blocknr, buf))
+		return -1;
+	if (le64toh(sb->magic) != THIN_SUPERBLOCK_MAGIC) {
+		fprintf(stderr, "%s: no thin pool superblock at block %llu\n", md->path,
+			(unsigned long long)blocknr);
+		return -1;
+	}
+	if (le32toh(sb->csum) != md_checksum(buf, SUPERBLOCK_CSUM_XOR) ||
+	    le64toh(sb->blocknr) != blocknr) {
+		fprintf(stderr, "%s: bad superblock checksum at block %llu\n", md->path,
+			(unsigned long long)blocknr);
+		return -1;
+	}
+	if (le32toh(sb->version) < 1 || le32toh(sb->version) > 2 || le32toh(sb->incompat_flags)) {
+		fprintf(stderr, "%s: unsupported metadata version %u\n", md->path,
+			le32toh(sb->version));
+		return -1;
+	}
+	return 0;
+}
+
+static int read_node(struct thin_metadata *md, uint64_t blocknr, char *buf, uint32_t leaf_value_size)
+{
+	const struct node_header *h = (const void *)buf;
+	uint32_t flags, nr, max, value_size;
+
+	if (read_block(md, blocknr, buf))
+		return -1;
+	flags = le32toh(h->flags);
+	nr = le32toh(h->nr_entries);
+	max = le32toh(h->max_entries);
+	value_size = le32toh(h->value_size);
+
+	if (le32toh(h->csum) != md_checksum(buf, BTREE_CSUM_XOR) || le64toh(h->blocknr) != blocknr) {
+		fprintf(stderr, "%s: bad btree node checksum at block %llu\n", md->path,
+			(unsigned long long)blocknr);
+		return -1;
+	}
+	if ((flags != INTERNAL_NODE && flags != LEAF_NODE) || nr > max ||
+	    value_size != (flags == LEAF_NODE ? leaf_value_size : sizeof(uint64_t)) ||
+	    sizeof(*h) + (uint64_t)max * (sizeof(uint64_t) + value_size) > MD_BLOCK_SIZE) {
+		fprintf(stderr, "%s: corrupt btree node at block %llu\n", md->path,
+			(unsigned long long)blocknr);
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t node_key(const char *node, uint32_t i)
+{
+	uint64_t key;
+
+	memcpy(&key, node + sizeof(struct node_header) + i * sizeof(uint64_t), sizeof(key));
+	return le64toh(key);
+}
+
+/* All values read here are 64 bit: child block numbers, roots and mappings */
+static uint64_t node_value64(const char *node, uint32_t i)
+{
+	const struct node_header *h = (const void *)node;
+	uint64_t value;
+
+	memcpy(&value, node + sizeof(*h) + le32toh(h->max_entries) * sizeof(uint64_t) +
+	       i * sizeof(uint64_t), sizeof(value));
+	return le64toh(value);
+}
+
+static char *alloc_block(void)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, MD_BLOCK_SIZE, MD_BLOCK_SIZE)) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	return buf;
+}
+
+struct thin_metadata *thin_metadata_open(const char *tmeta_path)
+{
+	struct thin_disk_superblock *sb;
+	struct thin_metadata *md;
+	uint64_t held_root;
+	char *buf;
+
+	md = calloc(1, sizeof(*md));
+	if (!md) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	md->path = tmeta_path;
+	/* Bypass the page cache, the kernel writes the metadata through its own */
+	md->fd = open(tmeta_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (md->fd == -1 && errno == EINVAL)
+		md->fd = open(tmeta_path, O_RDONLY | O_CLOEXEC);
+	if (md->fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", tmeta_path, strerror(errno));
+		free(md);
+		return NULL;
+	}
+
+	buf = alloc_block();
+	sb = (void *)buf;
+	if (read_superblock(md, 0, buf))
+		goto fail;
+	md->nr_blocks = le64toh(sb->metadata_nr_blocks);
+	held_root = le64toh(sb->held_root);
+	if (!held_root) {
+		fprintf(stderr, "%s: no metadata snapshot held\n", tmeta_path);
+		goto fail;
+	}
+
+	if (read_superblock(md, held_root, buf))
+		goto fail;
+	md->data_block_size = le32toh(sb->data_block_size);
+	md->trans_id = le64toh(sb->trans_id);
+	md->mapping_root = le64toh(sb->data_mapping_root);
+	if (!md->data_block_size) {
+		fprintf(stderr, "%s: invalid data block size\n", tmeta_path);
+		goto fail;
+	}
+	free(buf);
+	return md;
+
+fail:
+	free(buf);
+	close(md->fd);
+	free(md);
+	return NULL;
+}
+
+void thin_metadata_close(struct thin_metadata *md)
+{
+	close(md->fd);
+	free(md);
+}
+
+uint32_t thin_metadata_data_block_size(struct thin_metadata *md)
+{
+	return md->data_block_size;
+}
+
+uint64_t thin_metadata_transaction_id(struct thin_metadata *md)
+{
+	return md->trans_id;
+}
+
+/* Looks up the root of the mapping tree of one thin device */
+static int device_root(struct thin_metadata *md, uint64_t dev_id, uint64_t *root)
+{
+	uint64_t block = md->mapping_root;
+	char *node = alloc_block();
+	int depth, ret = -1;
+
+	for (depth = 0; depth < MAX_DEPTH; depth++) {
+		const struct node_header *h = (const void *)node;
+		uint32_t lo, hi, nr;
+
+		if (read_node(md, block, node, sizeof(uint64_t)))
+			goto out;
+		nr = le32toh(h->nr_entries);
+
+		/* the last entry with a key <= dev_id */
+		lo = 0;
+		hi = nr;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			if (node_key(node, mid) <= dev_id)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0)
+			break;
+
+		if (le32toh(h->flags) == LEAF_NODE) {
+			if (node_key(node, lo - 1) != dev_id)
+				break;
+			*root = node_value64(node, lo - 1);
+			ret = 0;
+			goto out;
+		}
+		block = node_value64(node, lo - 1);
+	}
+	fprintf(stderr, "%s: thin device %llu not found in metadata snapshot\n", md->path,
+		(unsigned long long)dev_id);
+out:
+	free(node);
+	return ret;
+}
+
+static void iter_init(struct btree_iter *it, struct thin_metadata *md)
+{
+	int i;
+
+	memset(it, 0, sizeof(*it));
+	it->md = md;
+	for (i = 0; i < MAX_DEPTH; i++)
+		it->stack[i].node = alloc_block();
+}
+
+static void iter_free(struct btree_iter *it)
+{
+	int i;
+
+	for (i = 0; i < MAX_DEPTH; i++)
+		free(it->stack[i].node);
+}
+
+static int iter_push(struct btree_iter *it, uint64_t block)
+{
+	struct frame *f;
+
+	if (it->depth == MAX_DEPTH) {
+		fprintf(stderr, "%s: btree too deep at block %llu\n", it->md->path,
+			(unsigned long long)block);
+		return -1;
+	}
+	f = &it->stack[it->depth];
+	if (read_node(it->md, block, f->node, sizeof(uint64_t)))
+		return -1;
+	f->leaf = le32toh(((struct node_header *)f->node)->flags) == LEAF_NODE;
+	f->idx = 0;
+	f->nr = le32toh(((struct node_header *)f->node)->nr_entries);
+	it->depth++;
+	return 0;
+}
+
+static enum iter_state iter_state(struct btree_iter *it)
+{
+	while (it->depth && it->stack[it->depth - 1].idx >= it->stack[it->depth - 1].nr)
+		it->depth--;
+	if (!it->depth)
+		return ITER_END;
+	return it->stack[it->depth - 1].leaf ? ITER_LEAF : ITER_CHILD;
+}
+
+/* For ITER_CHILD this is a lower bound of the keys in the subtree */
+static uint64_t iter_key(struct btree_iter *it)
+{
+	struct frame *f = &it->stack[it->depth - 1];
+
+	return node_key(f->node, f->idx);
+}
+
+static uint64_t iter_value(struct btree_iter *it)
+{
+	struct frame *f = &it->stack[it->depth - 1];
+
+	return node_value64(f->node, f->idx);
+}
+
+static void iter_skip(struct btree_iter *it)
+{
+	it->stack[it->depth - 1].idx++;
+}
+
+static int iter_descend(struct btree_iter *it)
+{
+	uint64_t child = iter_value(it);
+
+	iter_skip(it);
+	return iter_push(it, child);
+}
+
+/* Keys must be strictly ascending, this also stops cycles in corrupt metadata */
+static int iter_check_order(struct btree_iter *it)
+{
+	uint64_t key = iter_key(it);
+
+	if (it->have_last && key <= it->last_key) {
+		fprintf(stderr, "%s: btree keys out of order\n", it->md->path);
+		return -1;
+	}
+	it->have_last = true;
+	it->last_key = key;
+	return 0;
+}
+
+int thin_metadata_dump(struct thin_metadata *md, uint64_t dev_id, thin_mapping_fn fn, void *arg)
+{
+	struct btree_iter it;
+	uint64_t root;
+	int ret = -1;
+
+	if (device_root(md, dev_id, &root))
+		return -1;
+
+	iter_init(&it, md);
+	if (iter_push(&it, root))
+		goto out;
+	while (true) {
+		enum iter_state state = iter_state(&it);
+
+		if (state == ITER_END)
+			break;
+		if (state == ITER_CHILD) {
+			if (iter_descend(&it))
+				goto out;
+			continue;
+		}
+		if (iter_check_order(&it))
+			goto out;
+		fn(arg, THIN_MAPPED, iter_key(&it));
+		iter_skip(&it);
+	}
+	ret = 0;
+out:
+	iter_free(&it);
+	return ret;
+}
+
+/*
+ * Walks both trees in step. Where both are about to enter the same node,
+ * that whole subtree is identical and skipped. Otherwise the iterator
+ * with the lower next key advances, descending into subtrees as needed.
+ */
+int thin_metadata_delta(struct thin_metadata *md, uint64_t dev_id1, uint64_t dev_id2,
+			thin_mapping_fn fn, void *arg)
+{
+	struct btree_iter left, right;
+	uint64_t root1, root2;
+	int ret = -1;
+
+	if (device_root(md, dev_id1, &root1) || device_root(md, dev_id2, &root2))
+		return -1;
+	if (root1 == root2)
+		return 0;
+
+	iter_init(&left, md);
+	iter_init(&right, md);
+	if (iter_push(&left, root1) || iter_push(&right, root2))
+		goto out;
+
+	while (true) {
+		enum iter_state ls = iter_state(&left);
+		enum iter_state rs = iter_state(&right);
+		uint64_t lk, rk;
+
+		if (ls == ITER_END && rs == ITER_END)
+			break;
+		lk = ls == ITER_END ? UINT64_MAX : iter_key(&left);
+		rk = rs == ITER_END ? UINT64_MAX : iter_key(&right);
+
+		if (ls == ITER_CHILD && rs == ITER_CHILD && iter_value(&left) == iter_value(&right)) {
+			iter_skip(&left);
+			iter_skip(&right);
+			continue;
+		}
+		if (ls == ITER_CHILD && (rs == ITER_END || lk <= rk)) {
+			if (iter_descend(&left))
+				goto out;
+			continue;
+		}
+		if (rs == ITER_CHILD && (ls == ITER_END || rk <= lk)) {
+			if (iter_descend(&right))
+				goto out;
+			continue;
+		}
+
+		/* no subtree left to enter before the next pair of either side */
+		if (ls == ITER_LEAF && rs == ITER_LEAF && lk == rk) {
+			if (iter_check_order(&left) || iter_check_order(&right))
+				goto out;
+			if (iter_value(&left) >> MAPPING_TIME_BITS != iter_value(&right) >> MAPPING_TIME_BITS)
+				fn(arg, THIN_DIFFERENT, lk);
+			iter_skip(&left);
+			iter_skip(&right);
+		} else if (ls == ITER_LEAF && lk < rk) {
+			if (iter_check_order(&left))
+				goto out;
+			fn(arg, THIN_LEFT_ONLY, lk);
+			iter_skip(&left);
+		} else {
+			if (iter_check_order(&right))
+				goto out;
+			fn(arg, THIN_RIGHT_ONLY, rk);
+			iter_skip(&right);
+		}
+	}
+	ret = 0;
+out:
+	iter_free(&left);
+	iter_free(&right);
+	return ret;
+}
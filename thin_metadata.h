@@ -0,0 +1,44 @@
+#ifndef THIN_METADATA_H
+#define THIN_METADATA_H
+
+#include <stdint.h>
+
+/*
+ * Reads the mappings of thin devices directly from the held metadata
+ * snapshot of a pool (after "reserve_metadata_snap"), instead of
+ * running thin_delta or thin_dump and parsing their XML.
+ */
+struct thin_metadata;
+
+enum thin_change {
+	THIN_MAPPED,		/* thin_metadata_dump() */
+	THIN_DIFFERENT,
+	THIN_LEFT_ONLY,
+	THIN_RIGHT_ONLY,
+};
+
+/* Called once per data block, in ascending order of the virtual block */
+typedef void (*thin_mapping_fn)(void *arg, enum thin_change change, uint64_t block);
+
+/* NULL with a message on stderr if there is no usable metadata snapshot */
+extern struct thin_metadata *thin_metadata_open(const char *tmeta_path);
+extern void thin_metadata_close(struct thin_metadata *md);
+
+/* In 512-byte sectors */
+extern uint32_t thin_metadata_data_block_size(struct thin_metadata *md);
+
+/* The pool's transaction id at the time the snapshot was taken */
+extern uint64_t thin_metadata_transaction_id(struct thin_metadata *md);
+
+/* These return 0, or -1 with a message on stderr */
+extern int thin_metadata_dump(struct thin_metadata *md, uint64_t dev_id,
+			      thin_mapping_fn fn, void *arg);
+
+/*
+ * Like thin_delta: reports blocks that differ between dev_id1 (left) and
+ * dev_id2 (right). Subtrees the two devices share are skipped unread.
+ */
+extern int thin_metadata_delta(struct thin_metadata *md, uint64_t dev_id1, uint64_t dev_id2,
+			       thin_mapping_fn fn, void *arg);
+
+#endif
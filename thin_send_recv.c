@@ -1,9 +1,12 @@
 #define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/sendfile.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/random.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -17,24 +20,26 @@
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <linux/fs.h> /* ioctl BLKDISCARD */
 
-#include "thin_delta_scanner.h"
+#include "thin_delta_parser.h"
+#include "thin_metadata.h"
+#include "lv_lookup.h"
+#include "uring.h"
+#include "compress.h"
+#include "zero.h"
+#include "crc32c.h"
+#include "hash_manifest.h"
+#include "net.h"
+#include "report.h"
+#include "throttle.h"
 
 #ifndef FALLOC_FL_PUNCH_HOLE
 #define FALLOC_FL_PUNCH_HOLE     0x02 /* de-allocates range */
 #endif
 
-struct snap_info {
-	char *vg_name;
-	char *lv_name;
-	char *thin_pool_name;
-	char *dm_path;
-	int thin_id;
-	bool active;
-};
-
 struct chunk {
 	uint64_t magic;
 	uint64_t offset;
@@ -48,13 +53,75 @@ enum cmd {
 	CMD_UNMAP = 1,
 	CMD_BEGIN_STREAM = 2,
 	CMD_END_STREAM = 3,
+	CMD_DATA_COMPRESSED = 4,
+	CMD_ZERO = 5,
+	CMD_VOLUME = 6,		/* batch streams only */
+	CMD_CHECKSUM = 7,
+	CMD_CONNECTION = 8,	/* streams over several TCP connections only */
 
 	/* Forward compat for optional chunks */
 	CMD_FLAG_OPTIONAL_INFO = 1U << 31,
+
+	CMD_STREAM_STATS_EXT = CMD_FLAG_OPTIONAL_INFO | 1,
+	CMD_STREAM_ID = CMD_FLAG_OPTIONAL_INFO | 2,
+	CMD_STREAM_INDEX = CMD_FLAG_OPTIONAL_INFO | 3,
+};
+
+/*
+ * Payload of BEGIN_STREAM. Only sent if the stream makes use of features;
+ * receivers refuse streams with feature bits they do not know, before any
+ * data is applied. Receivers predating it fail on the next chunk header.
+ */
+struct stream_begin {
+	uint64_t features;
+} __attribute__((packed));
+
+enum stream_feature {
+	/* defines the binary format */
+	FEATURE_LZ4 = 1ULL << 0,
+	FEATURE_ZSTD = 1ULL << 1,
+	FEATURE_ZERO = 1ULL << 2,
+	FEATURE_CHECKSUM = 1ULL << 3,
 };
 
+/* Precedes the compressed data in the payload of CMD_DATA_COMPRESSED */
+struct compressed_data {
+	uint32_t algo;
+	uint32_t reserved;
+	uint64_t raw_length;
+} __attribute__((packed));
+
+#define MAX_RAW_LENGTH (1024 * 1024 * 1024)
+
+/*
+ * Payload of CMD_CHECKSUM, which precedes every DATA and DATA_COMPRESSED
+ * chunk of a FEATURE_CHECKSUM stream, with the same offset. CRC32C of the
+ * data as it ends up on the target, not of the compressed payload.
+ */
+struct chunk_checksum {
+	uint64_t length;	/* on the target */
+	uint32_t crc32c;
+	uint32_t reserved;
+} __attribute__((packed));
+
+/*
+ * Follows BEGIN_STREAM on each of the TCP connections of thin_send
+ * --connections. Every connection carries a complete stream of its own,
+ * with its share of the chunks and an END_STREAM counting those.
+ */
+struct connection_info {
+	uint64_t nonce;		/* the same on all connections of a stream */
+	uint32_t index;
+	uint32_t count;
+} __attribute__((packed));
+
+#define MAX_CONNECTIONS 64
+
+/* Longest target name in the VOLUME chunks of a batch stream */
+#define BATCH_MAX_TARGET 1024
+
 static const char *PGM_NAME = "thin-send-recv";
-static const char *const LOCKFILE_PATH = "/var/run/thin-send-recv.lock";
+static const char *const LOCKFILE_DIR = "/var/run";
 static const uint64_t MAGIC_VALUE_1_1 = 0x24C4F02AAE2E4FA9ULL;
 static const uint64_t MAGIC_VALUE_1_0 = 0xCA7F00D5DE7EC7EDULL;
 static const uint64_t OLD_MAGIC = 0xE85BC5636CC72A05ULL;
@@ -73,36 +140,445 @@ struct stream_stats {
 	uint64_t n_unmap;
 } __attribute__((packed));
 
+/* Sent just before END_STREAM, if the stream uses any features */
+struct stream_stats_ext {
+	uint64_t n_zero;
+	uint64_t bytes_data;
+	uint64_t bytes_zero;	/* not sent as data because it is all zeroes */
+} __attribute__((packed));
+
+/* Sent just after BEGIN_STREAM by resumable streams */
+struct stream_id {
+	uint64_t id;		/* what is sent, the same when resuming */
+	uint64_t resume_offset;	/* the stream starts here, all before it was applied */
+} __attribute__((packed));
+
+/*
+ * thin_send --index: the payload of STREAM_INDEX, the last chunk before
+ * END_STREAM, is an entry for every chunk before it, followed by a
+ * stream_index. That is at a fixed distance from the end of the stream,
+ * so a file holding the stream leads to its index without reading it.
+ */
+struct index_entry {
+	uint64_t pos;		/* of the chunk header, from the start of the stream */
+	uint64_t offset;
+	uint64_t length;	/* of the payload, as in the chunk header */
+	uint32_t cmd;
+	uint32_t raw_length;	/* DATA_COMPRESSED: the length on the target */
+} __attribute__((packed));
+
+struct stream_index {
+	uint64_t n_entries;
+	uint64_t pos;		/* of the STREAM_INDEX chunk header */
+} __attribute__((packed));
+
+/*
+ * thin_recv --inspect: what a stream holds. The histogram has a fixed
+ * number of buckets; when an offset beyond them shows up, neighbouring
+ * buckets are merged and the bucket size doubles.
+ */
+#define INSPECT_BUCKETS 32
+
+struct inspect_report {
+	uint64_t n_compressed;
+	uint64_t bytes_compressed;	/* in the stream, of the DATA_COMPRESSED chunks */
+	uint64_t bytes_unmap;
+	uint64_t n_checksum;
+	uint64_t n_optional;	/* not known to this version */
+	uint64_t bucket_size;
+	uint64_t bucket_extents[INSPECT_BUCKETS];
+	uint64_t bucket_bytes[INSPECT_BUCKETS];	/* of DATA and ZERO */
+};
+
+/* An extent parsed from the metadata tool's output, waiting to be sent */
+struct extent {
+	loff_t begin;
+	size_t length;
+	size_t block_size;
+	enum cmd cmd;
+};
+
 struct stream_context {
 	int in_fd;
 	int out_fd;
+	uint64_t in_size;	/* of a regular file as input, skip_input() seeks in it */
 
 	uint64_t n_chunks;
 	uint64_t n_data;
 	uint64_t n_unmap;
+	uint64_t n_zero;
+	uint64_t bytes_data;
+	uint64_t bytes_zero;
 	int n_begin_stream;
 	int n_end_stream;
+
+	/* thin_recv: checkpoints of resumable streams */
+	bool has_stream_id;
+	bool out_of_order;	/* can not resume by offset */
+	uint64_t stream_id;
+	loff_t applied_end;	/* everything before it is in the stream so far */
+	uint64_t checkpoint_bytes;	/* bytes_data at the last checkpoint */
+
+	/* thin_recv: from the CHECKSUM chunk, for the DATA chunk following it */
+	uint64_t features;
+	bool crc_pending;
+	uint32_t crc;
+	loff_t crc_offset;
+	size_t crc_length;
+
+	/* thin_recv --listen: other connections apply to the same target concurrently */
+	bool shared_target;
+
+	/* thin_recv --inspect: nothing is applied, what the stream holds is counted */
+	struct inspect_report *inspect;
+
+	/* thin_send --squash: nothing is applied, the chunks are recorded for file squash_file */
+	struct squash *squash;
+	int squash_file;
+
+	/* thin_send: with a hash manifest, where the extents sent so far end */
+	loff_t manifest_pos;
+	uint64_t volume_size;
+
+	struct send_pipeline *pipeline;
+	struct recv_pipeline *recv_pipeline;
+	struct discard_planner *discards;	/* started by the first UNMAP */
+	struct extent_queue *extents;
+	struct extent pending;	/* collects adjacent extents, length 0 if none */
+	uint64_t send_ns;	/* of parsing, spent sending inline; not parse time */
+};
+
+/*
+ * The parser never waits for the sender, so the metadata snapshot is
+ * released as soon as the scan is done, however slow the data transfer.
+ * Up to EXTENT_QUEUE_MEM extents are kept in memory; beyond that, newer
+ * extents are collected in spill and written to an unlinked tmp file,
+ * and read back once the ones in memory are sent.
+ */
+#define EXTENT_QUEUE_MEM (256 * 1024)
+#define EXTENT_QUEUE_SPILL 4096
+
+struct extent_queue {
+	struct extent *extents;
+	size_t head;	/* next to be popped */
+	size_t tail;	/* next free slot */
+	size_t size;
+	bool done;
+
+	/* in stream order: extents, then the tmp file, then spill */
+	bool spilling;
+	struct extent *spill;	/* and tmp_fd, once the queue first spilled */
+	size_t n_spill;
+	int tmp_fd;
+	uint64_t tmp_head;	/* in extents */
+	uint64_t tmp_tail;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct metadata_tool {
+	const char *thin_pool_dm_path;
+	const char *cmdline;
+	void (*parse)(struct stream_context *ctx, struct md_parser *md);
+	FILE *f;
+	uint64_t started;
+	pthread_t thread;
+	struct extent_queue queue;
+};
+
+/* A piece of a send_job that becomes one chunk in the stream */
+struct send_run {
+	enum cmd cmd;
+	size_t offset;		/* into the job */
+	size_t length;		/* on the target */
+	size_t payload_off;	/* into cbuf, for CMD_DATA_COMPRESSED */
+	size_t payload_len;
+	uint32_t crc;		/* of the data, with --checksum */
+};
+
+/* One unit of work for the send pipeline: a (sub-)extent and its data */
+struct send_job {
+	loff_t begin;
+	size_t length;
+	size_t block_size;
+	enum cmd cmd;
+	char *buf;
+	bool ready;
+
+	/* filled in by the reader thread */
+	struct send_run *runs;
+	unsigned int n_runs;
+	unsigned int max_runs;
+	char *cbuf;
+	size_t cbuf_size;
+};
+
+/*
+ * Reader threads fetch upcoming extents concurrently with pread(), the
+ * sequencer thread emits them onto out_fd in submission order.
+ * jobs[] is a ring indexed by sequence number modulo n_jobs.
+ */
+struct send_pipeline {
+	struct stream_context *ctx;
+	int in_fd;
+	int out_fd;
+	int n_readers;
+	pthread_t *readers;
+	pthread_t sequencer;
+
+	struct send_job *jobs;
+	unsigned int n_jobs;
+	uint64_t head;		/* next sequence number to be queued */
+	uint64_t next_read;	/* next sequence number to be picked by a reader */
+	uint64_t tail;		/* next sequence number to be written out */
+	bool shutdown;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/* A DATA piece or a ZERO range waiting for a writer thread of thin_recv */
+struct recv_job {
+	struct recv_job *next;
+	enum cmd cmd;
+	loff_t offset;
+	size_t length;		/* on the target */
+	char *buf;
+	size_t buf_len;
+	size_t buf_off;		/* --io-engine direct: where in buf the data starts */
+	size_t mem;		/* accounted against the memory cap */
+	enum compress_algo algo;
+	bool has_crc;		/* verified after decompression */
+	uint32_t crc;
+	bool running;
+};
+
+/*
+ * The main thread reads the stream into memory, bounded by mem_cap, and
+ * queues jobs in stream order. Writer threads apply them at their offsets
+ * in parallel; a job does not start while it overlaps an earlier queued one.
+ */
+struct recv_pipeline {
+	int out_fd;
+	int direct_fd;		/* the target with O_DIRECT, -1 if not --io-engine direct */
+	int n_writers;
+	pthread_t *writers;
+
+	/* --io-engine direct: contiguous DATA collects here before it is queued */
+	struct recv_job *filling;
+	char **pool;		/* free buffers of DIRECT_BUF_SIZE */
+	int n_pool;
+	int pool_size;
+
+	struct recv_job *jobs;
+	struct recv_job *jobs_tail;
+	unsigned int n_jobs;
+	size_t mem_used;
+	size_t mem_cap;
+	bool shutdown;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
 };
 
-static void parse_diff(struct stream_context *ctx);
-static void parse_dump(struct stream_context *ctx);
+#define RECV_MAX_JOBS 1024
+
+/* --io-engine direct: offsets and buffers aligned to this are written with O_DIRECT */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (4 * 1024 * 1024)
+
+/* A merged UNMAP range, queued for the discard thread of thin_recv */
+struct discard_range {
+	struct discard_range *next;
+	loff_t begin;
+	loff_t end;
+};
+
+/*
+ * thin_recv: adjacent UNMAPs are merged into one range, which a thread of
+ * its own discards aligned to the target's chunk size, zeroing the edges.
+ * DATA and ZERO only wait for it when they overlap a range not done yet.
+ */
+struct discard_planner {
+	int out_fd;
+	size_t granularity;
+	loff_t pending_begin;	/* collects adjacent UNMAPs, empty if begin == end */
+	loff_t pending_end;
+
+	struct discard_range *queue;	/* the head is in flight */
+	struct discard_range *queue_tail;
+	unsigned int n_queued;
+	bool shutdown;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+#define DISCARD_MAX_QUEUED 1024
+
+/*
+ * thin_recv --archive: threads pick the index entries in order and apply
+ * them, reading the chunks from the file with pread(). An entry does not
+ * start while it overlaps an earlier one that is still running.
+ */
+struct archive_restore {
+	int in_fd;
+	int out_fd;
+	uint64_t features;
+	size_t granularity;	/* of discards, for UNMAP */
+	struct index_entry *entries;	/* in host byte order */
+	uint64_t n_entries;
+	uint64_t next;		/* the entry to be picked next */
+	uint64_t *running;	/* per thread, UINT64_MAX while it has none */
+	int n_threads;
+	int n_started;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/* What an archive thread reads of an uncompressed DATA chunk at once */
+#define ARCHIVE_PIECE_SIZE (4 * 1024 * 1024)
+
+/*
+ * thin_send --squash: a DATA, DATA_COMPRESSED, ZERO or UNMAP chunk of one
+ * of the streams. Where records overlap, the one with the higher seq is
+ * what the target ends up with.
+ */
+struct squash_record {
+	uint64_t begin;		/* on the target */
+	uint64_t end;
+	uint64_t seq;
+	uint64_t pos;		/* of the payload in its file */
+	uint64_t length;	/* of the payload */
+	uint32_t file;
+	uint32_t cmd;
+	uint32_t crc;
+	uint32_t has_crc;
+};
+
+/* A sorted run of records in the tmp file, read back a slice at a time */
+struct squash_run {
+	uint64_t pos;		/* in records */
+	uint64_t n_left;
+	struct squash_record *buf;
+	size_t n_buf;
+	size_t i_buf;
+};
+
+/*
+ * The records of all streams are sorted by begin in runs of bounded size,
+ * spilled to a tmp file and merged. A sweep over them keeps the records
+ * covering the current position in a heap by seq; the top one owns the
+ * target there. Records entirely below the top one are dropped right away.
+ */
+struct squash {
+	const char *const *paths;
+	int *fds;
+	uint64_t *sizes;
+	int n_files;
+	uint64_t seq;
+
+	struct squash_record *records;	/* the run being collected */
+	size_t n_records;
+	int tmp_fd;		/* -1 while everything fits into records */
+	uint64_t tmp_records;
+	struct squash_run *runs;
+	int n_runs;
+	int *merge;		/* min-heap of run indexes, by their next record */
+	int n_merge;
+
+	struct squash_record *active;	/* max-heap by seq */
+	size_t n_active;
+	size_t size_active;
+
+	/* adjacent pieces of the same record, or of ZERO or UNMAP, become one chunk */
+	struct squash_record pending;
+	uint64_t pending_begin;
+	uint64_t pending_end;	/* nothing pending if begin == end */
+
+	struct stream_context *out;
+	char *buf;		/* of max_io_size */
+};
+
+#define SQUASH_RUN_RECORDS (1024 * 1024)
+#define SQUASH_READ_RECORDS 1024
+
+static void parse_diff(struct stream_context *ctx, struct md_parser *md);
+static void parse_dump(struct stream_context *ctx, struct md_parser *md);
 static void send_end_stream(struct stream_context *ctx);
+static void send_stream_index(struct stream_context *ctx);
 static void usage_exit(const struct option *long_options, const char *reason);
 static void get_snap_info(const char *snap_name, struct snap_info *info);
 static int checked_asprintf(char **strp, const char *fmt, ...);
 static int system_fmt(const char *fmt, ...);
 static void send_header(int out_fd, loff_t begin, size_t length, enum cmd cmd);
+static void send_begin_stream(int out_fd);
+static void send_stream_id(struct stream_context *ctx, const struct snap_info *snap1,
+			   const struct snap_info *snap2);
+static uint64_t stream_features(void);
 static void send_chunk(int in_fd, int out_fd, loff_t begin, size_t length, size_t block_size);
+static void send_extent(struct stream_context *ctx, enum cmd cmd, loff_t begin, size_t length, size_t block_size);
+static void send_pipeline_start(struct stream_context *ctx);
+static void flush_extent(struct stream_context *ctx);
+static void coalesce_extent(struct stream_context *ctx, enum cmd cmd, loff_t begin,
+			    size_t length, size_t block_size);
+static void send_pipeline_finish(struct stream_context *ctx);
+static void extent_queue_push(struct extent_queue *q, enum cmd cmd, loff_t begin,
+			      size_t length, size_t block_size);
+static void recv_pipeline_start(struct stream_context *ctx);
+static void recv_pipeline_finish(struct stream_context *ctx);
+static void zero_elide_setup(int out_fd);
+static void discard_plan(struct stream_context *ctx, loff_t offset, size_t length);
+static void discard_wait(struct stream_context *ctx, loff_t offset, size_t length);
+static void discard_drain(struct stream_context *ctx);
+static void discard_planner_finish(struct stream_context *ctx);
 static void thin_send_vol(const char *vol_name, int out_fd);
 static void thin_send_diff(const char *snap1_name, const char *snap2_name, int out_fd);
-static void thin_receive(const char *snap_name, int in_fd);
+static void thin_send_batch(const char *manifest, int out_fd);
+static void thin_send_file(const char *path, const char *extents_path, int out_fd);
+static void thin_send_squash(const char *const *paths, int n_paths, int out_fd);
+static void thin_receive(const char *snap_name, int in_fd, bool batch);
+static void thin_receive_batch(int in_fd);
+static void thin_receive_archive(const char *snap_name, const char *path);
+static int open_target(const char *snap_name);
+static void receive_stream(struct stream_context *ctx, bool batch);
+static void print_inspect_report(const struct stream_context *ctx, const char *name);
+static void thin_hash_target(const char *snap_name, const char *path);
+static int open_source_file(const char *path);
+static int open_connections(void);
+static void close_connections(int out_fd);
+static void thin_receive_listen(const char *snap_name);
+static void finish_report(void);
+static void zero_manifest_gap(struct stream_context *ctx, loff_t end);
+static void write_all(int out_fd, const char *data, const size_t count);
 static bool process_input(struct stream_context *ctx);
-static int lockfile_lock(void);
-static void lockfile_unlock(int lockfile_fd);
+size_t read_complete(struct stream_context *ctx, void *const buf, const size_t requested_count);
+static void advance_position(struct stream_context *ctx, loff_t offset, size_t length);
+static void skip_input(struct stream_context *ctx, size_t remaining);
+static int open_unlinked_tmp(void);
+static void squash_collect(struct stream_context *ctx, enum cmd cmd, uint64_t offset,
+			   uint64_t length, uint64_t payload_length, const uint32_t *crc);
+static void pread_archive(int fd, void *buf, size_t count, uint64_t pos);
+static void write_checkpoint(struct stream_context *ctx);
 static int reserve_metadata_snap(const char *thin_pool_dm_path);
 static void release_metadata_snap(const char *thin_pool_dm_path);
 
-static const char *data_for_signal_handler;
+/* A metadata snapshot reservation this process takes part in */
+struct reservation {
+	const char *thin_pool_dm_path;	/* NULL while the slot is free */
+	int lock_fd;
+	int users_fd;
+	uint64_t since;		/* report_now() when it was taken */
+};
+
+/* Batch mode scans up to this many pools at once, each with its reservation */
+#define MAX_RESERVATIONS 16
+
+static struct reservation reservations[MAX_RESERVATIONS];
+static pthread_mutex_t reservations_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static bool unsupported_unmap_is_fatal = false;
 
@@ -112,9 +588,295 @@ enum stream_format {
 	STREAM_FORMAT_1_1,
 };
 
-enum {	OPT_STREAM_FORMAT = 0x1000 };
+enum {
+	OPT_STREAM_FORMAT = 0x1000,
+	OPT_READERS,
+	OPT_MAX_IO,
+	OPT_IO_ENGINE,
+	OPT_IO_DEPTH,
+	OPT_WRITERS,
+	OPT_RECV_BUFFER,
+	OPT_COMPRESS,
+	OPT_DETECT_ZEROES,
+	OPT_ZERO_ELIDE,
+	OPT_STREAM_METADATA,
+	OPT_COALESCE_GAP,
+	OPT_METADATA_TOOL,
+	OPT_PRINT_EXTENTS,
+	OPT_BATCH,
+	OPT_RESUMABLE,
+	OPT_RESUME,
+	OPT_CHECKPOINT,
+	OPT_CHECKPOINT_INTERVAL,
+	OPT_CHECKSUM,
+	OPT_HASH_MANIFEST,
+	OPT_BLOCK_SIZE,
+	OPT_CONNECT,
+	OPT_CONNECTIONS,
+	OPT_STRIPE,
+	OPT_LISTEN,
+	OPT_SOCKET_BUFFER,
+	OPT_PROGRESS,
+	OPT_STATS_JSON,
+	OPT_EXTENTS,
+	OPT_FILE,
+	OPT_RATE_LIMIT,
+	OPT_IOPS_LIMIT,
+	OPT_LATENCY_TARGET,
+	OPT_THROTTLE_FILE,
+	OPT_IOPRIO,
+	OPT_INDEX,
+	OPT_ARCHIVE,
+	OPT_RANGE,
+	OPT_SQUASH,
+	OPT_INSPECT,
+};
 
 static enum stream_format stream_format = STREAM_FORMAT_AUTO;
+
+/* thin_send: with more than one reader, data is fetched by a thread pool */
+static int n_readers = 1;
+static bool n_readers_set = false;
+static size_t max_io_size = 1024 * 1024;
+
+/* thin_send: parse the metadata tool's output while it runs, without spool file */
+static bool stream_metadata = false;
+
+/* thin_send: DATA extents at most this far apart are sent as one, with the gap */
+static size_t coalesce_gap = 0;
+
+/* thin_send: run thin_delta/thin_dump instead of reading the metadata snapshot */
+static bool metadata_tool = false;
+/* thin_send: list the extents on stdout instead of sending a stream */
+static bool print_extents = false;
+
+/* thin_send: send the volumes of a manifest; thin_recv: receive such a stream */
+static bool batch_mode = false;
+
+/* thin_send: identify the stream, so that the receiver can checkpoint it */
+static bool resumable = false;
+/* thin_send: skip everything before resume_offset, from the receiver's checkpoint */
+static uint64_t resume_id;
+static uint64_t resume_offset;
+
+/* thin_send: append an index of the chunks, for restoring from a file in parallel */
+static bool stream_index = false;
+/* thin_recv: restore from such a file, only what falls into the range */
+static const char *archive_path;
+static uint64_t range_begin;
+static uint64_t range_end = UINT64_MAX;
+
+/* thin_send: merge stream files into one; features of the chunks passed through */
+static bool squash_mode = false;
+static uint64_t squash_features;
+
+/* thin_recv: check and describe the stream instead of applying it */
+static bool inspect_mode = false;
+
+/* thin_recv: record how far a resumable stream got, whenever this much more data is durable */
+static const char *checkpoint_path;
+static uint64_t checkpoint_interval = 1ULL << 30;
+
+/* thin_send: leave out the blocks the target holds already; thin_recv: write that manifest */
+static const char *hash_manifest_path;
+static struct hash_manifest manifest;
+/* thin_recv: hash blocks of this size, 0 for the chunk size of the target's pool */
+static uint64_t manifest_block_size;
+
+/* thin_send: send over TCP; chunks go round robin, or by offset in stripe_size pieces */
+static const char *connect_addr;
+static int n_connections = 1;
+static uint64_t stripe_size;
+/* thin_recv: accept the connections of thin_send --connect */
+static const char *listen_addr;
+static size_t socket_buffer_size = 4 * 1024 * 1024;
+
+/* report progress on stderr every that many seconds, 0 for not at all */
+static unsigned int progress_interval;
+/* write where the time went into this file at exit */
+static const char *stats_json_path;
+static const char *report_name;
+
+/* thin_send: extents from this thin_delta/thin_dump output, the source is a file then */
+static const char *extents_path;
+/* thin_recv: the target is a regular file, created if it does not exist */
+static bool target_file = false;
+
+/* limits for the device I/O, reads of thin_send and writes of thin_recv; 0 for none */
+static uint64_t rate_limit;
+static uint64_t iops_limit;
+static uint64_t latency_target;	/* ns, adapts the rate to the device */
+static const char *throttle_path;
+static int ioprio = -1;		/* class << 8 | level */
+
+enum io_engine {
+	IO_ENGINE_SPLICE,
+	IO_ENGINE_URING,	/* thin_send */
+	IO_ENGINE_DIRECT,	/* thin_recv */
+};
+
+static enum io_engine io_engine = IO_ENGINE_SPLICE;
+static unsigned int io_depth = 8;
+
+/* thin_recv: with more than one writer, chunks are applied by a thread pool */
+static int n_writers = 1;
+static bool n_writers_set = false;
+static size_t recv_buffer_size = 64 * 1024 * 1024;
+
+/* thin_send: compress DATA chunks on the reader threads */
+static enum compress_algo compress_algo = COMPRESS_NONE;
+static int compress_level;
+
+/* thin_send: checksum the data on the reader threads, for thin_recv to verify */
+static bool checksum = false;
+
+/* thin_send: send all-zero blocks as CMD_ZERO instead of CMD_DATA */
+static bool detect_zeroes = false;
+
+/* thin_recv: do not write all-zero blocks, discard or skip them */
+enum zero_elide {
+	ZERO_ELIDE_OFF,
+	ZERO_ELIDE_DISCARD,
+	ZERO_ELIDE_SKIP,	/* the target is known to be unmapped there */
+};
+
+static enum zero_elide zero_elide = ZERO_ELIDE_OFF;
+static size_t zero_elide_granularity;
+
+static enum zero_elide to_zero_elide(const char *opt)
+{
+	if (!strcmp(opt, "discard")) return ZERO_ELIDE_DISCARD;
+	if (!strcmp(opt, "skip")) return ZERO_ELIDE_SKIP;
+
+	fprintf(stderr, "unknown zero elision mode \"%s\"; should be one of \"discard\", \"skip\".\n", opt);
+	exit(10);
+}
+
+static enum io_engine to_io_engine(const char *opt)
+{
+	if (!strcmp(opt, "splice")) return IO_ENGINE_SPLICE;
+	if (!strcmp(opt, "uring")) return IO_ENGINE_URING;
+	if (!strcmp(opt, "direct")) return IO_ENGINE_DIRECT;
+
+	fprintf(stderr, "unknown io engine \"%s\"; should be one of \"splice\", \"uring\", \"direct\".\n", opt);
+	exit(10);
+}
+
+static long to_long(const char *opt, const char *name, long min, long max)
+{
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(opt, &end, 10);
+	if (errno || end == opt || *end || val < min || val > max) {
+		fprintf(stderr, "invalid value \"%s\" for %s; should be between %ld and %ld.\n",
+			opt, name, min, max);
+		exit(10);
+	}
+	return val;
+}
+
+/* idle, best-effort[:LEVEL] or realtime[:LEVEL], as for ionice */
+static int to_ioprio(const char *opt)
+{
+	const char *colon = strchr(opt, ':');
+	size_t len = colon ? (size_t)(colon - opt) : strlen(opt);
+	int class, level = 4;
+
+	if (len == 4 && !strncmp(opt, "idle", len)) {
+		class = IOPRIO_CLASS_IDLE;
+		level = 0;
+	} else if (len == 11 && !strncmp(opt, "best-effort", len)) {
+		class = IOPRIO_CLASS_BE;
+	} else if (len == 8 && !strncmp(opt, "realtime", len)) {
+		class = IOPRIO_CLASS_RT;
+	} else {
+		fprintf(stderr, "unknown I/O priority \"%s\"; should be one of \"idle\", "
+			"\"best-effort[:LEVEL]\", \"realtime[:LEVEL]\".\n", opt);
+		exit(10);
+	}
+	if (colon && class != IOPRIO_CLASS_IDLE)
+		level = to_long(colon + 1, "--ioprio level", 0, 7);
+	return class << 8 | level;
+}
+
+static uint64_t to_size(const char *opt, const char *name)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(opt, &end, 10);
+	if (errno || end == opt)
+		goto invalid;
+
+	switch (*end) {
+	case 'k': case 'K': val <<= 10; end++; break;
+	case 'm': case 'M': val <<= 20; end++; break;
+	case 'g': case 'G': val <<= 30; end++; break;
+	case 't': case 'T': val <<= 40; end++; break;
+	}
+	if (*end)
+		goto invalid;
+
+	return val;
+invalid:
+	fprintf(stderr, "invalid size \"%s\" for %s; expected a number with optional K, M, G or T suffix.\n",
+		opt, name);
+	exit(10);
+}
+
+static void to_compress(const char *opt)
+{
+	const char *colon = strchr(opt, ':');
+	size_t len = colon ? (size_t)(colon - opt) : strlen(opt);
+
+	if (len == 3 && !strncmp(opt, "lz4", len)) {
+		compress_algo = COMPRESS_LZ4;
+		compress_level = 1;
+	} else if (len == 4 && !strncmp(opt, "zstd", len)) {
+		compress_algo = COMPRESS_ZSTD;
+		compress_level = 3;
+	} else {
+		fprintf(stderr, "unknown compression \"%s\"; should be one of \"lz4[:LEVEL]\", \"zstd[:LEVEL]\".\n", opt);
+		exit(10);
+	}
+	if (colon)
+		compress_level = to_long(colon + 1, "--compress level", 1, 22);
+
+	if (!compress_supported(compress_algo)) {
+		fprintf(stderr, "%s was built without %s support.\n", PGM_NAME, compress_name(compress_algo));
+		exit(10);
+	}
+}
+
+/* OFFSET:LENGTH on the target, both with optional suffixes */
+static void to_range(const char *opt)
+{
+	const char *colon = strchr(opt, ':');
+	char *begin;
+	uint64_t length;
+
+	if (!colon) {
+		fprintf(stderr, "invalid range \"%s\"; expected OFFSET:LENGTH.\n", opt);
+		exit(10);
+	}
+	begin = strndup(opt, colon - opt);
+	if (!begin) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	range_begin = to_size(begin, "--range offset");
+	length = to_size(colon + 1, "--range length");
+	free(begin);
+	if (!length || range_begin + length < range_begin) {
+		fprintf(stderr, "invalid range \"%s\"; the length should be at least 1.\n", opt);
+		exit(10);
+	}
+	range_end = range_begin + length;
+}
+
 static enum stream_format to_stream_format(const char *opt)
 {
 	if (!strcmp(opt, "auto")) return STREAM_FORMAT_AUTO;
@@ -125,6 +887,19 @@ static enum stream_format to_stream_format(const char *opt)
 	exit(10);
 }
 
+/* "<stream id in hex>:<resume offset>", as thin_recv writes it into the checkpoint */
+static bool parse_resume_token(const char *token, uint64_t *id, uint64_t *offset)
+{
+	unsigned long long i, o;
+	int n = 0;
+
+	if (sscanf(token, "%16llx:%llu%n", &i, &o, &n) != 2 || (token[n] && token[n] != '\n'))
+		return false;
+	*id = i;
+	*offset = o;
+	return true;
+}
+
 int main(int argc, char **argv)
 {
 	if (argv == NULL || argc < 1) {
@@ -142,11 +917,51 @@ int main(int argc, char **argv)
 		{"allow-tty", no_argument, 0, 't' },
 		{"about",     no_argument, 0, 'a' },
 		{"accept-stream-format",     required_argument, 0, OPT_STREAM_FORMAT },
+		{"readers",   required_argument, 0, OPT_READERS },
+		{"max-io",    required_argument, 0, OPT_MAX_IO },
+		{"io-engine", required_argument, 0, OPT_IO_ENGINE },
+		{"io-depth",  required_argument, 0, OPT_IO_DEPTH },
+		{"writers",   required_argument, 0, OPT_WRITERS },
+		{"recv-buffer", required_argument, 0, OPT_RECV_BUFFER },
+		{"compress",  required_argument, 0, OPT_COMPRESS },
+		{"detect-zeroes", no_argument, 0, OPT_DETECT_ZEROES },
+		{"zero-elide", required_argument, 0, OPT_ZERO_ELIDE },
+		{"stream-metadata", no_argument, 0, OPT_STREAM_METADATA },
+		{"coalesce-gap", required_argument, 0, OPT_COALESCE_GAP },
+		{"metadata-tool", no_argument, 0, OPT_METADATA_TOOL },
+		{"print-extents", no_argument, 0, OPT_PRINT_EXTENTS },
+		{"batch",     no_argument, 0, OPT_BATCH },
+		{"resumable", no_argument, 0, OPT_RESUMABLE },
+		{"resume",    required_argument, 0, OPT_RESUME },
+		{"checkpoint", required_argument, 0, OPT_CHECKPOINT },
+		{"checkpoint-interval", required_argument, 0, OPT_CHECKPOINT_INTERVAL },
+		{"checksum",  no_argument, 0, OPT_CHECKSUM },
+		{"hash-manifest", required_argument, 0, OPT_HASH_MANIFEST },
+		{"block-size", required_argument, 0, OPT_BLOCK_SIZE },
+		{"connect",   required_argument, 0, OPT_CONNECT },
+		{"connections", required_argument, 0, OPT_CONNECTIONS },
+		{"stripe",    required_argument, 0, OPT_STRIPE },
+		{"listen",    required_argument, 0, OPT_LISTEN },
+		{"socket-buffer", required_argument, 0, OPT_SOCKET_BUFFER },
+		{"progress",  optional_argument, 0, OPT_PROGRESS },
+		{"stats-json", required_argument, 0, OPT_STATS_JSON },
+		{"extents",   required_argument, 0, OPT_EXTENTS },
+		{"file",      no_argument, 0, OPT_FILE },
+		{"rate-limit", required_argument, 0, OPT_RATE_LIMIT },
+		{"iops-limit", required_argument, 0, OPT_IOPS_LIMIT },
+		{"latency-target", required_argument, 0, OPT_LATENCY_TARGET },
+		{"throttle-file", required_argument, 0, OPT_THROTTLE_FILE },
+		{"ioprio",    required_argument, 0, OPT_IOPRIO },
+		{"index",     no_argument, 0, OPT_INDEX },
+		{"archive",   required_argument, 0, OPT_ARCHIVE },
+		{"range",     required_argument, 0, OPT_RANGE },
+		{"squash",    no_argument, 0, OPT_SQUASH },
+		{"inspect",   no_argument, 0, OPT_INSPECT },
 		{0,         0,             0, 0 }
 	};
 
 	bool send_mode = false, receive_mode = false, allow_tty = false;
-	int option_index, c;
+	int option_index, c, out_fd;
 
 	do {
 		c = getopt_long(argc, argv, "vsrta", long_options, &option_index);
@@ -172,6 +987,155 @@ int main(int argc, char **argv)
 		case OPT_STREAM_FORMAT:
 			stream_format = to_stream_format(optarg);
 			break;
+		case OPT_READERS:
+			n_readers = to_long(optarg, "--readers", 1, 256);
+			n_readers_set = true;
+			break;
+		case OPT_MAX_IO:
+			max_io_size = to_size(optarg, "--max-io");
+			if (max_io_size < 4096 || max_io_size > 1024 * 1024 * 1024) {
+				fputs("--max-io should be between 4K and 1G.\n", stderr);
+				exit(10);
+			}
+			max_io_size &= ~(size_t)4095; /* O_DIRECT alignment */
+			break;
+		case OPT_IO_ENGINE:
+			io_engine = to_io_engine(optarg);
+			break;
+		case OPT_IO_DEPTH:
+			io_depth = to_long(optarg, "--io-depth", 1, 1024);
+			break;
+		case OPT_WRITERS:
+			n_writers = to_long(optarg, "--writers", 1, 256);
+			n_writers_set = true;
+			break;
+		case OPT_RECV_BUFFER:
+			recv_buffer_size = to_size(optarg, "--recv-buffer");
+			if (recv_buffer_size < 4096) {
+				fputs("--recv-buffer should be at least 4K.\n", stderr);
+				exit(10);
+			}
+			recv_buffer_size &= ~(size_t)4095;
+			break;
+		case OPT_COMPRESS:
+			to_compress(optarg);
+			break;
+		case OPT_DETECT_ZEROES:
+			detect_zeroes = true;
+			break;
+		case OPT_ZERO_ELIDE:
+			zero_elide = to_zero_elide(optarg);
+			break;
+		case OPT_STREAM_METADATA:
+			stream_metadata = true;
+			break;
+		case OPT_COALESCE_GAP:
+			coalesce_gap = to_size(optarg, "--coalesce-gap");
+			break;
+		case OPT_METADATA_TOOL:
+			metadata_tool = true;
+			break;
+		case OPT_PRINT_EXTENTS:
+			print_extents = true;
+			break;
+		case OPT_BATCH:
+			batch_mode = true;
+			break;
+		case OPT_RESUMABLE:
+			resumable = true;
+			break;
+		case OPT_RESUME:
+			if (!parse_resume_token(optarg, &resume_id, &resume_offset)) {
+				fprintf(stderr, "invalid resume token \"%s\"; expected it as in the --checkpoint file.\n",
+					optarg);
+				exit(10);
+			}
+			resumable = true;
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_path = optarg;
+			break;
+		case OPT_CHECKSUM:
+			checksum = true;
+			break;
+		case OPT_HASH_MANIFEST:
+			hash_manifest_path = optarg;
+			break;
+		case OPT_BLOCK_SIZE:
+			manifest_block_size = to_size(optarg, "--block-size");
+			if (!manifest_block_size || manifest_block_size % 512) {
+				fputs("--block-size should be a multiple of 512.\n", stderr);
+				exit(10);
+			}
+			break;
+		case OPT_CONNECT:
+			connect_addr = optarg;
+			break;
+		case OPT_CONNECTIONS:
+			n_connections = to_long(optarg, "--connections", 1, MAX_CONNECTIONS);
+			break;
+		case OPT_STRIPE:
+			stripe_size = to_size(optarg, "--stripe");
+			break;
+		case OPT_LISTEN:
+			listen_addr = optarg;
+			break;
+		case OPT_SOCKET_BUFFER:
+			socket_buffer_size = to_size(optarg, "--socket-buffer");
+			if (socket_buffer_size > INT32_MAX) {
+				fputs("--socket-buffer should be below 2G.\n", stderr);
+				exit(10);
+			}
+			break;
+		case OPT_PROGRESS:
+			progress_interval = optarg ? to_long(optarg, "--progress", 1, 3600) : 2;
+			break;
+		case OPT_STATS_JSON:
+			stats_json_path = optarg;
+			break;
+		case OPT_EXTENTS:
+			extents_path = optarg;
+			break;
+		case OPT_FILE:
+			target_file = true;
+			break;
+		case OPT_RATE_LIMIT:
+			rate_limit = to_size(optarg, "--rate-limit");
+			break;
+		case OPT_IOPS_LIMIT:
+			iops_limit = to_long(optarg, "--iops-limit", 1, 10000000);
+			break;
+		case OPT_LATENCY_TARGET:
+			latency_target = to_long(optarg, "--latency-target", 1, 60000) * 1000000ULL;
+			break;
+		case OPT_THROTTLE_FILE:
+			throttle_path = optarg;
+			break;
+		case OPT_IOPRIO:
+			ioprio = to_ioprio(optarg);
+			break;
+		case OPT_INDEX:
+			stream_index = true;
+			break;
+		case OPT_ARCHIVE:
+			archive_path = optarg;
+			break;
+		case OPT_RANGE:
+			to_range(optarg);
+			break;
+		case OPT_SQUASH:
+			squash_mode = true;
+			break;
+		case OPT_INSPECT:
+			inspect_mode = true;
+			break;
+		case OPT_CHECKPOINT_INTERVAL:
+			checkpoint_interval = to_size(optarg, "--checkpoint-interval");
+			if (!checkpoint_interval) {
+				fputs("--checkpoint-interval should be at least 1.\n", stderr);
+				exit(10);
+			}
+			break;
 		case -1:
 			break;
 			/* case '?': unknown opt*/
@@ -189,27 +1153,120 @@ int main(int argc, char **argv)
 	if (!(send_mode || receive_mode) || (send_mode && receive_mode))
 		usage_exit(long_options, "Use --send or --receive\n");
 
+	/* before any thread or metadata tool is started, they inherit it */
+	if (ioprio != -1 && set_ioprio(ioprio >> 8, ioprio & 0xff))
+		exit(10);
+	throttle_setup(rate_limit, iops_limit, latency_target, throttle_path);
+
+	report_name = send_mode ? "thin_send" : "thin_recv";
+	if (progress_interval)
+		progress_start(report_name, progress_interval);
+	if (progress_interval || stats_json_path)
+		atexit(finish_report);
+
 	if (send_mode) {
-		if (optind != argc - 1 && optind != argc -2)
+		if (batch_mode && optind != argc - 1)
+			usage_exit(long_options, "The manifest expected as only positional argument\n");
+		if (batch_mode && resumable)
+			usage_exit(long_options, "Batch streams are not resumable\n");
+		if (!squash_mode && optind != argc - 1 && optind != argc -2)
 			usage_exit(long_options, "One or two positional arguments expected\n");
-
-		if (!allow_tty && isatty(fileno(stdout))) {
+		if (hash_manifest_path && (batch_mode || optind != argc - 1))
+			usage_exit(long_options, "A hash manifest only works when sending a whole volume\n");
+		if (n_connections > 1 && !connect_addr)
+			usage_exit(long_options, "--connections needs --connect\n");
+		if (n_connections > 1 && (batch_mode || resumable))
+			usage_exit(long_options, "Batch and resumable streams use a single connection\n");
+		if (io_engine == IO_ENGINE_DIRECT)
+			usage_exit(long_options, "--io-engine direct is for thin_recv\n");
+		if (stream_index && (batch_mode || n_connections > 1))
+			usage_exit(long_options, "An index is written for a single stream on a single connection\n");
+		if (squash_mode && (batch_mode || resumable || hash_manifest_path || extents_path ||
+				    print_extents || n_connections > 1))
+			usage_exit(long_options, "--squash writes a plain stream from stream files\n");
+		if (squash_mode && optind == argc)
+			usage_exit(long_options, "The stream files expected as positional arguments\n");
+		if (extents_path && (batch_mode || optind != argc - 1))
+			usage_exit(long_options, "--extents goes with a single source file\n");
+
+		if (!allow_tty && !print_extents && !connect_addr && isatty(fileno(stdout))) {
 			fprintf(stderr, "Not dumping the data stream onto your terminal\n"
 				"If you really like that try --allow-tty\n");
 			exit(10);
 		}
 
-		/* TODO: add some meta data? */
-		send_header(fileno(stdout), 0, 0, CMD_BEGIN_STREAM);
+		/* compression runs on the reader threads, one per CPU by default */
+		if (compress_algo != COMPRESS_NONE && !n_readers_set)
+			n_readers = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+		out_fd = connect_addr && !print_extents ? open_connections() : fileno(stdout);
+
+		if (batch_mode) {
+			thin_send_batch(argv[optind], out_fd);
+			close_connections(out_fd);
+			return 0;
+		}
+
+		if (squash_mode) {
+			thin_send_squash((const char *const *)argv + optind, argc - optind, out_fd);
+			close_connections(out_fd);
+			return 0;
+		}
+
+		if (hash_manifest_path) {
+			if (hash_manifest_read(&manifest, hash_manifest_path))
+				exit(10);
+			/* a block split over two reads is always sent */
+			if (max_io_size < manifest.block_size)
+				max_io_size = manifest.block_size;
+		}
+
+		if (!print_extents)
+			send_begin_stream(out_fd);
 		/* CMD_END_STREAM sent as last action in thin_send_vol/thin_send_diff */
 
-		if (optind == argc - 1)
-			thin_send_vol(argv[optind], fileno(stdout));
+		if (extents_path)
+			thin_send_file(argv[optind], extents_path, out_fd);
+		else if (optind == argc - 1)
+			thin_send_vol(argv[optind], out_fd);
 		else if (optind == argc - 2)
-			thin_send_diff(argv[optind], argv[optind + 1], fileno(stdout));
+			thin_send_diff(argv[optind], argv[optind + 1], out_fd);
+		close_connections(out_fd);
 	} else {
-		if (optind != argc - 1)
+		if (batch_mode && optind != argc)
+			usage_exit(long_options, "No positional arguments expected with --batch\n");
+		if (batch_mode && checkpoint_path)
+			usage_exit(long_options, "Batch streams are not resumable\n");
+		if (!batch_mode && !inspect_mode && optind != argc - 1)
 			usage_exit(long_options, "One positional argument expected\n");
+		if (inspect_mode && !batch_mode && optind != argc)
+			usage_exit(long_options, "No positional arguments expected with --inspect\n");
+		if (inspect_mode && (checkpoint_path || hash_manifest_path || listen_addr || archive_path))
+			usage_exit(long_options, "--inspect reads a stream from stdin\n");
+		if (hash_manifest_path && batch_mode)
+			usage_exit(long_options, "A hash manifest is written for one volume\n");
+		if (archive_path && (batch_mode || listen_addr || checkpoint_path || hash_manifest_path))
+			usage_exit(long_options, "--archive restores one volume from a file\n");
+		if (range_end != UINT64_MAX && !archive_path)
+			usage_exit(long_options, "--range needs --archive\n");
+
+		if (hash_manifest_path) {
+			thin_hash_target(argv[optind], hash_manifest_path);
+			return 0;
+		}
+
+		if (listen_addr) {
+			thin_receive_listen(batch_mode ? NULL : argv[optind]);
+			return 0;
+		}
+
+		if (archive_path) {
+			/* the threads read from the file, one per CPU by default */
+			if (!n_writers_set)
+				n_writers = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+			thin_receive_archive(argv[optind], archive_path);
+			return 0;
+		}
 
 		if (!allow_tty && isatty(fileno(stdin))) {
 			fprintf(stderr, "Expecting a data stream on stdin\n"
@@ -217,45 +1274,29 @@ int main(int argc, char **argv)
 			exit(10);
 		}
 
-		thin_receive(argv[optind], fileno(stdin));
+		if (batch_mode)
+			thin_receive_batch(fileno(stdin));
+		else
+			thin_receive(inspect_mode ? NULL : argv[optind], fileno(stdin), false);
 	}
 
 	return 0;
 }
 
-static char *get_thin_pool_dm_path(const struct snap_info *snap)
+/* Also on errors, how far it got can tell why */
+static void finish_report(void)
 {
-	char *thin_pool_dm_path, *cmdline;
-	int matches;
-	FILE *f;
-
-	checked_asprintf(&cmdline, "lvs --noheadings -o lv_dm_path %s/%s", snap->vg_name, snap->thin_pool_name);
-	f = popen(cmdline, "r");
-	if (!f) {
-		perror("popen failed");
-		exit(10);
-	}
-
-	matches = fscanf(f, " %ms", &thin_pool_dm_path);
-	if (matches != 1) {
-		fprintf(stderr, "failed to parse lvs output %d cmdline=%s\n", matches, cmdline);
-		exit(10);
-	}
-	pclose(f);
-
-	return thin_pool_dm_path;
+	progress_stop();
+	if (stats_json_path)
+		report_write_json(stats_json_path, report_name);
 }
 
-static void thin_send_diff(const char *snap1_name, const char *snap2_name, int out_fd)
+/* Runs the metadata tool into a tmp file, whose fd is returned for parsing */
+static int run_metadata_tool(const char *cmdline)
 {
-	struct stream_context ctx = { 0, };
-	struct snap_info snap1, snap2;
 	char tmp_file_name[] = "/tmp/thin_send_recv_XXXXXX";
-	char *thin_pool_dm_path;
-	int err, tmp_fd, snap2_fd;
-
-	get_snap_info(snap1_name, &snap1);
-	get_snap_info(snap2_name, &snap2);
+	uint64_t start;
+	int err, tmp_fd;
 
 	tmp_fd = mkstemp(tmp_file_name);
 	if (tmp_fd == -1) {
@@ -264,34 +1305,358 @@ static void thin_send_diff(const char *snap1_name, const char *snap2_name, int o
 	}
 	fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
 
-	thin_pool_dm_path = get_thin_pool_dm_path(&snap2);
-	const int lockfile_fd = lockfile_lock();
-	if (lockfile_fd == -1)
-		exit(10);
-	err = reserve_metadata_snap(thin_pool_dm_path);
+	start = report_now();
+	err = system_fmt("%s > %s", cmdline, tmp_file_name);
+	phase_add(PHASE_METADATA_TOOL, start, 0);
+	unlink(tmp_file_name);
 	if (err) {
-		unlink(tmp_file_name);
-		lockfile_unlock(lockfile_fd);
-		exit(10);
+		close(tmp_fd);
+		return -1;
 	}
 
-	err = system_fmt("thin_delta -m --snap1 %d --snap2 %d %s_tmeta > %s",
-			 snap1.thin_id, snap2.thin_id, thin_pool_dm_path,
-			 tmp_file_name);
-	unlink(tmp_file_name);
+	return tmp_fd;
+}
 
-	release_metadata_snap(thin_pool_dm_path);
-	lockfile_unlock(lockfile_fd);
+/*
+ * Runs the metadata tool while the metadata snapshot is reserved and
+ * spools its output into a tmp file, whose fd is returned for parsing.
+ */
+static int spool_metadata_tool(const char *thin_pool_dm_path, const char *cmdline)
+{
+	int err, tmp_fd;
 
+	err = reserve_metadata_snap(thin_pool_dm_path);
+	if (err)
+		exit(10);
+
+	tmp_fd = run_metadata_tool(cmdline);
+
+	release_metadata_snap(thin_pool_dm_path);
+	if (tmp_fd == -1)
+		exit(10);
+
+	return tmp_fd;
+}
+
+/* Called with the queue's mutex held */
+static struct extent *extent_queue_spill(struct extent_queue *q)
+{
+	if (!q->spill) {
+		q->spill = malloc(EXTENT_QUEUE_SPILL * sizeof(*q->spill));
+		if (!q->spill) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
+		q->tmp_fd = open_unlinked_tmp();
+	}
+	if (q->n_spill == EXTENT_QUEUE_SPILL) {
+		write_all(q->tmp_fd, (const char *)q->spill, q->n_spill * sizeof(*q->spill));
+		q->tmp_tail += q->n_spill;
+		q->n_spill = 0;
+	}
+	q->spilling = true;
+	return &q->spill[q->n_spill++];
+}
+
+static void extent_queue_push(struct extent_queue *q, enum cmd cmd, loff_t begin,
+			      size_t length, size_t block_size)
+{
+	struct extent *e;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->tail == q->size && !q->spilling) {
+		if (q->head > q->size / 2) {
+			memmove(q->extents, q->extents + q->head,
+				(q->tail - q->head) * sizeof(*q->extents));
+			q->tail -= q->head;
+			q->head = 0;
+		} else if (q->size < EXTENT_QUEUE_MEM) {
+			q->size = q->size ? 2 * q->size : 4096;
+			q->extents = realloc(q->extents, q->size * sizeof(*q->extents));
+			if (!q->extents) {
+				fputs("Out of memory.\n", stderr);
+				exit(10);
+			}
+		}
+	}
+	if (q->spilling || q->tail == q->size)
+		e = extent_queue_spill(q);
+	else
+		e = &q->extents[q->tail++];
+	e->cmd = cmd;
+	e->begin = begin;
+	e->length = length;
+	e->block_size = block_size;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void extent_queue_close(struct extent_queue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	q->done = true;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static void extent_queue_rewind(struct extent_queue *q)
+{
+	q->tmp_head = q->tmp_tail = 0;
+	if (q->spill && (lseek(q->tmp_fd, 0, SEEK_SET) == -1 || ftruncate(q->tmp_fd, 0))) {
+		perror("truncating the extent tmp file");
+		exit(10);
+	}
+}
+
+/* Called with the queue's mutex held, when there is nothing in extents */
+static void extent_queue_unspill(struct extent_queue *q)
+{
+	uint64_t n = q->tmp_tail - q->tmp_head;
+
+	q->head = q->tail = 0;
+	if (n) {
+		if (n > q->size)
+			n = q->size;
+		pread_archive(q->tmp_fd, q->extents, n * sizeof(*q->extents),
+			      q->tmp_head * sizeof(*q->extents));
+		q->tmp_head += n;
+		q->tail = n;
+		return;
+	}
+	/* the tmp file is drained, the spill buffer is next and the queue is in memory again */
+	memcpy(q->extents, q->spill, q->n_spill * sizeof(*q->extents));
+	q->tail = q->n_spill;
+	q->n_spill = 0;
+	extent_queue_rewind(q);
+	q->spilling = false;
+}
+
+/* Returns 0 once the queue is closed and empty */
+static size_t extent_queue_pop(struct extent_queue *q, struct extent *out, size_t max)
+{
+	size_t n;
+
+	pthread_mutex_lock(&q->mutex);
+	while (q->head == q->tail && !q->spilling && !q->done)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	if (q->head == q->tail && q->spilling)
+		extent_queue_unspill(q);
+	n = q->tail - q->head < max ? q->tail - q->head : max;
+	memcpy(out, q->extents + q->head, n * sizeof(*out));
+	q->head += n;
+	pthread_mutex_unlock(&q->mutex);
+
+	return n;
+}
+
+/* Forgets all extents, e.g. of a failed scan */
+static void extent_queue_clear(struct extent_queue *q)
+{
+	q->head = q->tail = 0;
+	q->n_spill = 0;
+	extent_queue_rewind(q);
+	q->spilling = false;
+}
+
+static void extent_queue_free(struct extent_queue *q)
+{
+	free(q->extents);
+	q->extents = NULL;
+	if (q->spill) {
+		free(q->spill);
+		q->spill = NULL;
+		close(q->tmp_fd);
+	}
+}
+
+/* Sends extents until the queue is closed and empty */
+static void send_queued_extents(struct stream_context *ctx, struct extent_queue *q)
+{
+	struct extent batch[256];
+	size_t i, n;
+
+	send_pipeline_start(ctx);
+	while ((n = extent_queue_pop(q, batch, sizeof(batch) / sizeof(batch[0]))))
+		for (i = 0; i < n; i++)
+			send_extent(ctx, batch[i].cmd, batch[i].begin, batch[i].length, batch[i].block_size);
+	send_pipeline_finish(ctx);
+}
+
+struct native_mappings {
+	struct stream_context ctx;
+	size_t block_size;
+};
+
+static void native_mapping(void *arg, enum thin_change change, uint64_t block)
+{
+	struct native_mappings *nm = arg;
+
+	coalesce_extent(&nm->ctx, change == THIN_LEFT_ONLY ? CMD_UNMAP : CMD_DATA,
+			block * nm->block_size, nm->block_size, nm->block_size);
+}
+
+/*
+ * Reads the extents of thin_id2, or where it differs from thin_id1 if that
+ * is >= 0, from the opened metadata snapshot into q. On failure, q is
+ * left empty.
+ */
+static bool native_extents(struct thin_metadata *md, int thin_id1, int thin_id2,
+			   struct extent_queue *q)
+{
+	struct native_mappings nm = { .ctx = { .extents = q } };
+	uint64_t start = report_now();
+	int err;
+
+	progress_scan(1);
+	nm.block_size = (size_t)thin_metadata_data_block_size(md) * 512;
+	if (thin_id1 >= 0)
+		err = thin_metadata_delta(md, thin_id1, thin_id2, native_mapping, &nm);
+	else
+		err = thin_metadata_dump(md, thin_id2, native_mapping, &nm);
+	flush_extent(&nm.ctx);
+	progress_scan(-1);
+	phase_add(PHASE_PARSE, start, 0);
+
+	if (err) {
+		extent_queue_clear(q);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Reads the extents straight from the held metadata snapshot into q,
+ * without thin_delta (thin_id1 >= 0) or thin_dump. Returns false if that
+ * does not work, the caller then falls back to the tool.
+ */
+static bool read_metadata_native(const char *thin_pool_dm_path, int thin_id1, int thin_id2,
+				 struct extent_queue *q)
+{
+	struct thin_metadata *md;
+	char *tmeta_path;
+	bool ok = false;
+	int err;
+
+	checked_asprintf(&tmeta_path, "%s_tmeta", thin_pool_dm_path);
+	err = reserve_metadata_snap(thin_pool_dm_path);
+	if (err)
+		exit(10);
+
+	md = thin_metadata_open(tmeta_path);
+	if (md) {
+		ok = native_extents(md, thin_id1, thin_id2, q);
+		thin_metadata_close(md);
+	}
+
+	release_metadata_snap(thin_pool_dm_path);
+	free(tmeta_path);
+
+	if (!ok) {
+		fprintf(stderr, "reading the metadata snapshot failed, falling back to %s\n",
+			thin_id1 >= 0 ? "thin_delta" : "thin_dump");
+		return false;
+	}
+	extent_queue_close(q);
+	return true;
+}
+
+/* Parses the tool's output as it comes, while the snapshot stays reserved */
+static void *metadata_tool_thread(void *arg)
+{
+	struct metadata_tool *mt = arg;
+	struct stream_context parse_ctx = { .extents = &mt->queue };
+	struct md_parser *md;
+	int ret;
+
+	md = md_parser_open(fileno(mt->f));
+	mt->parse(&parse_ctx, md);
+	md_parser_close(md);
+	ret = pclose(mt->f);
+	phase_add(PHASE_METADATA_TOOL, mt->started, 0);
+
+	release_metadata_snap(mt->thin_pool_dm_path);
+	if (!(WIFEXITED(ret) && WEXITSTATUS(ret) == 0)) {
+		fprintf(stderr, "cmd %s exited with %d\n", mt->cmdline, WEXITSTATUS(ret));
+		exit(10);
+	}
+
+	extent_queue_close(&mt->queue);
+	return NULL;
+}
+
+/*
+ * Overlapped mode: read the metadata tool's stdout through a pipe and send
+ * data while it is still running. The parser thread buffers the extents
+ * in memory, so the tool is not held up by the data transfer and the
+ * metadata snapshot is released as soon as the tool exits.
+ */
+static void send_from_metadata_tool(struct stream_context *ctx, const char *thin_pool_dm_path,
+				    const char *cmdline,
+				    void (*parse)(struct stream_context *ctx, struct md_parser *md))
+{
+	struct metadata_tool mt = {
+		.thin_pool_dm_path = thin_pool_dm_path,
+		.cmdline = cmdline,
+		.parse = parse,
+	};
+	int err;
+
+	pthread_mutex_init(&mt.queue.mutex, NULL);
+	pthread_cond_init(&mt.queue.cond, NULL);
+
+	err = reserve_metadata_snap(thin_pool_dm_path);
 	if (err)
 		exit(10);
 
-	yyin = fdopen(tmp_fd, "r");
-	if (!yyin) {
-		perror("failed to open tmpfile");
+	mt.started = report_now();
+	mt.f = popen(cmdline, "re");
+	if (!mt.f) {
+		perror("popen failed");
+		exit(10); /* releases the metadata snapshot in the atexit handler */
+	}
+	err = pthread_create(&mt.thread, NULL, metadata_tool_thread, &mt);
+	if (err) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
 		exit(10);
 	}
 
+	send_queued_extents(ctx, &mt.queue);
+
+	pthread_join(mt.thread, NULL);
+	extent_queue_free(&mt.queue);
+	pthread_mutex_destroy(&mt.queue.mutex);
+	pthread_cond_destroy(&mt.queue.cond);
+}
+
+static void thin_send_diff(const char *snap1_name, const char *snap2_name, int out_fd)
+{
+	struct stream_context ctx = { 0, };
+	const char *names[] = { snap1_name, snap2_name };
+	struct snap_info infos[2], snap1, snap2;
+	char *thin_pool_dm_path, *cmdline;
+	struct extent_queue extents = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	int snap2_fd, md_fd = -1;
+	uint64_t start;
+	bool native;
+
+	/* one lookup, so at most one lvs call for both */
+	start = report_now();
+	lookup_snaps(names, 2, infos);
+	phase_add(PHASE_LOOKUP, start, 0);
+	snap1 = infos[0];
+	snap2 = infos[1];
+
+	thin_pool_dm_path = lookup_thin_pool_dm_path(&snap2);
+	checked_asprintf(&cmdline, "thin_delta -m --snap1 %d --snap2 %d %s_tmeta",
+			 snap1.thin_id, snap2.thin_id, thin_pool_dm_path);
+	native = !metadata_tool &&
+		read_metadata_native(thin_pool_dm_path, snap1.thin_id, snap2.thin_id, &extents);
+	if (!native && !stream_metadata)
+		md_fd = spool_metadata_tool(thin_pool_dm_path, cmdline);
+
 	if (!snap2.active)
 		system_fmt("lvchange --ignoreactivationskip --activate y %s", snap2_name);
 
@@ -304,11 +1669,25 @@ static void thin_send_diff(const char *snap1_name, const char *snap2_name, int o
 	ctx.in_fd = snap2_fd;
 	ctx.out_fd = out_fd;
 	ctx.n_chunks = 2; /* begin and end marker count */
-	parse_diff(&ctx);
+	send_stream_id(&ctx, &snap1, &snap2);
+	if (native) {
+		send_queued_extents(&ctx, &extents);
+	} else if (stream_metadata) {
+		send_from_metadata_tool(&ctx, thin_pool_dm_path, cmdline, parse_diff);
+	} else {
+		struct md_parser *md = md_parser_open(md_fd);
+
+		send_pipeline_start(&ctx);
+		parse_diff(&ctx, md);
+		send_pipeline_finish(&ctx);
+		md_parser_close(md);
+		close(md_fd);
+	}
 	send_end_stream(&ctx);
 
-	fclose(yyin);
 	close(snap2_fd);
+	extent_queue_free(&extents);
+	free(cmdline);
 
 	if (!snap2.active)
 		system_fmt("lvchange --activate n %s", snap2_name);
@@ -318,44 +1697,23 @@ static void thin_send_vol(const char *vol_name, int out_fd)
 {
 	struct stream_context ctx = { 0, };
 	struct snap_info vol;
-	char tmp_file_name[] = "/tmp/thin_send_recv_XXXXXX";
-	char *thin_pool_dm_path;
-	int err, tmp_fd, vol_fd;
+	char *thin_pool_dm_path, *cmdline;
+	struct extent_queue extents = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	int vol_fd, md_fd = -1;
+	bool native;
 
 	get_snap_info(vol_name, &vol);
 
-	tmp_fd = mkstemp(tmp_file_name);
-	if (tmp_fd == -1) {
-		perror("failed creating tmp file");
-		exit(10);
-	}
-	fcntl(tmp_fd, F_SETFD, FD_CLOEXEC);
-
-	thin_pool_dm_path = get_thin_pool_dm_path(&vol);
-	const int lockfile_fd = lockfile_lock();
-	if (lockfile_fd == -1)
-		exit(10);
-	err = reserve_metadata_snap(thin_pool_dm_path);
-	if (err) {
-		unlink(tmp_file_name);
-		lockfile_unlock(lockfile_fd);
-		exit(10);
-	}
-
-	err = system_fmt("thin_dump -m --dev-id %d %s_tmeta > %s",
-			 vol.thin_id, thin_pool_dm_path, tmp_file_name);
-	unlink(tmp_file_name);
-
-	release_metadata_snap(thin_pool_dm_path);
-	lockfile_unlock(lockfile_fd);
-	if (err)
-		exit(10);
-
-	yyin = fdopen(tmp_fd, "r");
-	if (!yyin) {
-		perror("failed to open tmpfile");
-		exit(10);
-	}
+	thin_pool_dm_path = lookup_thin_pool_dm_path(&vol);
+	checked_asprintf(&cmdline, "thin_dump -m --dev-id %d %s_tmeta",
+			 vol.thin_id, thin_pool_dm_path);
+	native = !metadata_tool &&
+		read_metadata_native(thin_pool_dm_path, -1, vol.thin_id, &extents);
+	if (!native && !stream_metadata)
+		md_fd = spool_metadata_tool(thin_pool_dm_path, cmdline);
 
 	vol_fd = open(vol.dm_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
 	if (vol_fd == -1) {
@@ -366,157 +1724,794 @@ static void thin_send_vol(const char *vol_name, int out_fd)
 	ctx.in_fd = vol_fd;
 	ctx.out_fd = out_fd;
 	ctx.n_chunks = 2; /* begin and end marker count */
-	parse_dump(&ctx);
+	if (manifest.hashes && device_size(vol_fd, &ctx.volume_size))
+		exit(10);
+	send_stream_id(&ctx, NULL, &vol);
+	if (native) {
+		send_queued_extents(&ctx, &extents);
+	} else if (stream_metadata) {
+		send_from_metadata_tool(&ctx, thin_pool_dm_path, cmdline, parse_dump);
+	} else {
+		struct md_parser *md = md_parser_open(md_fd);
+
+		send_pipeline_start(&ctx);
+		parse_dump(&ctx, md);
+		send_pipeline_finish(&ctx);
+		md_parser_close(md);
+		close(md_fd);
+	}
+	/* the unmapped tail of the volume */
+	if (manifest.hashes)
+		zero_manifest_gap(&ctx, ctx.volume_size);
 	send_end_stream(&ctx);
 
-	fclose(yyin);
 	close(vol_fd);
+	extent_queue_free(&extents);
+	free(cmdline);
 }
 
-static void thin_receive(const char *snap_name, int in_fd)
+/* O_DIRECT where the file system supports it, tmpfs does not */
+static int open_source_file(const char *path)
 {
-	struct snap_info snap;
-	char *snap_file_name;
-	int out_fd;
-	bool cont;
-	struct stream_context ctx = { 0, };
-
-	get_snap_info(snap_name, &snap);
+	int fd;
 
-	checked_asprintf(&snap_file_name, "/dev/%s/%s", snap.vg_name, snap.lv_name);
-	out_fd = open(snap_file_name, O_WRONLY | O_CLOEXEC);
-	if (out_fd == -1) {
-		perror("failed to open snap");
+	fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd == -1 && errno == EINVAL)
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
 		exit(10);
 	}
-	free(snap_file_name);
-
-	ctx.in_fd = in_fd;
-	ctx.out_fd = out_fd;
-	do {
-		cont = process_input(&ctx);
-	} while (cont);
+	return fd;
+}
 
-	if (ctx.n_begin_stream && !ctx.n_end_stream) {
-		fprintf(stderr, "Missing END_STREAM marker.\n");
+/*
+ * Sends a file, or any block device, with the extents listed in a file
+ * of thin_delta or thin_dump output, without LVM. For benchmarks and tests.
+ */
+static void thin_send_file(const char *path, const char *extents_path, int out_fd)
+{
+	struct stream_context ctx = { 0, };
+	struct snap_info file = {
+		.vg_name = "",
+		.thin_pool_name = "",
+		.lv_name = (char *)path,
+		.thin_id = -1,
+	};
+	struct md_parser *md;
+	char head[4096];
+	ssize_t len;
+	bool diff;
+	int md_fd;
+
+	md_fd = open(extents_path, O_RDONLY | O_CLOEXEC);
+	if (md_fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", extents_path, strerror(errno));
 		exit(10);
 	}
-	if (ctx.n_chunks == 0) {
-		fprintf(stderr, "Empty input.\n");
-		if (stream_format == STREAM_FORMAT_1_1)
-			exit(10);
+	/* thin_delta output has a diff where thin_dump's has a device */
+	len = pread(md_fd, head, sizeof(head) - 1, 0);
+	if (len == -1) {
+		fprintf(stderr, "reading %s failed: %s\n", extents_path, strerror(errno));
+		exit(10);
+	}
+	head[len] = 0;
+	diff = strstr(head, "<diff") != NULL;
+	if (diff && manifest.hashes) {
+		fputs("A hash manifest only works with thin_dump output\n", stderr);
+		exit(10);
 	}
 
-	close(out_fd);
+	ctx.in_fd = open_source_file(path);
+	ctx.out_fd = out_fd;
+	ctx.n_chunks = 2; /* begin and end marker count */
+	if (manifest.hashes && device_size(ctx.in_fd, &ctx.volume_size))
+		exit(10);
+	send_stream_id(&ctx, NULL, &file);
+
+	md = md_parser_open(md_fd);
+	send_pipeline_start(&ctx);
+	if (diff)
+		parse_diff(&ctx, md);
+	else
+		parse_dump(&ctx, md);
+	send_pipeline_finish(&ctx);
+	md_parser_close(md);
+	close(md_fd);
+
+	if (manifest.hashes)
+		zero_manifest_gap(&ctx, ctx.volume_size);
+	send_end_stream(&ctx);
+	close(ctx.in_fd);
 }
 
-static void get_snap_info(const char *snap_name, struct snap_info *info)
+/* A line of the batch manifest */
+struct batch_entry {
+	char *snap1_name;	/* NULL to send all of snap2 */
+	char *snap2_name;
+	char *target;
+	struct snap_info snap1, snap2;
+	char *thin_pool_dm_path;
+	struct extent_queue extents;
+};
+
+/* Scan threads take the pools one by one, each scans all entries of its pool */
+struct batch {
+	struct batch_entry *entries;
+	int n_entries;
+	char **pools;
+	int n_pools;
+	int next_pool;
+	pthread_mutex_t mutex;
+};
+
+/*
+ * One volume per line, "volume target" for all of it or "snapshot1
+ * snapshot2 target" for the difference. "#" starts a comment.
+ */
+static void read_manifest(const char *manifest, struct batch *b)
 {
-	char *cmdline;
-	char *attr;
-	int matches;
-	FILE *f;
+	FILE *f = strcmp(manifest, "-") ? fopen(manifest, "re") : stdin;
+	char *line = NULL, *field[4], *hash;
+	size_t line_size = 0;
+	int n, line_nr = 0, size = 0;
 
-	checked_asprintf(&cmdline, "lvs --noheadings -o vg_name,lv_name,pool_lv,lv_dm_path,thin_id,attr %s", snap_name);
-	f = popen(cmdline, "r");
 	if (!f) {
-		perror("popen failed");
+		fprintf(stderr, "failed to open %s: %s\n", manifest, strerror(errno));
 		exit(10);
 	}
 
-	matches = fscanf(f, " %ms %ms %ms %ms %d %ms",
-			 &info->vg_name,
-			 &info->lv_name,
-			 &info->thin_pool_name,
-			 &info->dm_path,
-			 &info->thin_id,
-			 &attr);
-	if (matches != 6 || strlen(attr) < 5) {
-		fprintf(stderr, "failed to parse lvs output %d cmdline=%s\n", matches, cmdline);
-		exit(10);
+	while (getline(&line, &line_size, f) != -1) {
+		struct batch_entry *e;
+
+		line_nr++;
+		hash = strchr(line, '#');
+		if (hash)
+			*hash = 0;
+		n = sscanf(line, "%ms %ms %ms %ms", &field[0], &field[1], &field[2], &field[3]);
+		if (n <= 0)
+			continue;
+		if (n < 2 || n > 3 || strlen(field[n - 1]) > BATCH_MAX_TARGET) {
+			fprintf(stderr, "%s:%d: expected \"volume target\" or \"snapshot1 snapshot2 target\"\n",
+				manifest, line_nr);
+			exit(10);
+		}
+
+		if (b->n_entries == size) {
+			size = size ? 2 * size : 64;
+			b->entries = realloc(b->entries, size * sizeof(*b->entries));
+			if (!b->entries) {
+				fputs("Out of memory.\n", stderr);
+				exit(10);
+			}
+		}
+		e = &b->entries[b->n_entries++];
+		memset(e, 0, sizeof(*e));
+		e->snap1_name = n == 3 ? field[0] : NULL;
+		e->snap2_name = field[n - 2];
+		e->target = field[n - 1];
+		pthread_mutex_init(&e->extents.mutex, NULL);
+		pthread_cond_init(&e->extents.cond, NULL);
 	}
-	info->active = attr[4] == 'a';
+	free(line);
+	if (f != stdin)
+		fclose(f);
 
-	free(cmdline);
-	free(attr);
-	pclose(f);
+	if (!b->n_entries) {
+		fprintf(stderr, "%s: nothing to send\n", manifest);
+		exit(10);
+	}
 }
 
-static void usage_exit(const struct option *long_options, const char *reason)
+/* All names in one lookup, so at most one lvs call for the whole batch */
+static void lookup_batch(struct batch *b)
 {
-	const struct option *opt;
+	const char **names = malloc(2 * b->n_entries * sizeof(*names));
+	struct snap_info *infos = malloc(2 * b->n_entries * sizeof(*infos));
+	uint64_t start;
+	int i, j, n = 0;
+
+	b->pools = malloc(b->n_entries * sizeof(*b->pools));
+	if (!names || !infos || !b->pools) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
 
-	if (reason)
-		fputs(reason, stderr);
+	for (i = 0; i < b->n_entries; i++) {
+		if (b->entries[i].snap1_name)
+			names[n++] = b->entries[i].snap1_name;
+		names[n++] = b->entries[i].snap2_name;
+	}
+	start = report_now();
+	lookup_snaps(names, n, infos);
+	phase_add(PHASE_LOOKUP, start, 0);
 
-	fputs("\nUSAGE:\n"
-	      "thin_send [options] snapshot1 snapshot2\n"
-	      "thin_send [options] volume|snapshot\n"
-	      "thin_recv [options] volume|snapshot\n"
-	      "\n"
-	      "Options:\n", stderr);
+	for (i = 0, n = 0; i < b->n_entries; i++) {
+		struct batch_entry *e = &b->entries[i];
 
-	for (opt = long_options; opt->name; opt++)
-		fprintf(stderr, "  --%s | -%c\n", opt->name, opt->val);
+		if (e->snap1_name)
+			e->snap1 = infos[n++];
+		e->snap2 = infos[n++];
+		e->thin_pool_dm_path = lookup_thin_pool_dm_path(&e->snap2);
 
-	exit(10);
-}
+		for (j = 0; j < b->n_pools; j++)
+			if (!strcmp(b->pools[j], e->thin_pool_dm_path))
+				break;
+		if (j == b->n_pools)
+			b->pools[b->n_pools++] = e->thin_pool_dm_path;
+	}
 
-static void expected_got(int expected, int got)
-{
-	fprintf(stderr, "Got unexpected token %d. Expected a %d\n", got, expected);
-	exit(20);
+	free(names);
+	free(infos);
 }
 
-static int expect(int expected)
+/* Fills the entry's queue, from md if possible, while the pool's snapshot is reserved */
+static void scan_batch_entry(struct batch_entry *e, struct thin_metadata *md)
 {
-        int token;
-        token = yylex();
-        if (token != expected) {
-                expected_got(expected, token);
-        }
-        return token;
-}
+	struct stream_context parse_ctx = { .extents = &e->extents };
+	int thin_id1 = e->snap1_name ? e->snap1.thin_id : -1;
+	struct md_parser *parser;
+	char *cmdline;
+	int md_fd;
 
-static void expect_tag(int tag)
-{
-	expect('<');
-	expect(tag);
+	if (md && native_extents(md, thin_id1, e->snap2.thin_id, &e->extents))
+		goto done;
+
+	if (e->snap1_name)
+		checked_asprintf(&cmdline, "thin_delta -m --snap1 %d --snap2 %d %s_tmeta",
+				 e->snap1.thin_id, e->snap2.thin_id, e->thin_pool_dm_path);
+	else
+		checked_asprintf(&cmdline, "thin_dump -m --dev-id %d %s_tmeta",
+				 e->snap2.thin_id, e->thin_pool_dm_path);
+	if (!metadata_tool)
+		fprintf(stderr, "reading the metadata snapshot failed for %s, falling back to %s\n",
+			e->snap2_name, e->snap1_name ? "thin_delta" : "thin_dump");
+
+	md_fd = run_metadata_tool(cmdline);
+	if (md_fd == -1)
+		exit(10);
+	parser = md_parser_open(md_fd);
+	if (e->snap1_name)
+		parse_diff(&parse_ctx, parser);
+	else
+		parse_dump(&parse_ctx, parser);
+	md_parser_close(parser);
+	close(md_fd);
+	free(cmdline);
+done:
+	extent_queue_close(&e->extents);
 }
 
-static void expect_end_tag(int tag)
+static void *batch_scan_thread(void *arg)
 {
-	expect('<');
-	expect('/');
-	expect(tag);
-	expect('>');
+	struct batch *b = arg;
+	struct thin_metadata *md;
+	char *pool, *tmeta_path;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&b->mutex);
+		pool = b->next_pool < b->n_pools ? b->pools[b->next_pool++] : NULL;
+		pthread_mutex_unlock(&b->mutex);
+		if (!pool)
+			break;
+
+		if (reserve_metadata_snap(pool))
+			exit(10);
+
+		md = NULL;
+		if (!metadata_tool) {
+			checked_asprintf(&tmeta_path, "%s_tmeta", pool);
+			md = thin_metadata_open(tmeta_path);
+			free(tmeta_path);
+		}
+
+		for (i = 0; i < b->n_entries; i++)
+			if (!strcmp(b->entries[i].thin_pool_dm_path, pool))
+				scan_batch_entry(&b->entries[i], md);
+
+		if (md)
+			thin_metadata_close(md);
+		release_metadata_snap(pool);
+	}
+
+	return NULL;
 }
 
-static const char *expect_attribute(int attribute)
+/* Starts the stream of the index'th volume of a batch; without target, ends the batch */
+static void send_volume(int out_fd, uint64_t index, const char *target)
 {
-	expect(attribute);
-	expect('=');
-	expect(TK_VALUE);
-	return str_value;
+	size_t length = target ? strlen(target) : 0;
+
+	if (print_extents) {
+		if (target)
+			printf("volume %s\n", target);
+		return;
+	}
+
+	send_header(out_fd, index, length, CMD_VOLUME);
+	if (length)
+		write_all(out_fd, target, length);
 }
 
-/**
- * Parse the "flags" attribute and the following "version" attribute, ignoring flags if it does
- * not exist.
- */
-static void expect_flags_and_or_version()
+static void send_batch_entry(struct batch_entry *e, int index, int out_fd)
 {
-	int token = yylex();
-	switch(token) {
+	struct stream_context ctx = { 0, };
+	struct extent_queue *q = &e->extents;
+	bool activate = e->snap1_name && !e->snap2.active;
+	int in_fd;
+
+	/* a failed native read empties the queue again, so wait for the complete list */
+	pthread_mutex_lock(&q->mutex);
+	while (!q->done)
+		pthread_cond_wait(&q->cond, &q->mutex);
+	pthread_mutex_unlock(&q->mutex);
+
+	if (activate)
+		system_fmt("lvchange --ignoreactivationskip --activate y %s", e->snap2_name);
+
+	in_fd = open(e->snap2.dm_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (in_fd == -1) {
+		fprintf(stderr, "failed to open %s with %d %s\n", e->snap2.dm_path, errno, strerror(errno));
+		exit(10);
+	}
+
+	send_volume(out_fd, index, e->target);
+	if (!print_extents)
+		send_begin_stream(out_fd);
+
+	ctx.in_fd = in_fd;
+	ctx.out_fd = out_fd;
+	ctx.n_chunks = 2; /* begin and end marker count */
+	send_queued_extents(&ctx, q);
+	send_end_stream(&ctx);
+
+	close(in_fd);
+	extent_queue_free(q);
+
+	if (activate)
+		system_fmt("lvchange --activate n %s", e->snap2_name);
+}
+
+/*
+ * Sends the volumes of the manifest as one batch stream: each as a
+ * complete stream of its own, preceded by a VOLUME chunk naming the target.
+ * The metadata is scanned once per pool, on up to MAX_RESERVATIONS pools
+ * concurrently, while the volumes scanned so far are sent in manifest order.
+ */
+static void thin_send_batch(const char *manifest, int out_fd)
+{
+	struct batch b = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t threads[MAX_RESERVATIONS];
+	int i, n_threads, err;
+
+	read_manifest(manifest, &b);
+	lookup_batch(&b);
+
+	n_threads = b.n_pools < MAX_RESERVATIONS ? b.n_pools : MAX_RESERVATIONS;
+	for (i = 0; i < n_threads; i++) {
+		err = pthread_create(&threads[i], NULL, batch_scan_thread, &b);
+		if (err) {
+			fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+			exit(10);
+		}
+	}
+
+	for (i = 0; i < b.n_entries; i++)
+		send_batch_entry(&b.entries[i], i, out_fd);
+	send_volume(out_fd, b.n_entries, NULL);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < b.n_entries; i++) {
+		free(b.entries[i].snap1_name);
+		free(b.entries[i].snap2_name);
+		free(b.entries[i].target);
+		pthread_mutex_destroy(&b.entries[i].extents.mutex);
+		pthread_cond_destroy(&b.entries[i].extents.cond);
+	}
+	free(b.entries);
+	free(b.pools);
+}
+
+/* In a batch, the volume's stream ends with its END_STREAM marker */
+static void thin_receive(const char *snap_name, int in_fd, bool batch)
+{
+	struct stream_context ctx = { 0, };
+	struct inspect_report report = { .bucket_size = 1024 * 1024 };
+	struct stat sb;
+
+	ctx.in_fd = in_fd;
+	if (!fstat(in_fd, &sb) && S_ISREG(sb.st_mode))
+		ctx.in_size = sb.st_size;
+	if (inspect_mode) {
+		ctx.out_fd = -1;
+		ctx.inspect = &report;
+		receive_stream(&ctx, batch);
+		print_inspect_report(&ctx, snap_name);
+		return;
+	}
+	ctx.out_fd = open_target(snap_name);
+	zero_elide_setup(ctx.out_fd);
+	receive_stream(&ctx, batch);
+	close(ctx.out_fd);
+}
+
+static int open_target(const char *snap_name)
+{
+	struct snap_info snap;
+	char *snap_file_name;
+	int out_fd;
+
+	if (target_file) {
+		out_fd = open(snap_name, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+		if (out_fd == -1) {
+			fprintf(stderr, "failed to open %s: %s\n", snap_name, strerror(errno));
+			exit(10);
+		}
+		return out_fd;
+	}
+
+	get_snap_info(snap_name, &snap);
+
+	checked_asprintf(&snap_file_name, "/dev/%s/%s", snap.vg_name, snap.lv_name);
+	out_fd = open(snap_file_name, O_WRONLY | O_CLOEXEC);
+	if (out_fd == -1) {
+		perror("failed to open snap");
+		exit(10);
+	}
+	free(snap_file_name);
+	return out_fd;
+}
+
+/* After process_input() ran out of input */
+static void verify_stream_complete(struct stream_context *ctx, bool batch)
+{
+	if ((ctx->n_begin_stream || batch) && !ctx->n_end_stream) {
+		fprintf(stderr, "Missing END_STREAM marker.\n");
+		exit(10);
+	}
+	if (ctx->n_chunks == 0) {
+		fprintf(stderr, "Empty input.\n");
+		if (stream_format == STREAM_FORMAT_1_1)
+			exit(10);
+	}
+}
+
+static void receive_stream(struct stream_context *ctx, bool batch)
+{
+	bool cont;
+
+	if (!ctx->inspect)
+		recv_pipeline_start(ctx);
+	do {
+		cont = process_input(ctx);
+		if (checkpoint_path && ctx->bytes_data - ctx->checkpoint_bytes >= checkpoint_interval)
+			write_checkpoint(ctx);
+	} while (cont && !(batch && ctx->n_end_stream));
+	discard_planner_finish(ctx);
+	recv_pipeline_finish(ctx);
+	verify_stream_complete(ctx, batch);
+
+	/* complete, nothing to resume */
+	if (checkpoint_path && ctx->n_end_stream && unlink(checkpoint_path) && errno != ENOENT)
+		fprintf(stderr, "removing checkpoint %s failed: %s\n", checkpoint_path, strerror(errno));
+}
+
+/* Writes the hash manifest of the target, for thin_send --hash-manifest */
+static void thin_hash_target(const char *snap_name, const char *path)
+{
+	struct hash_manifest m;
+	struct snap_info snap;
+	uint64_t block_size = manifest_block_size;
+	char *thin_pool_dm_path, *snap_file_name;
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int fd;
+
+	if (target_file) {
+		fd = open_source_file(snap_name);
+	} else {
+		get_snap_info(snap_name, &snap);
+		if (!block_size) {
+			thin_pool_dm_path = lookup_thin_pool_dm_path(&snap);
+			if (pool_data_block_size(thin_pool_dm_path, &block_size))
+				block_size = 64 * 1024;
+			free(thin_pool_dm_path);
+		}
+
+		checked_asprintf(&snap_file_name, "/dev/%s/%s", snap.vg_name, snap.lv_name);
+		fd = open(snap_file_name, O_RDONLY | O_DIRECT | O_CLOEXEC);
+		if (fd == -1) {
+			perror("failed to open snap");
+			exit(10);
+		}
+		free(snap_file_name);
+	}
+	if (!block_size)
+		block_size = 64 * 1024;
+
+	if (hash_manifest_build(&m, fd, block_size, n_cpus > 1 ? n_cpus : 1) ||
+	    hash_manifest_write(&m, path))
+		exit(10);
+	hash_manifest_free(&m);
+	close(fd);
+}
+
+/* Receives the volumes of a batch stream, as sent by thin_send_batch() */
+static void thin_receive_batch(int in_fd)
+{
+	struct stream_context ctx = { .in_fd = in_fd };
+	char target[BATCH_MAX_TARGET + 1];
+	struct chunk chunk;
+	uint64_t index;
+	size_t length;
+
+	for (index = 0; ; index++) {
+		if (read_complete(&ctx, &chunk, sizeof(chunk)) != sizeof(chunk)) {
+			fprintf(stderr, "Batch stream ended after %"PRIu64" volumes, without end marker\n",
+				index);
+			exit(10);
+		}
+		length = be64toh(chunk.length);
+		if (be64toh(chunk.magic) != MAGIC_VALUE_1_1 || be32toh(chunk.cmd) != CMD_VOLUME ||
+		    be64toh(chunk.offset) != index || length > BATCH_MAX_TARGET) {
+			fprintf(stderr, "Expected VOLUME chunk for volume %"PRIu64" of the batch\n", index);
+			exit(10);
+		}
+		if (!length)
+			break;
+
+		if (read_complete(&ctx, target, length) != length) {
+			fputs("Truncated input.\n", stderr);
+			exit(10);
+		}
+		target[length] = 0;
+		thin_receive(target, in_fd, true);
+	}
+
+	if (read_complete(&ctx, &chunk, 1)) {
+		fprintf(stderr, "Trailing garbage beyond the end of the batch\n");
+		exit(10);
+	}
+}
+
+/* On stdout, after the stream passed the same checks as when it is applied */
+static void print_inspect_report(const struct stream_context *ctx, const char *name)
+{
+	const struct inspect_report *r = ctx->inspect;
+	int i;
+
+	if (name)
+		printf("volume %s\n", name);
+	printf("chunks %"PRIu64"\n", ctx->n_chunks);
+	if (ctx->has_stream_id)
+		printf("stream-id %016"PRIx64"\n", ctx->stream_id);
+	printf("data %"PRIu64" %"PRIu64"\n", ctx->n_data, ctx->bytes_data);
+	printf("compressed %"PRIu64" %"PRIu64"\n", r->n_compressed, r->bytes_compressed);
+	printf("zero %"PRIu64" %"PRIu64"\n", ctx->n_zero, ctx->bytes_zero);
+	printf("unmap %"PRIu64" %"PRIu64"\n", ctx->n_unmap, r->bytes_unmap);
+	printf("checksum %"PRIu64"\n", r->n_checksum);
+	if (r->n_optional)
+		printf("unknown-optional %"PRIu64"\n", r->n_optional);
+	for (i = 0; i < INSPECT_BUCKETS; i++) {
+		if (r->bucket_extents[i])
+			printf("offset %"PRIu64" %"PRIu64" %"PRIu64"\n", i * r->bucket_size,
+			       r->bucket_extents[i], r->bucket_bytes[i]);
+	}
+	fflush(stdout);
+}
+
+/* thin_recv --listen: the connections of the stream, as they announce themselves */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t nonce;
+	uint32_t count;		/* 0 until the first CONNECTION chunk */
+	bool seen[MAX_CONNECTIONS];
+	int n_finished;
+} listen_state = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *receive_connection(void *arg)
+{
+	struct stream_context *ctx = arg;
+
+	receive_stream(ctx, false);
+	close(ctx->in_fd);
+
+	pthread_mutex_lock(&listen_state.mutex);
+	listen_state.n_finished++;
+	pthread_cond_broadcast(&listen_state.cond);
+	pthread_mutex_unlock(&listen_state.mutex);
+	return NULL;
+}
+
+/*
+ * Receives a stream sent with thin_send --connect, from one connection or
+ * from all of them, each applied by a thread of its own. Without snap_name
+ * it is a batch stream, which always comes over one connection.
+ */
+static void thin_receive_listen(const char *snap_name)
+{
+	pthread_t threads[MAX_CONNECTIONS];
+	struct stream_context *conns;
+	int listen_fd, out_fd, fd, i, n = 1, err;
+
+	listen_fd = net_listen(listen_addr, socket_buffer_size);
+	if (listen_fd == -1)
+		exit(10);
+	if (!snap_name) {
+		fd = net_accept(listen_fd);
+		if (fd == -1)
+			exit(10);
+		close(listen_fd);
+		thin_receive_batch(fd);
+		close(fd);
+		return;
+	}
+
+	out_fd = open_target(snap_name);
+	zero_elide_setup(out_fd);
+	conns = calloc(MAX_CONNECTIONS, sizeof(*conns));
+	if (!conns) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+
+	for (i = 0; i < n; i++) {
+		conns[i].in_fd = net_accept(listen_fd);
+		if (conns[i].in_fd == -1)
+			exit(10);
+		conns[i].out_fd = out_fd;
+		conns[i].shared_target = i > 0;
+		err = pthread_create(&threads[i], NULL, receive_connection, &conns[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+			exit(10);
+		}
+
+		/* the first connection tells how many follow, a plain stream ends before */
+		if (i == 0) {
+			pthread_mutex_lock(&listen_state.mutex);
+			while (!listen_state.count && !listen_state.n_finished)
+				pthread_cond_wait(&listen_state.cond, &listen_state.mutex);
+			if (listen_state.count)
+				n = listen_state.count;
+			pthread_mutex_unlock(&listen_state.mutex);
+		}
+	}
+	close(listen_fd);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < (int)listen_state.count; i++) {
+		if (!listen_state.seen[i]) {
+			fprintf(stderr, "Connection %d of %u did not identify itself\n",
+				i, listen_state.count);
+			exit(10);
+		}
+	}
+
+	free(conns);
+	close(out_fd);
+}
+
+static void get_snap_info(const char *snap_name, struct snap_info *info)
+{
+	uint64_t start = report_now();
+
+	lookup_snaps(&snap_name, 1, info);
+	phase_add(PHASE_LOOKUP, start, 0);
+}
+
+static void usage_exit(const struct option *long_options, const char *reason)
+{
+	const struct option *opt;
+
+	if (reason)
+		fputs(reason, stderr);
+
+	fputs("\nUSAGE:\n"
+	      "thin_send [options] snapshot1 snapshot2\n"
+	      "thin_send [options] volume|snapshot\n"
+	      "thin_send [options] --batch manifest\n"
+	      "thin_send [options] --connect host:port [--connections N] ...\n"
+	      "thin_send [options] --extents thin_delta-or-thin_dump-output file\n"
+	      "thin_send [options] --squash stream-file...\n"
+	      "thin_recv [options] volume|snapshot\n"
+	      "thin_recv [options] --batch\n"
+	      "thin_recv [options] --hash-manifest file volume|snapshot\n"
+	      "thin_recv [options] --listen [host:]port volume|snapshot\n"
+	      "thin_recv [options] --file file\n"
+	      "thin_recv [options] --archive file [--range offset:length] volume|snapshot\n"
+	      "thin_recv [options] --inspect [--batch]\n"
+	      "\n"
+	      "Options:\n", stderr);
+
+	for (opt = long_options; opt->name; opt++) {
+		if (opt->val < 0x100)
+			fprintf(stderr, "  --%s | -%c\n", opt->name, opt->val);
+		else
+			fprintf(stderr, "  --%s%s\n", opt->name,
+				opt->has_arg == required_argument ? "=..." : "");
+	}
+
+	exit(10);
+}
+
+static void expected_got(int expected, int got)
+{
+	fprintf(stderr, "Got unexpected token %d. Expected a %d\n", got, expected);
+	exit(20);
+}
+
+static int expect(struct md_parser *md, int expected)
+{
+        int token;
+        token = md_lex(md);
+        if (token != expected) {
+                expected_got(expected, token);
+        }
+        return token;
+}
+
+static void expect_tag(struct md_parser *md, int tag)
+{
+	expect(md, '<');
+	expect(md, tag);
+}
+
+static void expect_end_tag(struct md_parser *md, int tag)
+{
+	expect(md, '<');
+	expect(md, '/');
+	expect(md, tag);
+	expect(md, '>');
+}
+
+static void expect_attribute(struct md_parser *md, int attribute)
+{
+	expect(md, attribute);
+	expect(md, '=');
+	expect(md, TK_VALUE);
+}
+
+static uint64_t expect_number_attribute(struct md_parser *md, int attribute)
+{
+	uint64_t value;
+	const char *str;
+	size_t len;
+
+	expect_attribute(md, attribute);
+	if (!md_value_u64(md, &value)) {
+		str = md_value(md, &len);
+		fprintf(stderr, "Got \"%.*s\" for attribute %d. Expected a number\n",
+			(int)len, str, attribute);
+		exit(20);
+	}
+	return value;
+}
+
+/**
+ * Parse the "flags" attribute and the following "version" attribute, ignoring flags if it does
+ * not exist.
+ */
+static void expect_flags_and_or_version(struct md_parser *md)
+{
+	int token = md_lex(md);
+	switch(token) {
 		case TK_FLAGS:
-			expect('=');
-			expect(TK_VALUE);
+			expect(md, '=');
+			expect(md, TK_VALUE);
 			// After flags, we expect version, so parse this here as well.
-			expect(TK_VERSION);
+			expect(md, TK_VERSION);
 			/* fall through */
 		case TK_VERSION:
-			expect('=');
-			expect(TK_VALUE);
+			expect(md, '=');
+			expect(md, TK_VALUE);
 			break;
 		default:
 			fprintf(stderr, "Got unexpected token %d. Expected a %d or %d\n", token, TK_FLAGS, TK_VERSION);
@@ -525,135 +2520,184 @@ static void expect_flags_and_or_version()
 
 }
 
-static void parse_diff(struct stream_context *ctx)
+/*
+ * Joins an extent to the pending one if it directly follows it. DATA
+ * extents are also joined across a gap of up to coalesce_gap bytes,
+ * which are then sent along with them: fewer, larger I/Os for a bit
+ * of extra data. The pending extent is sent once the next one does not fit.
+ */
+static void coalesce_extent(struct stream_context *ctx, enum cmd cmd, loff_t begin,
+			    size_t length, size_t block_size)
 {
-	long block_size;
-	int in_fd = ctx->in_fd;
-	int out_fd = ctx->out_fd;
+	struct extent *p = &ctx->pending;
+	loff_t p_end = p->begin + p->length;
+
+	if (p->length && p->cmd == cmd && p->block_size == block_size && begin >= p_end &&
+	    (begin == p_end || (cmd == CMD_DATA && begin - p_end <= coalesce_gap))) {
+		p->length = begin + length - p->begin;
+		return;
+	}
+
+	flush_extent(ctx);
+	p->cmd = cmd;
+	p->begin = begin;
+	p->length = length;
+	p->block_size = block_size;
+}
+
+static void flush_extent(struct stream_context *ctx)
+{
+	struct extent *p = &ctx->pending;
+
+	if (!p->length)
+		return;
+	progress_plan(p->cmd == CMD_DATA, p->length);
+	if (ctx->extents) {
+		send_extent(ctx, p->cmd, p->begin, p->length, p->block_size);
+	} else {
+		uint64_t start = report_now();
+
+		send_extent(ctx, p->cmd, p->begin, p->length, p->block_size);
+		ctx->send_ns += report_now() - start;
+	}
+	p->length = 0;
+}
 
-	expect_tag(TK_SUPERBLOCK);
-	expect_attribute(TK_UUID);
-	expect_attribute(TK_TIME);
-	expect_attribute(TK_TRANSACTION);
-	block_size = atol(expect_attribute(TK_DATA_BLOCK_SIZE));
-	expect_attribute(TK_NR_DATA_BLOCKS);
-	expect('>');
+static void parse_diff(struct stream_context *ctx, struct md_parser *md)
+{
+	uint64_t start = report_now();
+	long block_size;
 
-	expect_tag(TK_DIFF);
-	expect_attribute(TK_LEFT);
-	expect_attribute(TK_RIGHT);
-	expect('>');
+	progress_scan(1);
+	ctx->send_ns = 0;
+	expect_tag(md, TK_SUPERBLOCK);
+	expect_attribute(md, TK_UUID);
+	expect_attribute(md, TK_TIME);
+	expect_attribute(md, TK_TRANSACTION);
+	block_size = expect_number_attribute(md, TK_DATA_BLOCK_SIZE);
+	expect_attribute(md, TK_NR_DATA_BLOCKS);
+	expect(md, '>');
+
+	expect_tag(md, TK_DIFF);
+	expect_attribute(md, TK_LEFT);
+	expect_attribute(md, TK_RIGHT);
+	expect(md, '>');
 
 	while (true) {
 		loff_t begin;
 		size_t length;
 		int token;
 
-		expect('<');
-		token = yylex();
+		expect(md, '<');
+		token = md_lex(md);
 		switch (token) {
 		case TK_DIFFERENT:
 		case TK_SAME:
 		case TK_RIGHT_ONLY:
 		case TK_LEFT_ONLY:
-			begin = atoll(expect_attribute(TK_BEGIN));
-			length = atoll(expect_attribute(TK_LENGTH));
-			expect('/');
-			expect('>');
+			begin = expect_number_attribute(md, TK_BEGIN);
+			length = expect_number_attribute(md, TK_LENGTH);
+			expect(md, '/');
+			expect(md, '>');
 
 			break;
 		case '/':
 			goto break_loop;
+		default:
+			expected_got(TK_DIFFERENT, token);
 		}
-		if (token == TK_DIFFERENT || token == TK_RIGHT_ONLY) {
-			send_chunk(in_fd, out_fd,
-				   begin * block_size * 512,
-				   length * block_size * 512,
-				   block_size * 512);
-			ctx->n_data++;
-			ctx->n_chunks++;
-		} else if (token == TK_LEFT_ONLY) {
-			send_header(out_fd,
-				    begin * block_size * 512,
-				    length * block_size * 512,
-				    CMD_UNMAP);
-			ctx->n_unmap++;
-			ctx->n_chunks++;
-		}
+		if (token == TK_DIFFERENT || token == TK_RIGHT_ONLY)
+			coalesce_extent(ctx, CMD_DATA,
+					begin * block_size * 512,
+					length * block_size * 512,
+					block_size * 512);
+		else if (token == TK_LEFT_ONLY)
+			coalesce_extent(ctx, CMD_UNMAP,
+					begin * block_size * 512,
+					length * block_size * 512,
+					block_size * 512);
 	}
 break_loop:
-	expect(TK_DIFF);
-	expect('>');
+	flush_extent(ctx);
+	progress_scan(-1);
+	phase_add(PHASE_PARSE, start + ctx->send_ns, 0);
+	expect(md, TK_DIFF);
+	expect(md, '>');
 
-	expect_end_tag(TK_SUPERBLOCK);
+	expect_end_tag(md, TK_SUPERBLOCK);
 }
 
-static void parse_dump(struct stream_context *ctx)
+static void parse_dump(struct stream_context *ctx, struct md_parser *md)
 {
+	uint64_t start = report_now();
 	long block_size;
-	int in_fd = ctx->in_fd;
-	int out_fd = ctx->out_fd;
 
-	expect_tag(TK_SUPERBLOCK);
-	expect_attribute(TK_UUID);
-	expect_attribute(TK_TIME);
-	expect_attribute(TK_TRANSACTION);
-	expect_flags_and_or_version();
-	block_size = atol(expect_attribute(TK_DATA_BLOCK_SIZE));
-	expect_attribute(TK_NR_DATA_BLOCKS);
-	expect('>');
-
-	expect_tag(TK_DEVICE);
-	expect_attribute(TK_DEV_ID);
-	expect_attribute(TK_MAPPED_BLOCKS);
-	expect_attribute(TK_TRANSACTION);
-	expect_attribute(TK_CREATION_TIME);
-	expect_attribute(TK_SNAP_TIME);
-	expect('>');
+	progress_scan(1);
+	ctx->send_ns = 0;
+	expect_tag(md, TK_SUPERBLOCK);
+	expect_attribute(md, TK_UUID);
+	expect_attribute(md, TK_TIME);
+	expect_attribute(md, TK_TRANSACTION);
+	expect_flags_and_or_version(md);
+	block_size = expect_number_attribute(md, TK_DATA_BLOCK_SIZE);
+	expect_attribute(md, TK_NR_DATA_BLOCKS);
+	expect(md, '>');
+
+	expect_tag(md, TK_DEVICE);
+	expect_attribute(md, TK_DEV_ID);
+	expect_attribute(md, TK_MAPPED_BLOCKS);
+	expect_attribute(md, TK_TRANSACTION);
+	expect_attribute(md, TK_CREATION_TIME);
+	expect_attribute(md, TK_SNAP_TIME);
+	expect(md, '>');
 
 	while (true) {
 		loff_t begin;
 		size_t length;
 		int token;
 
-		expect('<');
-		token = yylex();
+		expect(md, '<');
+		token = md_lex(md);
 		switch (token) {
 		case TK_SINGLE_MAPPING:
 			length = 1;
-			begin = atoll(expect_attribute(TK_ORIGIN_BLOCK));
-			expect_attribute(TK_DATA_BLOCK);
-			expect_attribute(TK_TIME);
+			begin = expect_number_attribute(md, TK_ORIGIN_BLOCK);
+			expect_attribute(md, TK_DATA_BLOCK);
+			expect_attribute(md, TK_TIME);
 			break;
 		case TK_RANGE_MAPPING:
-			begin = atoll(expect_attribute(TK_ORIGIN_BEGIN));
-			expect_attribute(TK_DATA_BEGIN);
-			length = atoll(expect_attribute(TK_LENGTH));
-			expect_attribute(TK_TIME);
+			begin = expect_number_attribute(md, TK_ORIGIN_BEGIN);
+			expect_attribute(md, TK_DATA_BEGIN);
+			length = expect_number_attribute(md, TK_LENGTH);
+			expect_attribute(md, TK_TIME);
 			break;
 
 		case '/':
 			goto break_loop;
+		default:
+			expected_got(TK_SINGLE_MAPPING, token);
 		}
-		expect('/');
-		expect('>');
+		expect(md, '/');
+		expect(md, '>');
 
-		send_chunk(in_fd, out_fd,
-			   begin * block_size * 512,
-			   length * block_size * 512,
-			   block_size * 512);
-		ctx->n_chunks++;
-		ctx->n_data++;
+		coalesce_extent(ctx, CMD_DATA,
+				begin * block_size * 512,
+				length * block_size * 512,
+				block_size * 512);
 	}
 break_loop:
-	expect(TK_DEVICE);
-	expect('>');
+	flush_extent(ctx);
+	progress_scan(-1);
+	phase_add(PHASE_PARSE, start + ctx->send_ns, 0);
+	expect(md, TK_DEVICE);
+	expect(md, '>');
 
-	expect_end_tag(TK_SUPERBLOCK);
+	expect_end_tag(md, TK_SUPERBLOCK);
 }
 
 static void write_all(int out_fd, const char *data, const size_t count)
 {
+	uint64_t start = report_now();
 	size_t write_offset = 0;
 	do {
 		const ssize_t write_rc = write(out_fd, &data[write_offset], count - write_offset);
@@ -664,10 +2708,35 @@ static void write_all(int out_fd, const char *data, const size_t count)
 			exit(10);
 		}
 	} while (write_offset < count);
+	phase_add(PHASE_STREAM_WRITE, start, count);
+}
+
+static void send_stream_stats_ext(struct stream_context *ctx)
+{
+	struct stream_stats_ext ext = {
+		.n_zero = htobe64(ctx->n_zero),
+		.bytes_data = htobe64(ctx->bytes_data),
+		.bytes_zero = htobe64(ctx->bytes_zero),
+	};
+	send_header(ctx->out_fd, 0, sizeof(ext), CMD_STREAM_STATS_EXT);
+	write_all(ctx->out_fd, (const char *)&ext, sizeof(ext));
 }
 
 static void send_end_stream(struct stream_context *ctx)
 {
+	if (print_extents)
+		return;
+
+	/* Streams without features stay byte compatible with older versions */
+	if (stream_features()) {
+		ctx->n_chunks++;
+		send_stream_stats_ext(ctx);
+	}
+	if (stream_index) {
+		ctx->n_chunks++;
+		send_stream_index(ctx);
+	}
+
 	/* Maybe add "total bytes in stream", "checksum over full stream"? */
 	struct stream_stats stats = {
 		.n_chunks = htobe64(ctx->n_chunks),
@@ -678,6 +2747,69 @@ static void send_end_stream(struct stream_context *ctx)
 	write_all(ctx->out_fd, (const char *)&stats, sizeof(stats));
 }
 
+/* How much follows the chunk header; UNMAP and ZERO give the length on the target */
+static uint64_t payload_length(enum cmd cmd, uint64_t length)
+{
+	return cmd == CMD_UNMAP || cmd == CMD_ZERO ? 0 : length;
+}
+
+/* For spilling what does not fit into memory; gone once it is closed */
+static int open_unlinked_tmp(void)
+{
+	char tmp_file_name[] = "/tmp/thin_send_recv_XXXXXX";
+	int fd;
+
+	fd = mkstemp(tmp_file_name);
+	if (fd == -1) {
+		perror("failed creating tmp file");
+		exit(10);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	unlink(tmp_file_name);
+	return fd;
+}
+
+#define INDEX_BUF_ENTRIES 4096
+
+/*
+ * thin_send --index: the chunks sent so far, in stream byte order. The
+ * latest ones are in entries, all before them in an unlinked tmp file.
+ */
+static struct {
+	struct index_entry entries[INDEX_BUF_ENTRIES];
+	size_t n;
+	uint64_t n_spilled;
+	int tmp_fd;		/* -1 until entries fills up */
+	uint64_t pos;		/* where the next chunk starts */
+} send_index = { .tmp_fd = -1 };
+
+static void index_add(loff_t begin, size_t length, enum cmd cmd)
+{
+	struct index_entry *e;
+
+	if (send_index.n == INDEX_BUF_ENTRIES) {
+		if (send_index.tmp_fd == -1)
+			send_index.tmp_fd = open_unlinked_tmp();
+		write_all(send_index.tmp_fd, (const char *)send_index.entries, sizeof(send_index.entries));
+		send_index.n_spilled += send_index.n;
+		send_index.n = 0;
+	}
+	e = &send_index.entries[send_index.n++];
+	e->pos = htobe64(send_index.pos);
+	e->offset = htobe64(begin);
+	e->length = htobe64(length);
+	e->cmd = htobe32(cmd);
+	e->raw_length = 0;
+	send_index.pos += sizeof(struct chunk) + payload_length(cmd, length);
+}
+
+/* For the DATA_COMPRESSED chunk just sent, which is still in entries */
+static void index_raw_length(size_t raw_length)
+{
+	send_index.entries[send_index.n - 1].raw_length = htobe32(raw_length);
+}
+
+/* Every chunk header goes through here, the payload follows it */
 static void send_header(int out_fd, loff_t begin, size_t length, enum cmd cmd)
 {
 	struct chunk chunk = {
@@ -686,13 +2818,110 @@ static void send_header(int out_fd, loff_t begin, size_t length, enum cmd cmd)
 		.length = htobe64(length),
 		.cmd = htobe32(cmd),
 	};
+	if (stream_index && cmd != CMD_STREAM_INDEX && cmd != CMD_END_STREAM)
+		index_add(begin, length, cmd);
 	write_all(out_fd, (const char *) &chunk, sizeof(chunk));
 }
 
-static bool is_fifo(int fd)
+static void send_stream_index(struct stream_context *ctx)
 {
-	struct stat sb;
-	int err;
+	const uint64_t n_entries = send_index.n_spilled + send_index.n;
+	struct stream_index trailer = {
+		.n_entries = htobe64(n_entries),
+		.pos = htobe64(send_index.pos),
+	};
+	struct index_entry buf[256];
+	uint64_t done, n;
+
+	send_header(ctx->out_fd, 0, n_entries * sizeof(*buf) + sizeof(trailer), CMD_STREAM_INDEX);
+	for (done = 0; done < send_index.n_spilled; done += n) {
+		n = send_index.n_spilled - done;
+		if (n > sizeof(buf) / sizeof(*buf))
+			n = sizeof(buf) / sizeof(*buf);
+		pread_archive(send_index.tmp_fd, buf, n * sizeof(*buf), done * sizeof(*buf));
+		write_all(ctx->out_fd, (const char *)buf, n * sizeof(*buf));
+	}
+	write_all(ctx->out_fd, (const char *)send_index.entries, send_index.n * sizeof(*buf));
+	write_all(ctx->out_fd, (const char *)&trailer, sizeof(trailer));
+	if (send_index.tmp_fd != -1)
+		close(send_index.tmp_fd);
+	send_index.tmp_fd = -1;
+	send_index.n = send_index.n_spilled = 0;
+}
+
+static uint64_t stream_features(void)
+{
+	uint64_t features = 0;
+
+	if (compress_algo == COMPRESS_LZ4)
+		features |= FEATURE_LZ4;
+	if (compress_algo == COMPRESS_ZSTD)
+		features |= FEATURE_ZSTD;
+	if (detect_zeroes || manifest.hashes)
+		features |= FEATURE_ZERO;
+	if (checksum)
+		features |= FEATURE_CHECKSUM;
+
+	return features | squash_features;
+}
+
+static void send_begin_stream(int out_fd)
+{
+	struct stream_begin begin = {
+		.features = htobe64(stream_features()),
+	};
+
+	/* Without features, keep the stream readable by older receivers */
+	if (!begin.features) {
+		send_header(out_fd, 0, 0, CMD_BEGIN_STREAM);
+		return;
+	}
+	send_header(out_fd, 0, sizeof(begin), CMD_BEGIN_STREAM);
+	write_all(out_fd, (const char *)&begin, sizeof(begin));
+}
+
+/* Identifies the source of a stream; a snapshot recreated under the same name gets a new thin id */
+static uint64_t stream_identity(const struct snap_info *snap1, const struct snap_info *snap2)
+{
+	char *desc;
+	uint64_t id;
+	int len;
+
+	len = checked_asprintf(&desc, "%s/%s:%d %s/%s/%s:%d",
+			       snap1 ? snap1->vg_name : "", snap1 ? snap1->lv_name : "",
+			       snap1 ? snap1->thin_id : -1,
+			       snap2->vg_name, snap2->thin_pool_name, snap2->lv_name, snap2->thin_id);
+	id = (uint64_t)~crc32c(~0U, desc, len) << 32 | ~crc32c(0, desc, len);
+	free(desc);
+
+	return id;
+}
+
+static void send_stream_id(struct stream_context *ctx, const struct snap_info *snap1,
+			   const struct snap_info *snap2)
+{
+	uint64_t id = stream_identity(snap1, snap2);
+	struct stream_id sid = {
+		.id = htobe64(id),
+		.resume_offset = htobe64(resume_offset),
+	};
+
+	if (resume_offset && id != resume_id) {
+		fputs("The resume token belongs to a different stream.\n", stderr);
+		exit(10);
+	}
+	if (!resumable || print_extents)
+		return;
+
+	ctx->n_chunks++;
+	send_header(ctx->out_fd, 0, sizeof(sid), CMD_STREAM_ID);
+	write_all(ctx->out_fd, (const char *)&sid, sizeof(sid));
+}
+
+static bool is_fifo(int fd)
+{
+	struct stat sb;
+	int err;
 
 	err = fstat(fd, &sb);
 	if (err) {
@@ -702,8 +2931,14 @@ static bool is_fifo(int fd)
 	return S_ISFIFO(sb.st_mode);
 }
 
-static size_t splice_data(int in_fd, int out_fd, size_t len)
+/*
+ * out_pos is where out_fd is, if it is the target, or -1. What was written
+ * there is dropped from the page cache again; the previous piece as well,
+ * its writeback has started by now.
+ */
+static size_t splice_data(int in_fd, int out_fd, size_t len, loff_t out_pos)
 {
+	loff_t prev_pos = out_pos;
 	ssize_t ret;
 
 	do {
@@ -715,18 +2950,25 @@ static size_t splice_data(int in_fd, int out_fd, size_t len)
 			exit(10);
 		}
 		len -= ret;
-		posix_fadvise(out_fd, 0, 0, POSIX_FADV_DONTNEED);
+		if (out_pos != -1) {
+			out_pos += ret;
+			posix_fadvise(out_fd, prev_pos, out_pos - prev_pos, POSIX_FADV_DONTNEED);
+			prev_pos = out_pos - ret;
+		}
 	} while (len);
 
 	return len;
 }
 
-static size_t splice_data_with_fifo(int in_fd, int out_fd, size_t len, int pipe_fd[2])
+static size_t splice_data_with_fifo(int in_fd, int out_fd, loff_t out_pos, size_t len,
+				    int pipe_fd[2], enum phase in_phase, enum phase out_phase)
 {
 	ssize_t ret_pipe;
 	ssize_t ret_out;
+	uint64_t start;
 
 	do {
+		start = report_now();
 		ret_pipe = splice(in_fd, NULL, pipe_fd[1], NULL, len, SPLICE_F_MOVE);
 		if (ret_pipe == 0) {
 			break;
@@ -734,27 +2976,472 @@ static size_t splice_data_with_fifo(int in_fd, int out_fd, size_t len, int pipe_
 			perror("splice(data_with_fifo)");
 			exit(10);
 		}
-
-		ret_out = splice_data(pipe_fd[0], out_fd, ret_pipe);
+		if (in_phase == PHASE_DEVICE_READ)
+			throttle_done(start, ret_pipe);
+		phase_add(in_phase, start, ret_pipe);
+
+		start = report_now();
+		ret_out = splice_data(pipe_fd[0], out_fd, ret_pipe, out_pos);
+		if (out_phase == PHASE_DEVICE_WRITE)
+			throttle_done(start, ret_pipe);
+		phase_add(out_phase, start, ret_pipe);
 		if (ret_out != 0) {
 			fprintf(stderr, "Incomplete splice out: %zd bytes remaining.\n", ret_out);
 			break;
 		}
 		len -= ret_pipe;
+		if (out_pos != -1)
+			out_pos += ret_pipe;
 	} while (len);
 
 	return len;
 }
 
+/* thin_send --connections: spreads the stream written into a pipe over the connections */
+static struct {
+	int in_fd;
+	int n_conns;
+	struct stream_context *conns;	/* counts for the END_STREAM of each */
+	uint64_t nonce;
+	unsigned int next;
+	pthread_t thread;
+} striper;
+
+static struct stream_context *stripe_pick(loff_t offset)
+{
+	if (stripe_size)
+		return &striper.conns[(offset / stripe_size) % striper.n_conns];
+	return &striper.conns[striper.next++ % striper.n_conns];
+}
+
+static void send_connection(struct stream_context *c, uint32_t index)
+{
+	struct connection_info info = {
+		.nonce = htobe64(striper.nonce),
+		.index = htobe32(index),
+		.count = htobe32(striper.n_conns),
+	};
+
+	send_begin_stream(c->out_fd);
+	send_header(c->out_fd, 0, sizeof(info), CMD_CONNECTION);
+	write_all(c->out_fd, (const char *)&info, sizeof(info));
+	c->n_chunks = 3; /* begin, connection and end marker */
+}
+
+/*
+ * Each connection gets a BEGIN_STREAM, CONNECTION and END_STREAM of its
+ * own, the chunks in between are passed on with splice().
+ */
+static void *striper_thread(void *arg)
+{
+	struct stream_context in = { .in_fd = striper.in_fd };
+	struct stream_context *c = NULL;
+	struct compressed_data cd;
+	struct chunk chunk;
+	bool after_checksum = false;
+	uint64_t length;
+	enum cmd cmd;
+	int i;
+
+	while (read_complete(&in, &chunk, sizeof(chunk))) {
+		length = be64toh(chunk.length);
+		cmd = be32toh(chunk.cmd);
+
+		switch (cmd) {
+		case CMD_BEGIN_STREAM:
+			skip_input(&in, length);
+			for (i = 0; i < striper.n_conns; i++)
+				send_connection(&striper.conns[i], i);
+			continue;
+		case CMD_STREAM_STATS_EXT:
+			/* replaced by the one of each connection */
+			skip_input(&in, length);
+			continue;
+		case CMD_END_STREAM:
+			skip_input(&in, length);
+			for (i = 0; i < striper.n_conns; i++)
+				send_end_stream(&striper.conns[i]);
+			in.n_end_stream++;
+			continue;
+		default:
+			break;
+		}
+
+		/* the data a checksum is for follows it on the same connection */
+		if (!after_checksum)
+			c = stripe_pick(be64toh(chunk.offset));
+		after_checksum = cmd == CMD_CHECKSUM;
+
+		write_all(c->out_fd, (const char *)&chunk, sizeof(chunk));
+		c->n_chunks++;
+		switch (cmd) {
+		case CMD_DATA:
+			c->n_data++;
+			c->bytes_data += length;
+			break;
+		case CMD_DATA_COMPRESSED:
+			if (length < sizeof(cd) || read_complete(&in, &cd, sizeof(cd)) != sizeof(cd)) {
+				fputs("Truncated input.\n", stderr);
+				exit(10);
+			}
+			write_all(c->out_fd, (const char *)&cd, sizeof(cd));
+			length -= sizeof(cd);
+			c->n_data++;
+			c->bytes_data += be64toh(cd.raw_length);
+			break;
+		case CMD_ZERO:
+			c->n_zero++;
+			c->bytes_zero += length;
+			length = 0;
+			break;
+		case CMD_UNMAP:
+			c->n_unmap++;
+			length = 0;
+			break;
+		default:
+			break;
+		}
+		if (length && splice_data(striper.in_fd, c->out_fd, length, -1)) {
+			fputs("Truncated input.\n", stderr);
+			exit(10);
+		}
+	}
+	if (!in.n_end_stream) {
+		fputs("Missing END_STREAM marker.\n", stderr);
+		exit(10);
+	}
+	return NULL;
+}
+
+/* Where thin_send writes the stream: the socket, or a pipe to the striper */
+static int open_connections(void)
+{
+	int pipe_fd[2], i, err;
+
+	if (n_connections == 1) {
+		i = net_connect(connect_addr, socket_buffer_size);
+		if (i == -1)
+			exit(10);
+		return i;
+	}
+
+	striper.n_conns = n_connections;
+	striper.conns = calloc(n_connections, sizeof(*striper.conns));
+	if (!striper.conns) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < n_connections; i++) {
+		striper.conns[i].out_fd = net_connect(connect_addr, socket_buffer_size);
+		if (striper.conns[i].out_fd == -1)
+			exit(10);
+	}
+	if (getrandom(&striper.nonce, sizeof(striper.nonce), 0) != sizeof(striper.nonce)) {
+		perror("getrandom()");
+		exit(10);
+	}
+	if (pipe2(pipe_fd, O_CLOEXEC)) {
+		perror("pipe()");
+		exit(10);
+	}
+	/* a whole chunk fits, the sender does not wait for each connection's turn */
+	fcntl(pipe_fd[1], F_SETPIPE_SZ, max_io_size);
+	striper.in_fd = pipe_fd[0];
+
+	err = pthread_create(&striper.thread, NULL, striper_thread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		exit(10);
+	}
+	return pipe_fd[1];
+}
+
+static void close_connections(int out_fd)
+{
+	int i;
+
+	if (!connect_addr || print_extents)
+		return;
+	close(out_fd);
+	if (n_connections == 1)
+		return;
+
+	pthread_join(striper.thread, NULL);
+	for (i = 0; i < striper.n_conns; i++)
+		close(striper.conns[i].out_fd);
+	close(striper.in_fd);
+	free(striper.conns);
+}
+
+static void pread_all(int fd, char *buf, size_t count, loff_t offset)
+{
+	uint64_t start;
+	size_t done = 0;
+
+	throttle_io(count);
+	start = report_now();
+
+	while (done < count) {
+		const ssize_t ret = pread(fd, buf + done, count - done, offset + done);
+		if (ret > 0) {
+			done += ret;
+		} else if (ret == 0) {
+			fprintf(stderr, "Short read at %jd, %zu bytes missing.\n",
+				(intmax_t)(offset + done), count - done);
+			exit(10);
+		} else if (errno != EINTR) {
+			fprintf(stderr, "pread(%jd, %zu): %m\n", (intmax_t)(offset + done), count - done);
+			exit(10);
+		}
+	}
+	throttle_done(start, count);
+	phase_add(PHASE_DEVICE_READ, start, count);
+}
+
+static void pwrite_all(int fd, const char *buf, size_t count, loff_t offset)
+{
+	uint64_t start;
+	size_t done = 0;
+
+	throttle_io(count);
+	start = report_now();
+
+	while (done < count) {
+		const ssize_t ret = pwrite(fd, buf + done, count - done, offset + done);
+		if (ret > 0) {
+			done += ret;
+		} else if (ret == -1 && errno != EINTR) {
+			fprintf(stderr, "pwrite(%jd, %zu): %m\n", (intmax_t)(offset + done), count - done);
+			exit(10);
+		}
+	}
+	throttle_done(start, count);
+	phase_add(PHASE_DEVICE_WRITE, start, count);
+}
+
+/*
+ * io_uring engine: keeps io_depth O_DIRECT reads of up to max_io_size in
+ * flight into registered buffers, and writes completed reads to out_fd
+ * in order, batched into one writev per round trip.
+ */
+#define URING_WRITE_TAG (1ULL << 63)
+
+static struct {
+	bool initialized;
+	bool usable;
+	struct uring ring;
+	unsigned int depth;
+	size_t buf_size;
+	char **bufs;
+	size_t *lens;
+	bool *done;
+	uint64_t *started;
+	struct iovec *iov;
+} uring_engine;
+
+static bool uring_engine_init(void)
+{
+	unsigned int i;
+	int err;
+
+	if (uring_engine.initialized)
+		return uring_engine.usable;
+	uring_engine.initialized = true;
+
+	err = uring_init(&uring_engine.ring, io_depth + 1);
+	if (err) {
+		fprintf(stderr, "io_uring not available (%s), falling back to splice\n", strerror(-err));
+		return false;
+	}
+
+	uring_engine.depth = io_depth;
+	uring_engine.buf_size = max_io_size;
+	uring_engine.bufs = calloc(io_depth, sizeof(*uring_engine.bufs));
+	uring_engine.lens = calloc(io_depth, sizeof(*uring_engine.lens));
+	uring_engine.done = calloc(io_depth, sizeof(*uring_engine.done));
+	uring_engine.started = calloc(io_depth, sizeof(*uring_engine.started));
+	uring_engine.iov = calloc(io_depth, sizeof(*uring_engine.iov));
+	if (!uring_engine.bufs || !uring_engine.lens || !uring_engine.done ||
+	    !uring_engine.started || !uring_engine.iov) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < io_depth; i++) {
+		if (posix_memalign((void **)&uring_engine.bufs[i], 4096, max_io_size)) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
+		uring_engine.iov[i].iov_base = uring_engine.bufs[i];
+		uring_engine.iov[i].iov_len = max_io_size;
+	}
+	err = uring_register_buffers(&uring_engine.ring, uring_engine.iov, io_depth);
+	if (err) {
+		fprintf(stderr, "io_uring buffer registration failed (%s), falling back to splice\n",
+			strerror(-err));
+		uring_exit(&uring_engine.ring);
+		return false;
+	}
+
+	uring_engine.usable = true;
+	return true;
+}
+
+/* Finish a short writev synchronously; iov[] describes the whole batch */
+static void uring_write_rest(int out_fd, const struct iovec *iov, unsigned int n, size_t written)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (written >= iov[i].iov_len) {
+			written -= iov[i].iov_len;
+			continue;
+		}
+		write_all(out_fd, (const char *)iov[i].iov_base + written, iov[i].iov_len - written);
+		written = 0;
+	}
+}
+
+/* Returns false if io_uring cannot be used, the caller falls back to splice */
+static bool uring_copy(int in_fd, loff_t in_off, int out_fd, size_t len)
+{
+	struct uring *ring = &uring_engine.ring;
+	uint64_t n_seg, submitted = 0, written = 0;
+	unsigned int depth, write_batch = 0;
+	size_t buf_size, write_len = 0;
+
+	if (!uring_engine_init())
+		return false;
+
+	depth = uring_engine.depth;
+	buf_size = uring_engine.buf_size;
+	n_seg = (len + buf_size - 1) / buf_size;
+	while (written < n_seg) {
+		struct io_uring_sqe *sqe;
+		struct io_uring_cqe *cqe;
+		int err;
+
+		while (submitted < n_seg && submitted - written < depth) {
+			const unsigned int slot = submitted % depth;
+			const uint64_t pos = submitted * buf_size;
+
+			sqe = uring_get_sqe(ring);
+			if (!sqe)
+				break;
+			uring_engine.lens[slot] = len - pos < buf_size ? len - pos : buf_size;
+			uring_engine.done[slot] = false;
+			throttle_io(uring_engine.lens[slot]);
+			uring_engine.started[slot] = report_now();
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->fd = in_fd;
+			sqe->addr = (uintptr_t)uring_engine.bufs[slot];
+			sqe->len = uring_engine.lens[slot];
+			sqe->off = in_off + pos;
+			sqe->buf_index = slot;
+			sqe->user_data = submitted;
+			submitted++;
+		}
+
+		/* Only one write in flight, so the stream stays in order */
+		if (!write_batch) {
+			while (written + write_batch < submitted) {
+				const unsigned int slot = (written + write_batch) % depth;
+
+				if (!uring_engine.done[slot])
+					break;
+				uring_engine.iov[write_batch].iov_base = uring_engine.bufs[slot];
+				uring_engine.iov[write_batch].iov_len = uring_engine.lens[slot];
+				write_len += uring_engine.lens[slot];
+				write_batch++;
+			}
+			if (write_batch) {
+				sqe = uring_get_sqe(ring);
+				assert(sqe);
+				sqe->opcode = IORING_OP_WRITEV;
+				sqe->fd = out_fd;
+				sqe->addr = (uintptr_t)uring_engine.iov;
+				sqe->len = write_batch;
+				sqe->off = -1; /* current position, works for pipes, too */
+				sqe->user_data = URING_WRITE_TAG | write_batch;
+			}
+		}
+
+		err = uring_submit_and_wait(ring, 1);
+		if (err) {
+			fprintf(stderr, "io_uring_enter(): %s\n", strerror(-err));
+			exit(10);
+		}
+
+		while ((cqe = uring_peek_cqe(ring))) {
+			const uint64_t tag = cqe->user_data;
+			const int res = cqe->res;
+
+			uring_cqe_seen(ring);
+			if (tag & URING_WRITE_TAG) {
+				if (res < 0) {
+					fprintf(stderr, "io_uring write: %s\n", strerror(-res));
+					exit(10);
+				}
+				if ((size_t)res < write_len)
+					uring_write_rest(out_fd, uring_engine.iov, write_batch, res);
+				written += write_batch;
+				write_batch = 0;
+				write_len = 0;
+			} else {
+				const unsigned int slot = tag % depth;
+				const size_t seg_len = uring_engine.lens[slot];
+
+				if (res < 0) {
+					fprintf(stderr, "io_uring read(%jd, %zu): %s\n",
+						(intmax_t)(in_off + tag * buf_size), seg_len, strerror(-res));
+					exit(10);
+				}
+				throttle_done(uring_engine.started[slot], res);
+				if ((size_t)res < seg_len)
+					pread_all(in_fd, uring_engine.bufs[slot] + res, seg_len - res,
+						  in_off + tag * buf_size + res);
+				uring_engine.done[slot] = true;
+			}
+		}
+	}
+
+	return true;
+}
+
 static void copy_data(int in_fd, loff_t *in_off,
 		     int out_fd, loff_t *out_off,
 		     size_t len)
 {
 	static int one_is_fifo = -1;
 	static int pipe_fd[2];
+	const enum phase stream_phase = in_off ? PHASE_STREAM_WRITE : PHASE_STREAM_READ;
+	const size_t length = len;
+	uint64_t start = report_now();
+
+	/* The receive side reads a stream, reads cannot be issued ahead there */
+	if (io_engine == IO_ENGINE_URING && in_off && !out_off &&
+	    uring_copy(in_fd, *in_off, out_fd, len)) {
+		phase_add(stream_phase, start, length);
+		return;
+	}
+
+	/* in pieces, so that a long extent does not exceed the limits in one go */
+	if (throttle_enabled() && len > max_io_size) {
+		size_t done, piece;
+
+		for (done = 0; done < len; done += piece) {
+			loff_t in_pos = in_off ? *in_off + done : 0;
+			loff_t out_pos = out_off ? *out_off + done : 0;
+
+			piece = len - done < max_io_size ? len - done : max_io_size;
+			copy_data(in_fd, in_off ? &in_pos : NULL, out_fd, out_off ? &out_pos : NULL, piece);
+		}
+		return;
+	}
+	throttle_io(len);
 
 	if (one_is_fifo == -1) {
-		one_is_fifo = is_fifo(in_fd) || is_fifo(out_fd);
+		/* through the pipe, the time of the device side is needed by itself */
+		one_is_fifo = (is_fifo(in_fd) || is_fifo(out_fd)) && !throttle_adaptive();
 		if (!one_is_fifo) {
 			int ret = pipe2(pipe_fd, O_CLOEXEC);
 			if (ret) {
@@ -780,10 +3467,15 @@ static void copy_data(int in_fd, loff_t *in_off,
 		}
 	}
 
-	if (one_is_fifo)
-		len = splice_data(in_fd, out_fd, len);
-	else
-		len = splice_data_with_fifo(in_fd, out_fd, len, pipe_fd);
+	if (one_is_fifo) {
+		start = report_now();
+		len = splice_data(in_fd, out_fd, len, out_off ? *out_off : -1);
+		phase_add(stream_phase, start, length - len);
+	} else {
+		len = splice_data_with_fifo(in_fd, out_fd, out_off ? *out_off : -1, len, pipe_fd,
+					    in_off ? PHASE_DEVICE_READ : PHASE_STREAM_READ,
+					    in_off ? PHASE_STREAM_WRITE : PHASE_DEVICE_WRITE);
+	}
 	if (len != 0) {
 		fprintf(stderr, "Incomplete copy_data, %zu bytes missing.\n", len);
 		exit(10);
@@ -796,264 +3488,2852 @@ static void send_chunk(int in_fd, int out_fd, loff_t begin, size_t length, size_
 	copy_data(in_fd, &begin, out_fd, NULL, length);
 }
 
-size_t read_complete(struct stream_context *ctx, void *const buf, const size_t requested_count)
+static void send_job_add_run(struct send_job *job, enum cmd cmd, size_t offset, size_t length)
 {
-	const int fd = ctx->in_fd;
-	char *const read_buf = buf;
-	size_t completed_count = 0;
+	struct send_run *run;
 
-	while (completed_count < (ssize_t) requested_count) {
-		void *const read_ptr = &read_buf[completed_count];
-		const ssize_t read_bytes = read(fd, read_ptr, requested_count - completed_count);
-		if (read_bytes > 0) {
-			completed_count += read_bytes;
-		} else if (read_bytes < 0) {
-			/* No-op if EINTR, otherwise read error */
-			if (errno == EINTR)
-				continue; /* interrupted read, retry */
-			perror("read()");
-			exit(10);
-		} else {
-			/* read_bytes == 0, end of file */
-			/* clean end of file, nothing was read, completed_count == 0 */
-			if (completed_count == 0)
-				break;
-			/* else partially read buffer, error */
-			if (ctx->n_end_stream)
-				fprintf(stderr, "Trailing garbage beyond END_STREAM marker.\n");
-			else
-				fprintf(stderr, "Truncated input, bytes expected: %zu, got: %zu.\n",
-					requested_count, completed_count);
+	if (job->n_runs) {
+		run = &job->runs[job->n_runs - 1];
+		if (run->cmd == cmd && run->offset + run->length == offset) {
+			run->length += length;
+			return;
+		}
+	}
+	if (job->n_runs == job->max_runs) {
+		job->max_runs = job->max_runs ? 2 * job->max_runs : 4;
+		job->runs = realloc(job->runs, job->max_runs * sizeof(*job->runs));
+		if (!job->runs) {
+			fputs("Out of memory.\n", stderr);
 			exit(10);
 		}
 	}
+	run = &job->runs[job->n_runs++];
+	run->cmd = cmd;
+	run->offset = offset;
+	run->length = length;
+	run->payload_off = 0;
+	run->payload_len = 0;
+}
 
-	return completed_count;
+/* Runs of all-zero blocks become CMD_ZERO, everything else stays CMD_DATA */
+static void detect_zero_runs(struct send_job *job)
+{
+	const size_t step = job->block_size ? job->block_size : job->length;
+	size_t off;
+
+	for (off = 0; off < job->length; off += step) {
+		size_t len = job->length - off < step ? job->length - off : step;
+
+		send_job_add_run(job, buf_is_zero(job->buf + off, len) ? CMD_ZERO : CMD_DATA, off, len);
+	}
 }
 
-static void cmd_unmap(int out_fd, off_t byte_offset, size_t byte_length)
+/* Leaves out the blocks whose hash matches the target's, per the hash manifest */
+static void manifest_runs(struct send_job *job)
 {
-	/* For huge devices, and if device-mapper passes this down to the backend,
-	 * this may be large, and take some time.
-	 * Do it in "chunks" per call so this can show progress
-	 * and can be interrupted, if necessary. */
-	const size_t bytes_per_iteration = 1024*1024*1024;
+	const uint64_t bs = manifest.block_size;
+	size_t off, len;
+
+	for (off = 0; off < job->length; off += len) {
+		const loff_t pos = job->begin + off;
+		const char *buf = job->buf + off;
+
+		len = bs - pos % bs;
+		if (len > job->length - off)
+			len = job->length - off;
+		if (pos % bs == 0 && hash_manifest_matches(&manifest, pos / bs, buf, len))
+			continue;
+		send_job_add_run(job, detect_zeroes && buf_is_zero(buf, len) ? CMD_ZERO : CMD_DATA,
+				 off, len);
+	}
+}
 
-	size_t bytes_left = byte_length;
-	off_t offset = byte_offset;
-	size_t chunk;
-	uint64_t range[2];
-	int ret;
+/*
+ * Nothing is mapped on the source between manifest_pos and end, so it
+ * reads as zeroes there. Zeroes the blocks of the target that are not.
+ */
+static void zero_manifest_gap(struct stream_context *ctx, loff_t end)
+{
+	const uint64_t bs = manifest.block_size;
+	loff_t pos = ctx->manifest_pos, zero_from = -1, block_end;
+	bool zero;
+
+	if (end <= pos)
+		return;
+	ctx->manifest_pos = end;
+
+	for (; pos < end; pos = block_end) {
+		block_end = (pos / bs + 1) * bs;
+		if (block_end > end)
+			block_end = end;
+		zero = pos % bs == 0 && hash_manifest_is_zero(&manifest, pos / bs, block_end - pos);
+		if (!zero && zero_from == -1)
+			zero_from = pos;
+		if (zero && zero_from != -1) {
+			send_extent(ctx, CMD_ZERO, zero_from, pos - zero_from, bs);
+			zero_from = -1;
+		}
+	}
+	if (zero_from != -1)
+		send_extent(ctx, CMD_ZERO, zero_from, end - zero_from, bs);
+}
 
-	/* TODO
-	 * maybe properly align start and end of ioctl ranges,
-	 * and explicitly pwrite zero-out unaligned leading/trailing partial "extents".
-	 * In case thin allocation chunk size does not match between sender and receiver.
-	 */
+/* Turns the run into CMD_DATA_COMPRESSED, unless its data is incompressible */
+static void compress_run(struct send_job *job, struct send_run *run, size_t *cbuf_used)
+{
+	struct compressed_data *hdr = (struct compressed_data *)(job->cbuf + *cbuf_used);
+	const char *src = job->buf + run->offset;
+	size_t avail = job->cbuf_size - *cbuf_used;
+	size_t out;
+
+	if (avail <= sizeof(*hdr) || !compress_worthwhile(compress_algo, src, run->length))
+		return;
+
+	out = compress_buf(compress_algo, compress_level, src, run->length,
+			   (char *)(hdr + 1), avail - sizeof(*hdr));
+	if (!out || out + sizeof(*hdr) >= run->length)
+		return;
+
+	hdr->algo = htobe32(compress_algo);
+	hdr->reserved = 0;
+	hdr->raw_length = htobe64(run->length);
+	run->cmd = CMD_DATA_COMPRESSED;
+	run->payload_off = *cbuf_used;
+	run->payload_len = sizeof(*hdr) + out;
+	*cbuf_used += run->payload_len;
+}
 
-	while (bytes_left > 0) {
-		chunk = bytes_per_iteration < bytes_left ? bytes_per_iteration : bytes_left;
-		range[0] = offset;
-		range[1] = chunk; /* len */
+/* Runs on a reader thread: fetch the data and decide what goes on the wire */
+static void prepare_job(struct send_pipeline *pl, struct send_job *job)
+{
+	size_t cbuf_used = 0;
+	unsigned int i;
+
+	job->n_runs = 0;
+	/* UNMAP jobs have nothing to read, they only keep their place in the order */
+	if (job->cmd != CMD_DATA) {
+		send_job_add_run(job, job->cmd, 0, job->length);
+		return;
+	}
 
-		ret = ioctl(out_fd, BLKDISCARD, &range);
+	pread_all(pl->in_fd, job->buf, job->length, job->begin);
+	if (manifest.hashes)
+		manifest_runs(job);
+	else if (detect_zeroes)
+		detect_zero_runs(job);
+	else
+		send_job_add_run(job, CMD_DATA, 0, job->length);
 
-		if (ret == -1) {
-			bool ignore =
-				errno == EOPNOTSUPP &&
-				unsupported_unmap_is_fatal == false;
+	if (checksum) {
+		for (i = 0; i < job->n_runs; i++)
+			if (job->runs[i].cmd == CMD_DATA)
+				job->runs[i].crc = ~crc32c(~0U, job->buf + job->runs[i].offset,
+							   job->runs[i].length);
+	}
+
+	if (compress_algo != COMPRESS_NONE) {
+		for (i = 0; i < job->n_runs; i++)
+			if (job->runs[i].cmd == CMD_DATA)
+				compress_run(job, &job->runs[i], &cbuf_used);
+	}
+}
+
+static void *send_reader_thread(void *arg)
+{
+	struct send_pipeline *pl = arg;
+
+	while (true) {
+		struct send_job *job;
+
+		pthread_mutex_lock(&pl->mutex);
+		while (pl->next_read == pl->head && !pl->shutdown)
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		if (pl->next_read == pl->head) {
+			pthread_mutex_unlock(&pl->mutex);
+			return NULL;
+		}
+		job = &pl->jobs[pl->next_read % pl->n_jobs];
+		pl->next_read++;
+		pthread_mutex_unlock(&pl->mutex);
+
+		prepare_job(pl, job);
+
+		pthread_mutex_lock(&pl->mutex);
+		job->ready = true;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->mutex);
+	}
+}
+
+/* The sequencer is the only one writing to the stream, so it keeps the counters */
+static void send_job_runs(struct send_pipeline *pl, struct send_job *job)
+{
+	struct stream_context *ctx = pl->ctx;
+	unsigned int i;
+
+	for (i = 0; i < job->n_runs; i++) {
+		const struct send_run *run = &job->runs[i];
+		const loff_t begin = job->begin + run->offset;
+
+		if (checksum && (run->cmd == CMD_DATA || run->cmd == CMD_DATA_COMPRESSED)) {
+			struct chunk_checksum cs = {
+				.length = htobe64(run->length),
+				.crc32c = htobe32(run->crc),
+			};
+
+			send_header(pl->out_fd, begin, sizeof(cs), CMD_CHECKSUM);
+			write_all(pl->out_fd, (const char *)&cs, sizeof(cs));
+			ctx->n_chunks++;
+		}
+
+		switch (run->cmd) {
+		case CMD_DATA:
+			send_header(pl->out_fd, begin, run->length, CMD_DATA);
+			write_all(pl->out_fd, job->buf + run->offset, run->length);
+			ctx->n_data++;
+			ctx->bytes_data += run->length;
+			break;
+		case CMD_DATA_COMPRESSED:
+			send_header(pl->out_fd, begin, run->payload_len, CMD_DATA_COMPRESSED);
+			if (stream_index)
+				index_raw_length(run->length);
+			write_all(pl->out_fd, job->cbuf + run->payload_off, run->payload_len);
+			ctx->n_data++;
+			ctx->bytes_data += run->length;
+			break;
+		case CMD_ZERO:
+			send_header(pl->out_fd, begin, run->length, CMD_ZERO);
+			ctx->n_zero++;
+			ctx->bytes_zero += run->length;
+			break;
+		default:
+			send_header(pl->out_fd, begin, run->length, run->cmd);
+			ctx->n_unmap++;
+		}
+		ctx->n_chunks++;
+	}
+}
+
+static void *send_sequencer_thread(void *arg)
+{
+	struct send_pipeline *pl = arg;
+
+	while (true) {
+		struct send_job *job;
+
+		pthread_mutex_lock(&pl->mutex);
+		while (!(pl->tail < pl->head && pl->jobs[pl->tail % pl->n_jobs].ready)) {
+			if (pl->shutdown && pl->tail == pl->head) {
+				pthread_mutex_unlock(&pl->mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		}
+		job = &pl->jobs[pl->tail % pl->n_jobs];
+		pthread_mutex_unlock(&pl->mutex);
+
+		send_job_runs(pl, job);
+
+		pthread_mutex_lock(&pl->mutex);
+		job->ready = false;
+		pl->tail++;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->mutex);
+	}
+}
+
+static void send_pipeline_start(struct stream_context *ctx)
+{
+	struct send_pipeline *pl;
+	unsigned int i;
+	int err;
+
+	if (print_extents ||
+	    (n_readers < 2 && compress_algo == COMPRESS_NONE && !detect_zeroes && !checksum &&
+	     !manifest.hashes))
+		return;
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	pl->ctx = ctx;
+	pl->in_fd = ctx->in_fd;
+	pl->out_fd = ctx->out_fd;
+	pl->n_readers = n_readers;
+	/* Twice the readers, so the sequencer has work while the readers refill */
+	pl->n_jobs = 2 * n_readers;
+	pl->jobs = calloc(pl->n_jobs, sizeof(*pl->jobs));
+	pl->readers = calloc(pl->n_readers, sizeof(*pl->readers));
+	if (!pl->jobs || !pl->readers) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < pl->n_jobs; i++) {
+		/* O_DIRECT requires aligned buffers */
+		if (posix_memalign((void **)&pl->jobs[i].buf, 4096, max_io_size)) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
+		if (compress_algo != COMPRESS_NONE) {
+			/* room for some runs more than compress_bound() covers */
+			pl->jobs[i].cbuf_size = 4 * sizeof(struct compressed_data) +
+				compress_bound(compress_algo, max_io_size);
+			pl->jobs[i].cbuf = malloc(pl->jobs[i].cbuf_size);
+			if (!pl->jobs[i].cbuf) {
+				fputs("Out of memory.\n", stderr);
+				exit(10);
+			}
+		}
+	}
+	pthread_mutex_init(&pl->mutex, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+
+	for (i = 0; i < pl->n_readers; i++) {
+		err = pthread_create(&pl->readers[i], NULL, send_reader_thread, pl);
+		if (err) {
+			fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+			exit(10);
+		}
+	}
+	err = pthread_create(&pl->sequencer, NULL, send_sequencer_thread, pl);
+	if (err) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		exit(10);
+	}
+
+	ctx->pipeline = pl;
+}
+
+static void send_pipeline_submit(struct send_pipeline *pl, enum cmd cmd, loff_t begin,
+				 size_t length, size_t block_size)
+{
+	struct send_job *job;
+
+	pthread_mutex_lock(&pl->mutex);
+	while (pl->head - pl->tail == pl->n_jobs)
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	job = &pl->jobs[pl->head % pl->n_jobs];
+	job->cmd = cmd;
+	job->begin = begin;
+	job->length = length;
+	job->block_size = block_size;
+	job->ready = false;
+	pl->head++;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+/* Drains the pipeline, afterwards the caller owns out_fd and ctx again */
+static void send_pipeline_finish(struct stream_context *ctx)
+{
+	struct send_pipeline *pl = ctx->pipeline;
+	unsigned int i;
+
+	if (!pl)
+		return;
+
+	pthread_mutex_lock(&pl->mutex);
+	pl->shutdown = true;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+
+	for (i = 0; i < pl->n_readers; i++)
+		pthread_join(pl->readers[i], NULL);
+	pthread_join(pl->sequencer, NULL);
+
+	for (i = 0; i < pl->n_jobs; i++) {
+		free(pl->jobs[i].buf);
+		free(pl->jobs[i].cbuf);
+		free(pl->jobs[i].runs);
+	}
+	free(pl->jobs);
+	free(pl->readers);
+	pthread_mutex_destroy(&pl->mutex);
+	pthread_cond_destroy(&pl->cond);
+	free(pl);
+	ctx->pipeline = NULL;
+}
+
+/*
+ * Queue an extent for the stream. DATA extents are split into sub-chunks
+ * of at most max_io_size (rounded down to the block size). With the reader
+ * pool each becomes one or more chunks of its own, without it one chunk.
+ * Without it, the counters are updated here, otherwise by the sequencer.
+ */
+static void send_extent(struct stream_context *ctx, enum cmd cmd, loff_t begin, size_t length, size_t block_size)
+{
+	struct send_pipeline *pl = ctx->pipeline;
+
+	if (ctx->extents) {
+		extent_queue_push(ctx->extents, cmd, begin, length, block_size);
+		return;
+	}
+	/* the gaps zeroed for a hash manifest were not planned */
+	if (cmd != CMD_ZERO)
+		progress_done(cmd == CMD_DATA, length);
+	/* whole manifest blocks, so that their hashes can be compared */
+	if (manifest.hashes && cmd == CMD_DATA) {
+		loff_t end = begin + length;
+
+		begin -= begin % manifest.block_size;
+		if (begin < ctx->manifest_pos)
+			begin = ctx->manifest_pos;
+		if (end % manifest.block_size)
+			end += manifest.block_size - end % manifest.block_size;
+		if (end > (loff_t)ctx->volume_size)
+			end = ctx->volume_size;
+		if (end <= begin)
+			return;
+		zero_manifest_gap(ctx, begin);
+		ctx->manifest_pos = end;
+		length = end - begin;
+	}
+	/* resumed, the receiver has everything before resume_offset */
+	if (begin < (loff_t)resume_offset) {
+		if (begin + (loff_t)length <= (loff_t)resume_offset)
+			return;
+		length -= resume_offset - begin;
+		begin = resume_offset;
+	}
+	if (print_extents) {
+		printf("%s %lld %zu\n", cmd == CMD_UNMAP ? "unmap" : cmd == CMD_ZERO ? "zero" : "data",
+		       (long long)begin, length);
+		return;
+	}
+
+	size_t sub_size = max_io_size;
+	if (manifest.hashes)
+		sub_size -= sub_size % manifest.block_size;
+	else if (block_size && block_size <= sub_size)
+		sub_size -= sub_size % block_size;
+
+	if (!pl) {
+		if (cmd == CMD_DATA) {
+			/* bounded chunks, the receiver checkpoints between them */
+			while (length) {
+				size_t len = length < sub_size ? length : sub_size;
+
+				send_chunk(ctx->in_fd, ctx->out_fd, begin, len, block_size);
+				ctx->n_data++;
+				ctx->bytes_data += len;
+				ctx->n_chunks++;
+				begin += len;
+				length -= len;
+			}
+			return;
+		}
+		if (cmd == CMD_ZERO) {
+			send_header(ctx->out_fd, begin, length, cmd);
+			ctx->n_zero++;
+			ctx->bytes_zero += length;
+		} else {
+			send_header(ctx->out_fd, begin, length, cmd);
+			ctx->n_unmap++;
+		}
+		ctx->n_chunks++;
+		return;
+	}
+
+	if (cmd != CMD_DATA) {
+		send_pipeline_submit(pl, cmd, begin, length, block_size);
+		return;
+	}
+
+	while (length) {
+		size_t len = length < sub_size ? length : sub_size;
+
+		send_pipeline_submit(pl, CMD_DATA, begin, len, block_size);
+		begin += len;
+		length -= len;
+	}
+}
+
+size_t read_complete(struct stream_context *ctx, void *const buf, const size_t requested_count)
+{
+	const int fd = ctx->in_fd;
+	char *const read_buf = buf;
+	size_t completed_count = 0;
+	uint64_t start = report_now();
+
+	while (completed_count < (ssize_t) requested_count) {
+		void *const read_ptr = &read_buf[completed_count];
+		const ssize_t read_bytes = read(fd, read_ptr, requested_count - completed_count);
+		if (read_bytes > 0) {
+			completed_count += read_bytes;
+		} else if (read_bytes < 0) {
+			/* No-op if EINTR, otherwise read error */
+			if (errno == EINTR)
+				continue; /* interrupted read, retry */
+			perror("read()");
+			exit(10);
+		} else {
+			/* read_bytes == 0, end of file */
+			/* clean end of file, nothing was read, completed_count == 0 */
+			if (completed_count == 0)
+				break;
+			/* else partially read buffer, error */
+			if (ctx->n_end_stream)
+				fprintf(stderr, "Trailing garbage beyond END_STREAM marker.\n");
+			else
+				fprintf(stderr, "Truncated input, bytes expected: %zu, got: %zu.\n",
+					requested_count, completed_count);
+			exit(10);
+		}
+	}
+
+	phase_add(PHASE_STREAM_READ, start, completed_count);
+	return completed_count;
+}
+
+static void cmd_unmap(int out_fd, off_t byte_offset, size_t byte_length)
+{
+	/* For huge devices, and if device-mapper passes this down to the backend,
+	 * this may be large, and take some time.
+	 * Do it in "chunks" per call so this can show progress
+	 * and can be interrupted, if necessary. */
+	const size_t bytes_per_iteration = 1024*1024*1024;
+
+	static bool ignored_before;
+	size_t bytes_left = byte_length;
+	off_t offset = byte_offset;
+	size_t chunk;
+	uint64_t range[2];
+	uint64_t start;
+	int ret;
+
+	while (bytes_left > 0) {
+		chunk = bytes_per_iteration < bytes_left ? bytes_per_iteration : bytes_left;
+		range[0] = offset;
+		range[1] = chunk; /* len */
+
+		start = report_now();
+		ret = ioctl(out_fd, BLKDISCARD, &range);
+		if (ret == -1 && errno == ENOTTY) /* regular file */
+			ret = fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					offset, chunk);
+		phase_add(PHASE_DEVICE_WRITE, start, 0);
+
+		if (ret == -1) {
+			bool ignore =
+				errno == EOPNOTSUPP &&
+				unsupported_unmap_is_fatal == false;
+
+			if (!ignore || !ignored_before)
+				fprintf(stderr, "unmap(,%zd,%zu) failed: %s%s\n",
+					byte_offset, byte_length, strerror(errno),
+					ignore ? " -- ignored, further ones silently" : "");
+			if (!ignore)
+				exit(10);
+			ignored_before = true;
+		}
+		offset += chunk;
+		bytes_left -= chunk;
+	}
+}
+
+/*
+ * BLKDISCARD does not guarantee that the range reads back as zeroes
+ * afterwards, so this uses BLKZEROOUT, or fallocate() on regular files.
+ */
+static void zero_range(int out_fd, off_t byte_offset, size_t byte_length)
+{
+	static const char zeroes[64 * 1024];
+	uint64_t range[2] = { byte_offset, byte_length };
+	uint64_t start = report_now();
+	size_t done;
+
+	if (byte_length == 0)
+		return;
+	if (ioctl(out_fd, BLKZEROOUT, &range) == 0) {
+		phase_add(PHASE_DEVICE_WRITE, start, 0);
+		return;
+	}
+	if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL) {
+		fprintf(stderr, "zeroout(,%jd,%zu) failed: %s\n",
+			(intmax_t)byte_offset, byte_length, strerror(errno));
+		exit(10);
+	}
+
+	if (fallocate(out_fd, FALLOC_FL_ZERO_RANGE, byte_offset, byte_length) == 0) {
+		phase_add(PHASE_DEVICE_WRITE, start, 0);
+		return;
+	}
+
+	for (done = 0; done < byte_length; done += sizeof(zeroes)) {
+		size_t len = byte_length - done < sizeof(zeroes) ? byte_length - done : sizeof(zeroes);
+
+		pwrite_all(out_fd, zeroes, len, byte_offset + done);
+	}
+}
+
+/* Returns false if the range was not deallocated, the caller writes zeroes then */
+static bool discard_range(int out_fd, off_t byte_offset, size_t byte_length)
+{
+	uint64_t range[2] = { byte_offset, byte_length };
+	uint64_t start = report_now();
+	bool ok;
+
+	ok = ioctl(out_fd, BLKDISCARD, &range) == 0 ||
+		(errno == ENOTTY && /* regular file */
+		 fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			   byte_offset, byte_length) == 0);
+	phase_add(PHASE_DEVICE_WRITE, start, 0);
+	return ok;
+}
+
+/* The largest part of the range that is aligned to the zero elision granularity */
+static bool zero_elide_aligned(off_t byte_offset, size_t byte_length, off_t *start, off_t *end)
+{
+	const off_t gran = zero_elide_granularity;
+
+	*start = (byte_offset + gran - 1) / gran * gran;
+	*end = (byte_offset + (off_t)byte_length) / gran * gran;
+	return *start < *end;
+}
+
+static void cmd_zero(int out_fd, off_t byte_offset, size_t byte_length)
+{
+	off_t start, end;
+
+	if (zero_elide != ZERO_ELIDE_OFF &&
+	    zero_elide_aligned(byte_offset, byte_length, &start, &end) &&
+	    (zero_elide == ZERO_ELIDE_SKIP || discard_range(out_fd, start, end - start))) {
+		zero_range(out_fd, byte_offset, start - byte_offset);
+		zero_range(out_fd, end, byte_offset + byte_length - end);
+		return;
+	}
+	zero_range(out_fd, byte_offset, byte_length);
+}
+
+/* Exits if the CRC32C of a DATA payload is not the one its CHECKSUM chunk announced */
+static void verify_checksum(uint32_t expected, uint32_t crc, loff_t offset, size_t length)
+{
+	if (crc != expected) {
+		fprintf(stderr, "Checksum mismatch for the data at offset %jd, length %zu: expected %08x, got %08x\n",
+			(intmax_t)offset, length, expected, crc);
+		exit(10);
+	}
+}
+
+/* The aligned middle with O_DIRECT if there is direct_fd, the edges through the page cache */
+static void write_target(int out_fd, int direct_fd, const char *buf, size_t len, loff_t offset)
+{
+	const loff_t end = offset + len;
+	const loff_t start = (offset + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+	const loff_t stop = end / DIRECT_ALIGN * DIRECT_ALIGN;
+
+	if (direct_fd == -1 || start >= stop ||
+	    (uintptr_t)(buf + (start - offset)) % DIRECT_ALIGN) {
+		pwrite_all(out_fd, buf, len, offset);
+		return;
+	}
+	if (start > offset)
+		pwrite_all(out_fd, buf, start - offset, offset);
+	pwrite_all(direct_fd, buf + (start - offset), stop - start, start);
+	if (end > stop)
+		pwrite_all(out_fd, buf + (stop - offset), end - stop, stop);
+}
+
+/*
+ * Writes a DATA payload. With zero elision, runs of all-zero blocks that
+ * are aligned to the target's discard granularity are discarded (or
+ * skipped) instead of written, so the target stays sparse.
+ */
+static void apply_data(int out_fd, int direct_fd, const char *buf, size_t len, loff_t offset)
+{
+	const size_t gran = zero_elide_granularity;
+	size_t pos, end, write_from = 0;
+
+	if (zero_elide == ZERO_ELIDE_OFF) {
+		write_target(out_fd, direct_fd, buf, len, offset);
+		return;
+	}
+
+	pos = (gran - offset % gran) % gran;
+	while (pos + gran <= len) {
+		if (!buf_is_zero(buf + pos, gran)) {
+			pos += gran;
+			continue;
+		}
+		for (end = pos + gran; end + gran <= len; end += gran)
+			if (!buf_is_zero(buf + end, gran))
+				break;
+
+		if (zero_elide == ZERO_ELIDE_SKIP || discard_range(out_fd, offset + pos, end - pos)) {
+			if (pos > write_from)
+				write_target(out_fd, direct_fd, buf + write_from, pos - write_from,
+					     offset + write_from);
+			write_from = end;
+		}
+		pos = end;
+	}
+	if (len > write_from)
+		write_target(out_fd, direct_fd, buf + write_from, len - write_from, offset + write_from);
+}
+
+/* DATA without the recv pipeline, when the payload needs to be looked at */
+static void recv_data_buffered(struct stream_context *ctx, loff_t offset, size_t length,
+			       const uint32_t *expected_crc)
+{
+	const loff_t chunk_offset = offset;
+	const size_t chunk_length = length;
+	uint32_t crc = ~0U;
+	static __thread char *buf;
+
+	if (!buf && posix_memalign((void **)&buf, 4096, max_io_size)) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	while (length) {
+		size_t len = length < max_io_size ? length : max_io_size;
+
+		if (read_complete(ctx, buf, len) != len) {
+			fputs("Truncated input.\n", stderr);
+			exit(10);
+		}
+		if (expected_crc) {
+			crc = crc32c(crc, buf, len);
+			/* a chunk that fits into the buffer is never written corrupt */
+			if (len == length)
+				verify_checksum(*expected_crc, ~crc, chunk_offset, chunk_length);
+		}
+		apply_data(ctx->out_fd, -1, buf, len, offset);
+		offset += len;
+		length -= len;
+	}
+}
+
+/* For a thin LV the chunk size of its pool; 0 if the target can not discard */
+static unsigned long discard_granularity(int out_fd)
+{
+	unsigned long gran = 0;
+	struct stat sb;
+	char *path;
+	FILE *f;
+
+	if (fstat(out_fd, &sb)) {
+		perror("fstat failed");
+		exit(10);
+	}
+
+	if (S_ISREG(sb.st_mode)) {
+		gran = sb.st_blksize;
+	} else if (S_ISBLK(sb.st_mode)) {
+		checked_asprintf(&path, "/sys/dev/block/%u:%u/queue/discard_granularity",
+				 major(sb.st_rdev), minor(sb.st_rdev));
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%lu", &gran) != 1)
+				gran = 0;
+			fclose(f);
+		}
+		free(path);
+	}
+	return gran;
+}
+
+/* Zero elision works on blocks the target can deallocate */
+static void zero_elide_setup(int out_fd)
+{
+	unsigned long gran;
+
+	if (zero_elide == ZERO_ELIDE_OFF)
+		return;
+
+	gran = discard_granularity(out_fd);
+	if (gran == 0 || gran % 512) {
+		if (zero_elide == ZERO_ELIDE_DISCARD) {
+			fputs("Target does not support discards, not eliding zero blocks.\n", stderr);
+			zero_elide = ZERO_ELIDE_OFF;
+			return;
+		}
+		gran = 64 * 1024; /* smallest thin pool chunk size */
+	}
+	zero_elide_granularity = gran;
+}
+
+/*
+ * Returns the allocation to free; the data starts at offset % DIRECT_ALIGN
+ * in it, so that aligned offsets are at aligned addresses.
+ */
+static char *decompress_verified(enum compress_algo algo, const char *buf, size_t len,
+				 loff_t offset, size_t raw_length, const uint32_t *expected_crc)
+{
+	const size_t raw_off = offset % DIRECT_ALIGN;
+	char *mem, *raw;
+
+	if (posix_memalign((void **)&mem, 4096, raw_off + raw_length)) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	raw = mem + raw_off;
+	if (decompress_buf(algo, buf, len, raw, raw_length)) {
+		fprintf(stderr, "Corrupt %s compressed chunk at offset %jd, length %zu\n",
+			compress_name(algo), (intmax_t)offset, raw_length);
+		exit(10);
+	}
+	/* before anything of it reaches the target */
+	if (expected_crc)
+		verify_checksum(*expected_crc, ~crc32c(~0U, raw, raw_length), offset, raw_length);
+	return mem;
+}
+
+static void apply_compressed(int out_fd, int direct_fd, enum compress_algo algo,
+			     const char *buf, size_t len,
+			     loff_t offset, size_t raw_length, const uint32_t *expected_crc)
+{
+	char *mem = decompress_verified(algo, buf, len, offset, raw_length, expected_crc);
+
+	apply_data(out_fd, direct_fd, mem + offset % DIRECT_ALIGN, raw_length, offset);
+	free(mem);
+}
+
+static bool recv_jobs_overlap(const struct recv_job *a, const struct recv_job *b)
+{
+	return a->offset < b->offset + (loff_t)b->length &&
+		b->offset < a->offset + (loff_t)a->length;
+}
+
+/* The first job that neither runs already nor overlaps an earlier one */
+static struct recv_job *recv_pick_job(struct recv_pipeline *pl)
+{
+	struct recv_job *job, *earlier;
+
+	for (job = pl->jobs; job; job = job->next) {
+		if (job->running)
+			continue;
+		for (earlier = pl->jobs; earlier != job; earlier = earlier->next)
+			if (recv_jobs_overlap(earlier, job))
+				break;
+		if (earlier == job)
+			return job;
+	}
+	return NULL;
+}
+
+static void *recv_writer_thread(void *arg)
+{
+	struct recv_pipeline *pl = arg;
+
+	while (true) {
+		struct recv_job *job, *prev;
+
+		pthread_mutex_lock(&pl->mutex);
+		while (!(job = recv_pick_job(pl))) {
+			if (pl->shutdown && !pl->jobs) {
+				pthread_mutex_unlock(&pl->mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		}
+		job->running = true;
+		pthread_mutex_unlock(&pl->mutex);
+
+		if (job->cmd == CMD_DATA)
+			apply_data(pl->out_fd, pl->direct_fd, job->buf + job->buf_off,
+				   job->length, job->offset);
+		else if (job->cmd == CMD_DATA_COMPRESSED)
+			apply_compressed(pl->out_fd, pl->direct_fd, job->algo, job->buf, job->buf_len,
+					 job->offset, job->length, job->has_crc ? &job->crc : NULL);
+		else
+			cmd_zero(pl->out_fd, job->offset, job->length);
+
+		pthread_mutex_lock(&pl->mutex);
+		if (pl->jobs == job) {
+			prev = NULL;
+			pl->jobs = job->next;
+		} else {
+			for (prev = pl->jobs; prev->next != job; prev = prev->next)
+				;
+			prev->next = job->next;
+		}
+		if (pl->jobs_tail == job)
+			pl->jobs_tail = prev;
+		pl->n_jobs--;
+		pl->mem_used -= job->mem;
+		if (job->buf_len == DIRECT_BUF_SIZE && pl->n_pool < pl->pool_size) {
+			pl->pool[pl->n_pool++] = job->buf;
+			job->buf = NULL;
+		}
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->mutex);
+
+		free(job->buf);
+		free(job);
+	}
+}
+
+static void recv_pipeline_start(struct stream_context *ctx)
+{
+	struct recv_pipeline *pl;
+	int i, err;
+
+	if (n_writers < 2 && io_engine != IO_ENGINE_DIRECT)
+		return;
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	pl->out_fd = ctx->out_fd;
+	pl->direct_fd = -1;
+	pl->n_writers = n_writers;
+	pl->mem_cap = recv_buffer_size;
+	if (io_engine == IO_ENGINE_DIRECT) {
+		char *path;
+
+		/* the edges of unaligned chunks still go through out_fd */
+		checked_asprintf(&path, "/proc/self/fd/%d", ctx->out_fd);
+		pl->direct_fd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+		if (pl->direct_fd == -1)
+			fprintf(stderr, "Opening the target with O_DIRECT failed: %s; writing through the page cache\n",
+				strerror(errno));
+		free(path);
+		/* as many as the memory cap lets be in use at once */
+		pl->pool_size = pl->mem_cap / DIRECT_BUF_SIZE + 1;
+		pl->pool = calloc(pl->pool_size, sizeof(*pl->pool));
+		if (!pl->pool) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
+	}
+	pl->writers = calloc(n_writers, sizeof(*pl->writers));
+	if (!pl->writers) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	pthread_mutex_init(&pl->mutex, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+
+	for (i = 0; i < pl->n_writers; i++) {
+		err = pthread_create(&pl->writers[i], NULL, recv_writer_thread, pl);
+		if (err) {
+			fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+			exit(10);
+		}
+	}
+
+	ctx->recv_pipeline = pl;
+}
+
+static void recv_pipeline_append(struct recv_pipeline *pl, struct recv_job *job)
+{
+	pthread_mutex_lock(&pl->mutex);
+	job->next = NULL;
+	if (pl->jobs_tail)
+		pl->jobs_tail->next = job;
+	else
+		pl->jobs = job;
+	pl->jobs_tail = job;
+	pl->n_jobs++;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+/*
+ * Queues the job DATA was collected in. If it holds at most half of its
+ * buffer, the data moves to a buffer of its size and the large one goes
+ * back to the pool; the memory cap then counts what queued jobs hold.
+ */
+static void recv_queue_filling(struct recv_pipeline *pl)
+{
+	struct recv_job *job = pl->filling;
+	size_t len = (job->buf_off + job->length + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+	char *buf;
+
+	pl->filling = NULL;
+	if (len <= job->buf_len / 2) {
+		if (posix_memalign((void **)&buf, DIRECT_ALIGN, len)) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
+		memcpy(buf, job->buf, job->buf_off + job->length);
+
+		pthread_mutex_lock(&pl->mutex);
+		if (pl->n_pool < pl->pool_size)
+			pl->pool[pl->n_pool++] = job->buf;
+		else
+			free(job->buf);
+		pl->mem_used -= job->mem - len;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->mutex);
+
+		job->buf = buf;
+		job->buf_len = job->mem = len;
+	}
+	recv_pipeline_append(pl, job);
+}
+
+static void recv_pipeline_queue(struct recv_pipeline *pl, struct recv_job *job)
+{
+	/* keeps the stream order */
+	if (pl->filling && pl->filling != job)
+		recv_queue_filling(pl);
+	recv_pipeline_append(pl, job);
+}
+
+/* Queues what was collected, before waiting for the writers */
+static void recv_pipeline_flush(struct recv_pipeline *pl)
+{
+	if (pl->filling)
+		recv_queue_filling(pl);
+}
+
+/*
+ * buf_len bytes of payload are read into the job, mem is what the job
+ * holds until it is applied (for compressed data including the output).
+ */
+static struct recv_job *recv_job_alloc(struct recv_pipeline *pl, enum cmd cmd,
+				       loff_t offset, size_t length,
+				       size_t buf_len, size_t mem)
+{
+	struct recv_job *job = calloc(1, sizeof(*job));
+
+	if (!job) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	job->cmd = cmd;
+	job->offset = offset;
+	job->length = length;
+	job->buf_len = buf_len;
+	job->mem = mem;
+
+	/* the writers could not free what it holds otherwise */
+	recv_pipeline_flush(pl);
+	pthread_mutex_lock(&pl->mutex);
+	while (pl->n_jobs >= RECV_MAX_JOBS ||
+	       (mem && pl->mem_used && pl->mem_used + mem > pl->mem_cap))
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	pl->mem_used += mem;
+	if (buf_len == DIRECT_BUF_SIZE && pl->n_pool)
+		job->buf = pl->pool[--pl->n_pool];
+	pthread_mutex_unlock(&pl->mutex);
+
+	if (buf_len && !job->buf && posix_memalign((void **)&job->buf, 4096, buf_len)) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	return job;
+}
+
+/*
+ * --io-engine direct: the job collecting DATA that continues at offset,
+ * so that chunks contiguous on the target become one large write. The
+ * data starts in the buffer at the offset's alignment, that way the
+ * aligned parts can be written with O_DIRECT straight from it.
+ */
+static struct recv_job *recv_filling_job(struct recv_pipeline *pl, loff_t offset)
+{
+	struct recv_job *job = pl->filling;
+
+	if (job && job->offset + (loff_t)job->length == offset)
+		return job;
+	if (job)
+		recv_queue_filling(pl);
+	job = recv_job_alloc(pl, CMD_DATA, offset, 0, DIRECT_BUF_SIZE, DIRECT_BUF_SIZE);
+	job->buf_off = offset % DIRECT_ALIGN;
+	pl->filling = job;
+	return job;
+}
+
+/*
+ * Reads the payload of a DATA chunk in pieces that fit into the memory cap.
+ * Its checksum is verified before the last piece is queued; a chunk that
+ * fits into one piece is thereby never written corrupt.
+ */
+static void recv_pipeline_data(struct stream_context *ctx, loff_t offset, size_t length,
+			       const uint32_t *expected_crc)
+{
+	struct recv_pipeline *pl = ctx->recv_pipeline;
+	size_t piece_size = max_io_size < pl->mem_cap ? max_io_size : pl->mem_cap;
+	const loff_t chunk_offset = offset;
+	const size_t chunk_length = length;
+	uint32_t crc = ~0U;
+
+	while (length) {
+		size_t len = length < piece_size ? length : piece_size;
+		struct recv_job *job;
+		char *buf;
+
+		if (pl->direct_fd != -1) {
+			job = recv_filling_job(pl, offset);
+			/* keep a small chunk in one buffer, the checksum covers it all */
+			if (len == length && job->length &&
+			    len > job->buf_len - job->buf_off - job->length &&
+			    offset % DIRECT_ALIGN + len <= DIRECT_BUF_SIZE) {
+				recv_queue_filling(pl);
+				job = recv_filling_job(pl, offset);
+			}
+			buf = job->buf + job->buf_off + job->length;
+			if (len > job->buf_len - job->buf_off - job->length)
+				len = job->buf_len - job->buf_off - job->length;
+		} else {
+			job = recv_job_alloc(pl, CMD_DATA, offset, len, len, len);
+			buf = job->buf;
+		}
+
+		if (read_complete(ctx, buf, len) != len) {
+			fputs("Truncated input.\n", stderr);
+			exit(10);
+		}
+		if (expected_crc) {
+			crc = crc32c(crc, buf, len);
+			if (len == length)
+				verify_checksum(*expected_crc, ~crc, chunk_offset, chunk_length);
+		}
+		if (pl->direct_fd != -1) {
+			job->length += len;
+			if (job->buf_off + job->length == job->buf_len) {
+				pl->filling = NULL;
+				recv_pipeline_queue(pl, job);
+			}
+		} else {
+			recv_pipeline_queue(pl, job);
+		}
+		offset += len;
+		length -= len;
+	}
+}
+
+/* For ZERO, which carries no payload */
+static void recv_pipeline_range(struct stream_context *ctx, enum cmd cmd, loff_t offset, size_t length)
+{
+	struct recv_pipeline *pl = ctx->recv_pipeline;
+
+	recv_pipeline_queue(pl, recv_job_alloc(pl, cmd, offset, length, 0, 0));
+}
+
+static void recv_pipeline_compressed(struct stream_context *ctx, loff_t offset,
+				     enum compress_algo algo, size_t raw_length, size_t length,
+				     const uint32_t *expected_crc)
+{
+	struct recv_pipeline *pl = ctx->recv_pipeline;
+	struct recv_job *job;
+
+	job = recv_job_alloc(pl, CMD_DATA_COMPRESSED, offset, raw_length,
+			     length, length + raw_length);
+	job->algo = algo;
+	if (expected_crc) {
+		job->has_crc = true;
+		job->crc = *expected_crc;
+	}
+	if (read_complete(ctx, job->buf, length) != length) {
+		fputs("Truncated input.\n", stderr);
+		exit(10);
+	}
+	recv_pipeline_queue(pl, job);
+}
+
+/* CMD_CHECKSUM, for the DATA or DATA_COMPRESSED chunk that follows */
+static void read_checksum(struct stream_context *ctx, loff_t offset, size_t length)
+{
+	struct chunk_checksum cs;
+
+	if (length < sizeof(cs) ||
+	    read_complete(ctx, &cs, sizeof(cs)) != sizeof(cs)) {
+		fprintf(stderr, "Cannot parse checksum chunk at offset %jd, length %zu\n",
+			(intmax_t)offset, length);
+		exit(10);
+	}
+	skip_input(ctx, length - sizeof(cs));
+
+	ctx->crc_pending = true;
+	ctx->crc = be32toh(cs.crc32c);
+	ctx->crc_offset = offset;
+	ctx->crc_length = be64toh(cs.length);
+}
+
+/* Whether the data chunk has a checksum; in a FEATURE_CHECKSUM stream, all have */
+static bool take_checksum(struct stream_context *ctx, loff_t offset, size_t length, uint32_t *crc)
+{
+	if (!ctx->crc_pending) {
+		if (ctx->features & FEATURE_CHECKSUM) {
+			fprintf(stderr, "No checksum for the data at offset %jd, length %zu\n",
+				(intmax_t)offset, length);
+			exit(10);
+		}
+		return false;
+	}
+	if (ctx->crc_offset != offset || ctx->crc_length != length) {
+		fprintf(stderr, "Checksum for offset %jd, length %zu, but the data is at offset %jd, length %zu\n",
+			(intmax_t)ctx->crc_offset, ctx->crc_length, (intmax_t)offset, length);
+		exit(10);
+	}
+	ctx->crc_pending = false;
+	*crc = ctx->crc;
+	return true;
+}
+
+static void cmd_data_compressed(struct stream_context *ctx, loff_t offset, size_t length)
+{
+	struct compressed_data hdr;
+	enum compress_algo algo;
+	size_t raw_length;
+	uint32_t crc;
+	bool has_crc;
+	char *buf;
+
+	if (length <= sizeof(hdr) ||
+	    read_complete(ctx, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "Invalid compressed chunk at offset %jd, length %zu\n",
+			(intmax_t)offset, length);
+		exit(10);
+	}
+	length -= sizeof(hdr);
+	algo = be32toh(hdr.algo);
+	raw_length = be64toh(hdr.raw_length);
+	if (algo == COMPRESS_NONE || !compress_supported(algo) ||
+	    raw_length == 0 || raw_length > MAX_RAW_LENGTH) {
+		fprintf(stderr, "Unsupported compressed chunk at offset %jd: algo %u, raw length %zu\n",
+			(intmax_t)offset, algo, raw_length);
+		exit(10);
+	}
+
+	discard_wait(ctx, offset, raw_length);
+	ctx->bytes_data += raw_length;
+	advance_position(ctx, offset, raw_length);
+	has_crc = take_checksum(ctx, offset, raw_length, &crc);
+	if (ctx->inspect || ctx->squash) {
+		if (ctx->inspect) {
+			ctx->inspect->n_compressed++;
+			ctx->inspect->bytes_compressed += sizeof(hdr) + length;
+		} else {
+			squash_collect(ctx, CMD_DATA_COMPRESSED, offset, raw_length, sizeof(hdr) + length,
+				       has_crc ? &crc : NULL);
+		}
+		skip_input(ctx, length);
+		return;
+	}
+	if (ctx->recv_pipeline) {
+		recv_pipeline_compressed(ctx, offset, algo, raw_length, length, has_crc ? &crc : NULL);
+		return;
+	}
+
+	buf = malloc(length);
+	if (!buf) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	if (read_complete(ctx, buf, length) != length) {
+		fputs("Truncated input.\n", stderr);
+		exit(10);
+	}
+	apply_compressed(ctx->out_fd, -1, algo, buf, length, offset, raw_length, has_crc ? &crc : NULL);
+	free(buf);
+}
+
+/* Waits until everything queued so far is applied and on stable storage */
+static void recv_pipeline_drain(struct stream_context *ctx)
+{
+	struct recv_pipeline *pl = ctx->recv_pipeline;
+
+	if (!pl)
+		return;
+
+	recv_pipeline_flush(pl);
+	pthread_mutex_lock(&pl->mutex);
+	while (pl->jobs)
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	pthread_mutex_unlock(&pl->mutex);
+
+	if (fsync(pl->out_fd)) {
+		perror("fsync()");
+		exit(10);
+	}
+}
+
+static void recv_pipeline_finish(struct stream_context *ctx)
+{
+	struct recv_pipeline *pl = ctx->recv_pipeline;
+	int i;
+
+	if (!pl)
+		return;
+
+	recv_pipeline_drain(ctx);
+
+	pthread_mutex_lock(&pl->mutex);
+	pl->shutdown = true;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+	for (i = 0; i < pl->n_writers; i++)
+		pthread_join(pl->writers[i], NULL);
+
+	while (pl->n_pool)
+		free(pl->pool[--pl->n_pool]);
+	free(pl->pool);
+	if (pl->direct_fd != -1)
+		close(pl->direct_fd);
+	free(pl->writers);
+	pthread_mutex_destroy(&pl->mutex);
+	pthread_cond_destroy(&pl->cond);
+	free(pl);
+	ctx->recv_pipeline = NULL;
+}
+
+static bool recv_range_busy(struct recv_pipeline *pl, loff_t begin, loff_t end)
+{
+	struct recv_job *job;
+
+	for (job = pl->jobs; job; job = job->next)
+		if (job->offset < end && begin < job->offset + (loff_t)job->length)
+			return true;
+	return false;
+}
+
+/* Waits until no job queued so far writes into the range */
+static void recv_pipeline_wait_range(struct recv_pipeline *pl, loff_t begin, loff_t end)
+{
+	recv_pipeline_flush(pl);
+	pthread_mutex_lock(&pl->mutex);
+	while (recv_range_busy(pl, begin, end))
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+/*
+ * Discards the chunks the range covers completely and zeroes the rest:
+ * a thin pool ignores discards of partial chunks, which would leave the
+ * old data there.
+ */
+static void discard_aligned(int out_fd, size_t gran, loff_t begin, loff_t end)
+{
+	const loff_t start = (begin + gran - 1) / gran * gran;
+	const loff_t stop = end / gran * gran;
+
+	if (start >= stop) {
+		zero_range(out_fd, begin, end - begin);
+		return;
+	}
+	zero_range(out_fd, begin, start - begin);
+	cmd_unmap(out_fd, start, stop - start);
+	zero_range(out_fd, stop, end - stop);
+}
+
+static void *discard_thread(void *arg)
+{
+	struct discard_planner *pl = arg;
+	struct discard_range *r;
+
+	pthread_mutex_lock(&pl->mutex);
+	while (true) {
+		while (!pl->queue && !pl->shutdown)
+			pthread_cond_wait(&pl->cond, &pl->mutex);
+		r = pl->queue;
+		if (!r)
+			break;
+		pthread_mutex_unlock(&pl->mutex);
+
+		discard_aligned(pl->out_fd, pl->granularity, r->begin, r->end);
+
+		pthread_mutex_lock(&pl->mutex);
+		pl->queue = r->next;
+		if (!pl->queue)
+			pl->queue_tail = NULL;
+		pl->n_queued--;
+		pthread_cond_broadcast(&pl->cond);
+		free(r);
+	}
+	pthread_mutex_unlock(&pl->mutex);
+	return NULL;
+}
+
+static void discard_planner_start(struct stream_context *ctx)
+{
+	struct discard_planner *pl;
+	unsigned long gran;
+	int err;
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	gran = discard_granularity(ctx->out_fd);
+	pl->out_fd = ctx->out_fd;
+	pl->granularity = gran && gran % 512 == 0 ? gran : 512;
+	pthread_mutex_init(&pl->mutex, NULL);
+	pthread_cond_init(&pl->cond, NULL);
+	err = pthread_create(&pl->thread, NULL, discard_thread, pl);
+	if (err) {
+		fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+		exit(10);
+	}
+	ctx->discards = pl;
+}
+
+/* Hands the pending range to the discard thread */
+static void discard_submit(struct discard_planner *pl)
+{
+	struct discard_range *r;
+
+	if (pl->pending_begin == pl->pending_end)
+		return;
+	r = malloc(sizeof(*r));
+	if (!r) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	r->next = NULL;
+	r->begin = pl->pending_begin;
+	r->end = pl->pending_end;
+	pl->pending_end = pl->pending_begin;
+
+	pthread_mutex_lock(&pl->mutex);
+	while (pl->n_queued >= DISCARD_MAX_QUEUED)
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	if (pl->queue_tail)
+		pl->queue_tail->next = r;
+	else
+		pl->queue = r;
+	pl->queue_tail = r;
+	pl->n_queued++;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+static void discard_plan(struct stream_context *ctx, loff_t offset, size_t length)
+{
+	struct discard_planner *pl = ctx->discards;
+	const loff_t end = offset + length;
+
+	if (!pl) {
+		discard_planner_start(ctx);
+		pl = ctx->discards;
+	}
+	/* DATA queued before it must not land after the discard */
+	if (ctx->recv_pipeline)
+		recv_pipeline_wait_range(ctx->recv_pipeline, offset, end);
+
+	/*
+	 * Only overlapping or adjacent UNMAPs merge. A gap between them is
+	 * not bridged, however small: what the stream leaves alone there is
+	 * unchanged data of the target, and discarding it would lose it.
+	 */
+	if (pl->pending_begin != pl->pending_end &&
+	    offset <= pl->pending_end && end >= pl->pending_begin) {
+		if (offset < pl->pending_begin)
+			pl->pending_begin = offset;
+		if (end > pl->pending_end)
+			pl->pending_end = end;
+		return;
+	}
+	discard_submit(pl);
+	pl->pending_begin = offset;
+	pl->pending_end = end;
+}
+
+static bool discard_range_busy(struct discard_planner *pl, loff_t begin, loff_t end)
+{
+	struct discard_range *r;
+
+	for (r = pl->queue; r; r = r->next)
+		if (r->begin < end && begin < r->end)
+			return true;
+	return false;
+}
+
+/* Before writing into the range, as it may still be discarded */
+static void discard_wait(struct stream_context *ctx, loff_t offset, size_t length)
+{
+	struct discard_planner *pl = ctx->discards;
+	const loff_t end = offset + length;
+
+	if (!pl)
+		return;
+	if (pl->pending_begin < end && offset < pl->pending_end)
+		discard_submit(pl);
+
+	pthread_mutex_lock(&pl->mutex);
+	while (discard_range_busy(pl, offset, end))
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+static void discard_drain(struct stream_context *ctx)
+{
+	struct discard_planner *pl = ctx->discards;
+
+	if (!pl)
+		return;
+	discard_submit(pl);
+
+	pthread_mutex_lock(&pl->mutex);
+	while (pl->queue)
+		pthread_cond_wait(&pl->cond, &pl->mutex);
+	pthread_mutex_unlock(&pl->mutex);
+}
+
+static void discard_planner_finish(struct stream_context *ctx)
+{
+	struct discard_planner *pl = ctx->discards;
+
+	if (!pl)
+		return;
+	discard_drain(ctx);
+
+	pthread_mutex_lock(&pl->mutex);
+	pl->shutdown = true;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->mutex);
+	pthread_join(pl->thread, NULL);
+
+	pthread_mutex_destroy(&pl->mutex);
+	pthread_cond_destroy(&pl->cond);
+	free(pl);
+	ctx->discards = NULL;
+}
+
+static void skip_input(struct stream_context *ctx, size_t remaining)
+{
+	off_t pos;
+
+	if (ctx->in_size) {
+		pos = lseek(ctx->in_fd, remaining, SEEK_CUR);
+		if (pos == -1 || (uint64_t)pos > ctx->in_size) {
+			fputs("Truncated input.\n", stderr);
+			exit(10);
+		}
+		return;
+	}
+	while (remaining > 0) {
+		char sink[512];
+		size_t skip = sizeof(sink);
+
+		if (skip > remaining)
+			skip = remaining;
+		if (read_complete(ctx, sink, skip) != skip) {
+			fputs("Truncated input.\n", stderr);
+			exit(10);
+		}
+		remaining -= skip;
+	}
+}
+
+static uint64_t supported_features(void)
+{
+	uint64_t features = 0;
+
+	if (compress_supported(COMPRESS_LZ4))
+		features |= FEATURE_LZ4;
+	if (compress_supported(COMPRESS_ZSTD))
+		features |= FEATURE_ZSTD;
+	features |= FEATURE_ZERO;
+	features |= FEATURE_CHECKSUM;
+
+	return features;
+}
+
+static void verify_begin_stream(struct stream_context *ctx, uint64_t length)
+{
+	struct stream_begin begin;
+	uint64_t unsupported;
+
+	if (length == 0)
+		return;
+	if (length < sizeof(begin) ||
+	    read_complete(ctx, &begin, sizeof(begin)) != sizeof(begin)) {
+		fprintf(stderr, "Cannot parse BEGIN_STREAM marker, length %"PRIu64"\n", length);
+		exit(10);
+	}
+	/* Later versions may append more, we do not know what it means */
+	skip_input(ctx, length - sizeof(begin));
+
+	ctx->features = be64toh(begin.features);
+	unsupported = ctx->features & ~supported_features();
+	if (unsupported) {
+		fprintf(stderr, "Stream requires features 0x%"PRIx64" this receiver does not support%s\n",
+			unsupported,
+			unsupported & (FEATURE_LZ4 | FEATURE_ZSTD) ?
+			" (built without the compression library?)" : "");
+		exit(10);
+	}
+}
+
+static void verify_stream_stats_ext(struct stream_context *ctx, uint64_t length)
+{
+	struct stream_stats_ext ext;
+
+	if (length < sizeof(ext) ||
+	    read_complete(ctx, &ext, sizeof(ext)) != sizeof(ext)) {
+		fprintf(stderr, "Cannot parse extended stream stats, length %"PRIu64"\n", length);
+		exit(10);
+	}
+	skip_input(ctx, length - sizeof(ext));
+
+	ext.n_zero = be64toh(ext.n_zero);
+	ext.bytes_data = be64toh(ext.bytes_data);
+	ext.bytes_zero = be64toh(ext.bytes_zero);
+	if (ctx->n_zero != ext.n_zero
+	||  ctx->bytes_data != ext.bytes_data
+	||  ctx->bytes_zero != ext.bytes_zero) {
+		fprintf(stderr,
+			"Extended stream stats mismatch: zero/data bytes/zero bytes: stream: %"PRIu64"/%"PRIu64"/%"PRIu64", marker: %"PRIu64"/%"PRIu64"/%"PRIu64"\n",
+			ctx->n_zero, ctx->bytes_data, ctx->bytes_zero,
+			ext.n_zero, ext.bytes_data, ext.bytes_zero);
+		exit(10);
+	}
+}
+
+static bool read_checkpoint(uint64_t *id, uint64_t *offset)
+{
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	fd = open(checkpoint_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = 0;
+
+	return parse_resume_token(buf, id, offset);
+}
+
+/* All connections of a stream come from the same thin_send, each one once */
+static void verify_connection(struct stream_context *ctx, uint64_t length)
+{
+	struct connection_info info;
+	uint32_t index, count;
+	uint64_t nonce;
+
+	if (length != sizeof(info) ||
+	    read_complete(ctx, &info, sizeof(info)) != sizeof(info)) {
+		fprintf(stderr, "Cannot parse CONNECTION chunk, length %"PRIu64"\n", length);
+		exit(10);
+	}
+	if (!listen_addr || ctx->n_chunks != 2) {
+		fprintf(stderr, "Unexpected CONNECTION chunk; receive streams sent with --connect with --listen\n");
+		exit(10);
+	}
+	nonce = be64toh(info.nonce);
+	index = be32toh(info.index);
+	count = be32toh(info.count);
+
+	pthread_mutex_lock(&listen_state.mutex);
+	if (!listen_state.count && count && count <= MAX_CONNECTIONS) {
+		listen_state.count = count;
+		listen_state.nonce = nonce;
+	}
+	if (count != listen_state.count || nonce != listen_state.nonce ||
+	    index >= count || listen_state.seen[index]) {
+		fprintf(stderr, "Connection %u of %u does not belong to this stream\n", index, count);
+		exit(10);
+	}
+	if (count > 1 && checkpoint_path) {
+		fprintf(stderr, "Streams over several connections are not resumable\n");
+		exit(10);
+	}
+	listen_state.seen[index] = true;
+	ctx->shared_target = count > 1;
+	pthread_cond_broadcast(&listen_state.cond);
+	pthread_mutex_unlock(&listen_state.mutex);
+}
+
+/* A resumed stream must continue where the checkpoint says it may */
+static void verify_stream_id(struct stream_context *ctx, uint64_t length)
+{
+	struct stream_id sid;
+	uint64_t id, offset;
+
+	if (length < sizeof(sid) ||
+	    read_complete(ctx, &sid, sizeof(sid)) != sizeof(sid)) {
+		fprintf(stderr, "Cannot parse stream id, length %"PRIu64"\n", length);
+		exit(10);
+	}
+	skip_input(ctx, length - sizeof(sid));
+
+	if (ctx->n_data || ctx->n_unmap || ctx->n_zero) {
+		fputs("Stream id after the first data\n", stderr);
+		exit(10);
+	}
+	ctx->has_stream_id = true;
+	ctx->stream_id = be64toh(sid.id);
+	ctx->applied_end = be64toh(sid.resume_offset);
+
+	if (!ctx->applied_end || !checkpoint_path)
+		return;
+	if (!read_checkpoint(&id, &offset)) {
+		fprintf(stderr, "Stream resumes at %jd, but there is no checkpoint in %s\n",
+			(intmax_t)ctx->applied_end, checkpoint_path);
+		exit(10);
+	}
+	if (id != ctx->stream_id || (uint64_t)ctx->applied_end > offset) {
+		fprintf(stderr, "Stream resumes at %jd, which does not match the checkpoint %016"PRIx64":%"PRIu64"\n",
+			(intmax_t)ctx->applied_end, id, offset);
+		exit(10);
+	}
+}
+
+/* Checkpoints are only meaningful while the stream goes up in offsets */
+static void advance_position(struct stream_context *ctx, loff_t offset, size_t length)
+{
+	if (offset < ctx->applied_end)
+		ctx->out_of_order = true;
+	else
+		ctx->applied_end = offset + length;
+}
+
+/*
+ * Once everything received so far is durable, records the stream id and
+ * how far it got; thin_send --resume takes that as its resume token.
+ */
+static void write_checkpoint(struct stream_context *ctx)
+{
+	char *tmp_path;
+	int fd, len;
+	char buf[64];
+
+	ctx->checkpoint_bytes = ctx->bytes_data;
+	if (!ctx->has_stream_id || ctx->out_of_order) {
+		fprintf(stderr, "%s, not writing checkpoints\n",
+			ctx->out_of_order ? "Stream is not in offset order" : "Stream not sent with --resumable");
+		checkpoint_path = NULL;
+		return;
+	}
+
+	discard_drain(ctx);
+	if (ctx->recv_pipeline)
+		recv_pipeline_drain(ctx);
+	else if (fsync(ctx->out_fd)) {
+		perror("fsync()");
+		exit(10);
+	}
+
+	len = snprintf(buf, sizeof(buf), "%016"PRIx64":%jd\n", ctx->stream_id, (intmax_t)ctx->applied_end);
+	checked_asprintf(&tmp_path, "%s.tmp", checkpoint_path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1 || write(fd, buf, len) != len || fsync(fd) || rename(tmp_path, checkpoint_path))
+		fprintf(stderr, "writing checkpoint %s failed: %s\n", checkpoint_path, strerror(errno));
+	if (fd != -1)
+		close(fd);
+	free(tmp_path);
+}
+
+static void verify_end_stream(struct stream_context *ctx, uint64_t offset, uint64_t length)
+{
+	/* offset does not carry meaning (yet), expected to be 0.
+	 * length is expected to be sizeof(stream_stats).
+	 * "Forward compat" could allow larger length to add additional info,
+	 * but I think those should rather be added in "optional chunks" just
+	 * before the END_STREAM marker.
+	 * Treat them as additional magic numbers. */
+
+	struct stream_stats stats;
+	size_t count;
+	if (!(offset == 0 && length == sizeof(stats))) {
+		fprintf(stderr, "Cannot verify END_STREAM marker chunk: o: %"PRIu64", l: %"PRIu64"\n",
+			offset, length);
+		exit(10);
+	}
+	errno = 0;
+	count = read_complete(ctx, &stats, sizeof(stats));
+	if (count != sizeof(stats)) {
+		fprintf(stderr, "Cannot verify END_STREAM marker, incomplete stats: expected %zu bytes, got %zu\n",
+			sizeof(stats), count);
+		exit(10);
+	}
+	stats.n_chunks = be64toh(stats.n_chunks);
+	stats.n_unmap = be64toh(stats.n_unmap);
+	stats.n_data = be64toh(stats.n_data);
+	if (ctx->n_chunks != stats.n_chunks
+	||  ctx->n_unmap != stats.n_unmap
+	||  ctx->n_data != stats.n_data) {
+		fprintf(stderr,
+			"END_STREAM marker mismatch: chunks/unmap/data: stream: %"PRIu64"/%"PRIu64"/%"PRIu64", marker: %"PRIu64"/%"PRIu64"/%"PRIu64"\n",
+			ctx->n_chunks, ctx->n_unmap, ctx->n_data,
+			stats.n_chunks, stats.n_unmap, stats.n_data
+			);
+		exit(10);
+	}
+}
+
+/* thin_recv --inspect: counts a DATA or ZERO extent into the offset histogram */
+static void inspect_extent(struct stream_context *ctx, loff_t offset, size_t length)
+{
+	struct inspect_report *r = ctx->inspect;
+	uint64_t b;
+	int i;
+
+	if (!r)
+		return;
+	while ((uint64_t)offset / r->bucket_size >= INSPECT_BUCKETS) {
+		for (i = 0; i < INSPECT_BUCKETS / 2; i++) {
+			r->bucket_extents[i] = r->bucket_extents[2 * i] + r->bucket_extents[2 * i + 1];
+			r->bucket_bytes[i] = r->bucket_bytes[2 * i] + r->bucket_bytes[2 * i + 1];
+		}
+		memset(&r->bucket_extents[i], 0, sizeof(r->bucket_extents[0]) * (INSPECT_BUCKETS - i));
+		memset(&r->bucket_bytes[i], 0, sizeof(r->bucket_bytes[0]) * (INSPECT_BUCKETS - i));
+		r->bucket_size *= 2;
+	}
+	b = offset / r->bucket_size;
+	r->bucket_extents[b]++;
+	r->bucket_bytes[b] += length;
+}
+
+static bool process_input(struct stream_context *ctx)
+{
+	int in_fd = ctx->in_fd;
+	int out_fd = ctx->out_fd;
+	struct chunk chunk;
+	uint64_t recv_magic_value;
+	off_t offset;
+	size_t length;
+	enum cmd cmd;
+	uint32_t crc;
+	bool has_crc;
+	int ret;
+
+	ret = read_complete(ctx, &chunk, sizeof(chunk));
+	if (ret == 0)
+		return false;
+	assert(ret == sizeof(chunk));
+
+	ctx->n_chunks++;
+	if (ctx->n_end_stream) {
+		fprintf(stderr, "Stream continued beyond END_STREAM marker\n");
+		exit(10);
+	}
+
+	recv_magic_value = be64toh(chunk.magic);
+	offset = be64toh(chunk.offset);
+	length = be64toh(chunk.length);
+	cmd = be32toh(chunk.cmd);
+
+	if (ctx->n_chunks == 1) {
+		if (recv_magic_value == MAGIC_VALUE_1_1) {
+			if (stream_format == STREAM_FORMAT_1_1
+			||  stream_format == STREAM_FORMAT_AUTO) {
+				expect_magic = MAGIC_VALUE_1_1;
+			} else {
+				fprintf(stderr, "Found current version magic, but was told to only accept older version magic.\n");
+			}
+		} else if (recv_magic_value == OLD_MAGIC) {
+			fputs("Received data contains the magic value of a previous version of this program.\n"
+			      "Make sure that the version of this program that is used on the sending side matches\n"
+			      "the version of this program used on the receiving side.\n",
+			      stderr);
+		} else if (recv_magic_value == MAGIC_VALUE_1_0) {
+			if (stream_format == STREAM_FORMAT_1_0
+			||  stream_format == STREAM_FORMAT_AUTO) {
+				/* silently accept previous format stream */
+				expect_magic = MAGIC_VALUE_1_0;
+			} else {
+				fprintf(stderr, "Found old version magic, but was told to only accept current version magic.\n");
+			}
+		} else {
+			fprintf(stderr, "Magic value mismatch, encountered unknown value 0x%llX\n",
+				(unsigned long long) recv_magic_value);
+		}
+
+		if (!expect_magic)
+			exit(10);
+	}
+
+	if (expect_magic != recv_magic_value) {
+		fprintf(stderr, "Magic value mismatch, expected 0x%llX, found 0x%llX\n",
+			(unsigned long long) expect_magic,
+			(unsigned long long) recv_magic_value);
+		exit(10);
+	}
+
+	if (ctx->n_chunks == 1 && cmd == CMD_VOLUME) {
+		fprintf(stderr, "This is a batch stream, receive it with --batch\n");
+		exit(10);
+	}
+
+	if (ctx->n_chunks == 1 && cmd != CMD_BEGIN_STREAM && expect_magic != MAGIC_VALUE_1_0) {
+		fprintf(stderr, "Stream does not start with BEGIN_STREAM\n");
+		exit(10);
+	}
+
+	if (expect_magic == MAGIC_VALUE_1_0 && cmd != CMD_DATA && cmd != CMD_UNMAP) {
+		fprintf(stderr, "Old format stream containing unknown cmd chunk: %u\n", cmd);
+		exit(10);
+		/*
+		 * FIXME: rather silently accept, for bug to bug compat?
+		 * Previous version would ignore unknown cmd values.
+		 */
+	}
+
+	if (ctx->crc_pending && cmd != CMD_DATA && cmd != CMD_DATA_COMPRESSED) {
+		fprintf(stderr, "Checksum for offset %jd not followed by its data\n",
+			(intmax_t)ctx->crc_offset);
+		exit(10);
+	}
+
+	switch (cmd) {
+	case CMD_DATA:
+		discard_wait(ctx, offset, length);
+		advance_position(ctx, offset, length);
+		has_crc = take_checksum(ctx, offset, length, &crc);
+		if (ctx->squash)
+			squash_collect(ctx, CMD_DATA, offset, length, length, has_crc ? &crc : NULL);
+		if (ctx->inspect || ctx->squash)
+			skip_input(ctx, length);
+		else if (ctx->recv_pipeline)
+			recv_pipeline_data(ctx, offset, length, has_crc ? &crc : NULL);
+		else if (zero_elide != ZERO_ELIDE_OFF || has_crc || ctx->shared_target)
+			recv_data_buffered(ctx, offset, length, has_crc ? &crc : NULL);
+		else
+			copy_data(in_fd, NULL, out_fd, &offset, length);
+		ctx->n_data++;
+		ctx->bytes_data += length;
+		inspect_extent(ctx, offset, length);
+		if (!ctx->squash)
+			progress_done(true, length);
+		break;
+
+	case CMD_DATA_COMPRESSED: {
+		uint64_t bytes_data = ctx->bytes_data;
+
+		cmd_data_compressed(ctx, offset, length);
+		ctx->n_data++;
+		inspect_extent(ctx, offset, ctx->bytes_data - bytes_data);
+		if (!ctx->squash)
+			progress_done(true, ctx->bytes_data - bytes_data);
+		break;
+	}
+
+	case CMD_ZERO:
+		discard_wait(ctx, offset, length);
+		if (ctx->recv_pipeline)
+			recv_pipeline_range(ctx, CMD_ZERO, offset, length);
+		else if (ctx->squash)
+			squash_collect(ctx, CMD_ZERO, offset, length, 0, NULL);
+		else if (!ctx->inspect)
+			cmd_zero(out_fd, offset, length);
+		advance_position(ctx, offset, length);
+		ctx->n_zero++;
+		ctx->bytes_zero += length;
+		inspect_extent(ctx, offset, length);
+		if (!ctx->squash)
+			progress_done(true, length);
+		break;
+
+	case CMD_UNMAP:
+		/* we'd like to "punch hole".
+		 * But the VFS layer will not allow us to use FALLOC_FL_NO_HIDE_STALE.
+		 * And without that, this translates to blockdev_issue_zeroout,
+		 * but the block layer rejects "efficient zeroout", because
+		 * device mapper thin does not implement it.
+		ret = fallocate(out_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE|FALLOC_FL_NO_HIDE_STALE, offset, length);
+		if (ret == -1) {
+			perror("fallocate(, FALLOC_FL_PUNCH_HOLE,) failed");
+			exit(10);
+		}
+		 */
+		if (ctx->inspect)
+			ctx->inspect->bytes_unmap += length;
+		else if (ctx->squash)
+			squash_collect(ctx, CMD_UNMAP, offset, length, 0, NULL);
+		else
+			discard_plan(ctx, offset, length);
+		advance_position(ctx, offset, length);
+		ctx->n_unmap++;
+		if (!ctx->squash)
+			progress_done(false, length);
+		break;
+
+	/* below is not even reached for MAGIC_VALUE_1_0 */
+	case CMD_BEGIN_STREAM:
+		/* carries the stream features, if the sender uses any */
+		if (ctx->n_chunks != 1) {
+			fprintf(stderr, "BEGIN_STREAM must occur only once, at the start of the stream\n");
+			exit(10);
+		}
+		verify_begin_stream(ctx, length);
+		ctx->n_begin_stream++;
+		break;
+	case CMD_STREAM_STATS_EXT:
+		verify_stream_stats_ext(ctx, length);
+		break;
+	case CMD_STREAM_ID:
+		verify_stream_id(ctx, length);
+		break;
+	case CMD_CHECKSUM:
+		read_checksum(ctx, offset, length);
+		if (ctx->inspect)
+			ctx->inspect->n_checksum++;
+		break;
+	case CMD_CONNECTION:
+		verify_connection(ctx, length);
+		break;
+	case CMD_STREAM_INDEX:
+		/* only of use to thin_recv --archive, which seeks to it */
+		skip_input(ctx, length);
+		break;
+	case CMD_END_STREAM:
+		/* TODO store something useful in it, do something useful with it? */
+		if (ctx->n_begin_stream != 1) {
+			fprintf(stderr, "END_STREAM without BEGIN_STREAM!?\n");
+			exit(10);
+		}
+		/* only verify once everything before it is durable */
+		discard_drain(ctx);
+		recv_pipeline_drain(ctx);
+		verify_end_stream(ctx, offset, length);
+		ctx->n_end_stream++;
+		break;
+	default:
+		if (cmd & CMD_FLAG_OPTIONAL_INFO) {
+			fprintf(stderr, "Unrecognized optional chunk 0x%x, length %zu\n", cmd, length);
+			skip_input(ctx, length);
+			if (ctx->inspect)
+				ctx->inspect->n_optional++;
+		} else {
+			fprintf(stderr, "Unrecognized chunk 0x%x, length %zu\n", cmd, length);
+			exit(10);
+		}
+	}
+
+	return true;
+}
+
+static void pread_archive(int fd, void *buf, size_t count, uint64_t pos)
+{
+	uint64_t start = report_now();
+	size_t done = 0;
+
+	while (done < count) {
+		const ssize_t ret = pread(fd, (char *)buf + done, count - done, pos + done);
+		if (ret > 0) {
+			done += ret;
+		} else if (ret == 0) {
+			fprintf(stderr, "Truncated archive, %zu bytes missing at %"PRIu64"\n",
+				count - done, pos + done);
+			exit(10);
+		} else if (errno != EINTR) {
+			fprintf(stderr, "pread(%"PRIu64", %zu): %m\n", pos + done, count - done);
+			exit(10);
+		}
+	}
+	phase_add(PHASE_STREAM_READ, start, count);
+}
+
+/* Where the entry writes to the target, within the range; false if nowhere */
+static bool archive_extent(const struct index_entry *e, loff_t *begin, loff_t *end)
+{
+	uint64_t length;
+
+	*begin = *end = 0;
+	switch (e->cmd) {
+	case CMD_DATA:
+	case CMD_ZERO:
+	case CMD_UNMAP:
+		length = e->length;
+		break;
+	case CMD_DATA_COMPRESSED:
+		length = e->raw_length;
+		break;
+	default:
+		return false;
+	}
+	*begin = e->offset > range_begin ? e->offset : range_begin;
+	*end = e->offset + length < range_end ? e->offset + length : range_end;
+	return *begin < *end;
+}
+
+static bool archive_busy(struct archive_restore *ar, uint64_t i, loff_t begin, loff_t end)
+{
+	loff_t b, e;
+	int t;
+
+	for (t = 0; t < ar->n_threads; t++) {
+		uint64_t j = ar->running[t];
+
+		if (j < i && archive_extent(&ar->entries[j], &b, &e) && b < end && begin < e)
+			return true;
+	}
+	return false;
+}
+
+/* The CHECKSUM chunk right before the data chunk i, if there is one */
+static bool archive_checksum(struct archive_restore *ar, uint64_t i, uint64_t length, uint32_t *crc)
+{
+	const struct index_entry *e = &ar->entries[i];
+	const struct index_entry *prev = &ar->entries[i - 1];
+	struct chunk_checksum cs;
+
+	if (prev->cmd != CMD_CHECKSUM || prev->offset != e->offset) {
+		if (ar->features & FEATURE_CHECKSUM) {
+			fprintf(stderr, "No checksum for the data at offset %"PRIu64", length %"PRIu64"\n",
+				e->offset, length);
+			exit(10);
+		}
+		return false;
+	}
+	if (prev->length < sizeof(cs)) {
+		fprintf(stderr, "Cannot parse checksum chunk at offset %"PRIu64", length %"PRIu64"\n",
+			prev->offset, prev->length);
+		exit(10);
+	}
+	pread_archive(ar->in_fd, &cs, sizeof(cs), prev->pos + sizeof(struct chunk));
+	if (be64toh(cs.length) != length) {
+		fprintf(stderr, "Checksum for offset %"PRIu64", length %"PRIu64", but the data is at offset %"PRIu64", length %"PRIu64"\n",
+			prev->offset, (uint64_t)be64toh(cs.length), e->offset, length);
+		exit(10);
+	}
+	*crc = be32toh(cs.crc32c);
+	return true;
+}
+
+/*
+ * With a checksum, all of the chunk is read to verify it, but only the
+ * range is written. buf is the thread's, of ARCHIVE_PIECE_SIZE.
+ */
+static void archive_data(struct archive_restore *ar, uint64_t i, loff_t begin, loff_t end,
+			 char *buf)
+{
+	const struct index_entry *e = &ar->entries[i];
+	const loff_t offset = e->offset;
+	uint32_t expected_crc, crc = ~0U;
+	bool has_crc = archive_checksum(ar, i, e->length, &expected_crc);
+	loff_t from = has_crc ? offset : begin;
+	loff_t to = has_crc ? offset + (loff_t)e->length : end;
+
+	while (from < to) {
+		size_t len = to - from < ARCHIVE_PIECE_SIZE ? to - from : ARCHIVE_PIECE_SIZE;
+		loff_t b = from > begin ? from : begin;
+		loff_t en = from + (loff_t)len < end ? from + (loff_t)len : end;
+
+		pread_archive(ar->in_fd, buf, len, e->pos + sizeof(struct chunk) + (from - offset));
+		if (has_crc)
+			crc = crc32c(crc, buf, len);
+		if (b < en)
+			apply_data(ar->out_fd, -1, buf + (b - from), en - b, b);
+		from += len;
+	}
+	if (has_crc)
+		verify_checksum(expected_crc, ~crc, offset, e->length);
+}
+
+static void archive_compressed(struct archive_restore *ar, uint64_t i, loff_t begin, loff_t end)
+{
+	const struct index_entry *e = &ar->entries[i];
+	struct compressed_data *hdr;
+	uint32_t crc;
+	bool has_crc = archive_checksum(ar, i, e->raw_length, &crc);
+	char *buf, *mem;
+
+	buf = malloc(e->length);
+	if (!buf) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	pread_archive(ar->in_fd, buf, e->length, e->pos + sizeof(struct chunk));
+	hdr = (struct compressed_data *)buf;
+	if (e->length <= sizeof(*hdr) || be64toh(hdr->raw_length) != e->raw_length ||
+	    be32toh(hdr->algo) == COMPRESS_NONE || !compress_supported(be32toh(hdr->algo))) {
+		fprintf(stderr, "Unsupported compressed chunk at offset %"PRIu64": algo %u, raw length %"PRIu64"\n",
+			e->offset, be32toh(hdr->algo), (uint64_t)be64toh(hdr->raw_length));
+		exit(10);
+	}
+	mem = decompress_verified(be32toh(hdr->algo), (char *)(hdr + 1), e->length - sizeof(*hdr),
+				  e->offset, e->raw_length, has_crc ? &crc : NULL);
+	apply_data(ar->out_fd, -1, mem + e->offset % DIRECT_ALIGN + (begin - e->offset),
+		   end - begin, begin);
+	free(mem);
+	free(buf);
+}
+
+/* The chunk in the file must be what the index says */
+static void archive_apply(struct archive_restore *ar, uint64_t i, loff_t begin, loff_t end,
+			  char *buf)
+{
+	const struct index_entry *e = &ar->entries[i];
+	struct chunk chunk;
+
+	pread_archive(ar->in_fd, &chunk, sizeof(chunk), e->pos);
+	if (be64toh(chunk.magic) != MAGIC_VALUE_1_1 || be64toh(chunk.offset) != e->offset ||
+	    be64toh(chunk.length) != e->length || be32toh(chunk.cmd) != e->cmd) {
+		fprintf(stderr, "Chunk at %"PRIu64" of the archive does not match its index entry\n",
+			e->pos);
+		exit(10);
+	}
+
+	switch (e->cmd) {
+	case CMD_DATA:
+		archive_data(ar, i, begin, end, buf);
+		break;
+	case CMD_DATA_COMPRESSED:
+		archive_compressed(ar, i, begin, end);
+		break;
+	case CMD_ZERO:
+		cmd_zero(ar->out_fd, begin, end - begin);
+		break;
+	default:
+		discard_aligned(ar->out_fd, ar->granularity, begin, end);
+	}
+	progress_done(e->cmd != CMD_UNMAP, end - begin);
+}
+
+static void *archive_thread(void *arg)
+{
+	struct archive_restore *ar = arg;
+	loff_t begin = 0, end = 0;
+	uint64_t i;
+	char *buf;
+	int t;
+
+	if (posix_memalign((void **)&buf, 4096, ARCHIVE_PIECE_SIZE)) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	pthread_mutex_lock(&ar->mutex);
+	t = ar->n_started++;
+	while (true) {
+		while (ar->next < ar->n_entries && !archive_extent(&ar->entries[ar->next], &begin, &end))
+			ar->next++;
+		if (ar->next == ar->n_entries)
+			break;
+		i = ar->next++;
+		ar->running[t] = i;
+		while (archive_busy(ar, i, begin, end))
+			pthread_cond_wait(&ar->cond, &ar->mutex);
+		pthread_mutex_unlock(&ar->mutex);
+
+		archive_apply(ar, i, begin, end, buf);
+
+		pthread_mutex_lock(&ar->mutex);
+		ar->running[t] = UINT64_MAX;
+		pthread_cond_broadcast(&ar->cond);
+	}
+	pthread_mutex_unlock(&ar->mutex);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Reads the index of a file written by thin_send --index, after checking
+ * that it describes the file, and verifies the stream stats against it.
+ */
+static void read_archive_index(struct stream_context *ctx, struct archive_restore *ar,
+			       const char *path)
+{
+	struct stream_index trailer;
+	struct chunk chunk, end_chunk;
+	uint64_t size, end_pos, index_pos, pos, i;
+	struct index_entry *e;
+	off_t ret;
+
+	ret = lseek(ctx->in_fd, 0, SEEK_END);
+	if (ret == -1) {
+		fprintf(stderr, "%s is not seekable: %s\n", path, strerror(errno));
+		exit(10);
+	}
+	size = ret;
+	if (size < 3 * sizeof(chunk) + sizeof(struct stream_stats) + sizeof(trailer))
+		goto no_index;
+	end_pos = size - sizeof(chunk) - sizeof(struct stream_stats);
+	pread_archive(ctx->in_fd, &end_chunk, sizeof(end_chunk), end_pos);
+	if (be64toh(end_chunk.magic) != MAGIC_VALUE_1_1 || be32toh(end_chunk.cmd) != CMD_END_STREAM)
+		goto no_index;
+
+	pread_archive(ctx->in_fd, &trailer, sizeof(trailer), end_pos - sizeof(trailer));
+	ar->n_entries = be64toh(trailer.n_entries);
+	index_pos = be64toh(trailer.pos);
+	if (index_pos > end_pos - sizeof(trailer) - sizeof(chunk) ||
+	    ar->n_entries != (end_pos - sizeof(trailer) - sizeof(chunk) - index_pos) / sizeof(*e) ||
+	    (end_pos - sizeof(trailer) - sizeof(chunk) - index_pos) % sizeof(*e))
+		goto no_index;
+	pread_archive(ctx->in_fd, &chunk, sizeof(chunk), index_pos);
+	if (be64toh(chunk.magic) != MAGIC_VALUE_1_1 || be32toh(chunk.cmd) != CMD_STREAM_INDEX)
+		goto no_index;
+
+	ar->entries = malloc(ar->n_entries * sizeof(*e));
+	if (!ar->entries) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	pread_archive(ctx->in_fd, ar->entries, ar->n_entries * sizeof(*e), index_pos + sizeof(chunk));
+
+	/* the entries must cover the stream before the index without gaps */
+	for (i = 0, pos = 0; i < ar->n_entries; i++) {
+		e = &ar->entries[i];
+		e->pos = be64toh(e->pos);
+		e->offset = be64toh(e->offset);
+		e->length = be64toh(e->length);
+		e->cmd = be32toh(e->cmd);
+		e->raw_length = be32toh(e->raw_length);
+		if (e->pos != pos || pos + sizeof(chunk) > index_pos ||
+		    payload_length(e->cmd, e->length) > index_pos - pos - sizeof(chunk)) {
+			fprintf(stderr, "Index entry %"PRIu64" of %s is inconsistent\n", i, path);
+			exit(10);
+		}
+		pos += sizeof(chunk) + payload_length(e->cmd, e->length);
+
+		switch (e->cmd) {
+		case CMD_DATA:
+			ctx->n_data++;
+			ctx->bytes_data += e->length;
+			break;
+		case CMD_DATA_COMPRESSED:
+			ctx->n_data++;
+			ctx->bytes_data += e->raw_length;
+			break;
+		case CMD_ZERO:
+			ctx->n_zero++;
+			ctx->bytes_zero += e->length;
+			break;
+		case CMD_UNMAP:
+			ctx->n_unmap++;
+			break;
+		}
+	}
+	if (pos != index_pos || !ar->n_entries || ar->entries[0].cmd != CMD_BEGIN_STREAM) {
+		fprintf(stderr, "The index of %s does not describe the stream\n", path);
+		exit(10);
+	}
+
+	/* the stats chunks, checked as if the stream was received */
+	for (i = 0; i < ar->n_entries; i++) {
+		e = &ar->entries[i];
+		if (e->cmd != CMD_STREAM_STATS_EXT)
+			continue;
+		lseek(ctx->in_fd, e->pos + sizeof(chunk), SEEK_SET);
+		verify_stream_stats_ext(ctx, e->length);
+	}
+	ctx->n_chunks = ar->n_entries + 2; /* index and end marker */
+	lseek(ctx->in_fd, end_pos + sizeof(chunk), SEEK_SET);
+	verify_end_stream(ctx, be64toh(end_chunk.offset), be64toh(end_chunk.length));
+	return;
+
+no_index:
+	fprintf(stderr, "%s does not end with the index of thin_send --index\n", path);
+	exit(10);
+}
+
+static void thin_receive_archive(const char *snap_name, const char *path)
+{
+	struct stream_context ctx = { 0, };
+	struct archive_restore ar = { 0, };
+	pthread_t *threads;
+	unsigned long gran;
+	int i, err;
+
+	ctx.in_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ctx.in_fd == -1) {
+		fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+		exit(10);
+	}
+	read_archive_index(&ctx, &ar, path);
+
+	/* magic and features, as for any stream */
+	lseek(ctx.in_fd, 0, SEEK_SET);
+	ctx.n_chunks = 0;
+	process_input(&ctx);
+
+	ctx.out_fd = open_target(snap_name);
+	zero_elide_setup(ctx.out_fd);
+	gran = discard_granularity(ctx.out_fd);
+
+	ar.in_fd = ctx.in_fd;
+	ar.out_fd = ctx.out_fd;
+	ar.features = ctx.features;
+	ar.granularity = gran && gran % 512 == 0 ? gran : 512;
+	ar.n_threads = n_writers;
+	ar.running = malloc(n_writers * sizeof(*ar.running));
+	threads = calloc(n_writers, sizeof(*threads));
+	if (!ar.running || !threads) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < n_writers; i++)
+		ar.running[i] = UINT64_MAX;
+	pthread_mutex_init(&ar.mutex, NULL);
+	pthread_cond_init(&ar.cond, NULL);
+
+	for (i = 0; i < n_writers; i++) {
+		err = pthread_create(&threads[i], NULL, archive_thread, &ar);
+		if (err) {
+			fprintf(stderr, "pthread_create(): %s\n", strerror(err));
+			exit(10);
+		}
+	}
+	for (i = 0; i < n_writers; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fsync(ctx.out_fd)) {
+		perror("fsync()");
+		exit(10);
+	}
+	pthread_mutex_destroy(&ar.mutex);
+	pthread_cond_destroy(&ar.cond);
+	free(threads);
+	free(ar.running);
+	free(ar.entries);
+	close(ctx.out_fd);
+	close(ctx.in_fd);
+}
+
+static int squash_record_cmp(const void *a, const void *b)
+{
+	const struct squash_record *ra = a, *rb = b;
+
+	if (ra->begin != rb->begin)
+		return ra->begin < rb->begin ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static void squash_spill(struct squash *sq)
+{
+	struct squash_run *run;
+
+	qsort(sq->records, sq->n_records, sizeof(*sq->records), squash_record_cmp);
+	if (sq->tmp_fd == -1)
+		sq->tmp_fd = open_unlinked_tmp();
+	sq->runs = realloc(sq->runs, (sq->n_runs + 1) * sizeof(*sq->runs));
+	if (!sq->runs) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	run = &sq->runs[sq->n_runs++];
+	memset(run, 0, sizeof(*run));
+	run->pos = sq->tmp_records;
+	run->n_left = sq->n_records;
+	write_all(sq->tmp_fd, (const char *)sq->records, sq->n_records * sizeof(*sq->records));
+	sq->tmp_records += sq->n_records;
+	sq->n_records = 0;
+}
+
+static void squash_add(struct squash *sq, int file, enum cmd cmd, uint64_t begin, uint64_t end,
+		       uint64_t pos, uint64_t length, const uint32_t *crc)
+{
+	struct squash_record *r;
+
+	if (begin == end)
+		return;
+	if (sq->n_records == SQUASH_RUN_RECORDS)
+		squash_spill(sq);
+	r = &sq->records[sq->n_records++];
+	r->begin = begin;
+	r->end = end;
+	r->seq = sq->seq++;
+	r->pos = pos;
+	r->length = length;
+	r->file = file;
+	r->cmd = cmd;
+	r->crc = crc ? *crc : 0;
+	r->has_crc = crc != NULL;
+}
+
+/* From process_input(), for a chunk whose payload (if any) follows */
+static void squash_collect(struct stream_context *ctx, enum cmd cmd, uint64_t offset,
+			   uint64_t length, uint64_t payload_length, const uint32_t *crc)
+{
+	off_t pos = lseek(ctx->in_fd, 0, SEEK_CUR);
+
+	/* the payload starts with the header, which was read already */
+	if (cmd == CMD_DATA_COMPRESSED) {
+		pos -= sizeof(struct compressed_data);
+		squash_features |= ctx->features & (FEATURE_LZ4 | FEATURE_ZSTD);
+	}
+	if (cmd == CMD_ZERO)
+		squash_features |= FEATURE_ZERO;
+	squash_add(ctx->squash, ctx->squash_file, cmd, offset, offset + length, pos,
+		   payload_length, crc);
+}
+
+/*
+ * Reads one stream with the checks of thin_recv, seeking over the payloads.
+ * The stream id and the index do not carry over into the squashed stream.
+ */
+static void squash_scan(struct squash *sq, int file)
+{
+	struct stream_context ctx = {
+		.in_fd = sq->fds[file],
+		.out_fd = -1,
+		.in_size = sq->sizes[file],
+		.squash = sq,
+		.squash_file = file,
+	};
+
+	while (process_input(&ctx))
+		;
+	verify_stream_complete(&ctx, false);
+}
+
+/* The next record of the run, NULL if there is none */
+static struct squash_record *squash_run_peek(struct squash *sq, struct squash_run *run)
+{
+	size_t n;
+
+	if (run->i_buf < run->n_buf)
+		return &run->buf[run->i_buf];
+	if (!run->n_left)
+		return NULL;
+
+	n = run->n_left < SQUASH_READ_RECORDS ? run->n_left : SQUASH_READ_RECORDS;
+	pread_archive(sq->tmp_fd, run->buf, n * sizeof(*run->buf), run->pos * sizeof(*run->buf));
+	run->pos += n;
+	run->n_left -= n;
+	run->n_buf = n;
+	run->i_buf = 0;
+	return run->buf;
+}
+
+static bool squash_run_before(struct squash *sq, int a, int b)
+{
+	return squash_record_cmp(squash_run_peek(sq, &sq->runs[a]),
+				 squash_run_peek(sq, &sq->runs[b])) < 0;
+}
+
+static void squash_merge_down(struct squash *sq, int i)
+{
+	while (true) {
+		int min = i, l = 2 * i + 1, r = 2 * i + 2, tmp;
+
+		if (l < sq->n_merge && squash_run_before(sq, sq->merge[l], sq->merge[min]))
+			min = l;
+		if (r < sq->n_merge && squash_run_before(sq, sq->merge[r], sq->merge[min]))
+			min = r;
+		if (min == i)
+			return;
+		tmp = sq->merge[i];
+		sq->merge[i] = sq->merge[min];
+		sq->merge[min] = tmp;
+		i = min;
+	}
+}
+
+/* Without runs in the tmp file, the records in memory are the only run */
+static void squash_merge_start(struct squash *sq)
+{
+	int i;
+
+	if (sq->tmp_fd != -1) {
+		if (sq->n_records)
+			squash_spill(sq);
+		free(sq->records);
+		sq->records = NULL;
+	} else {
+		qsort(sq->records, sq->n_records, sizeof(*sq->records), squash_record_cmp);
+		sq->runs = calloc(1, sizeof(*sq->runs));
+		if (!sq->runs) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
+		sq->runs[0].buf = sq->records;
+		sq->runs[0].n_buf = sq->n_records;
+		sq->n_runs = 1;
+	}
+
+	sq->merge = malloc(sq->n_runs * sizeof(*sq->merge));
+	if (!sq->merge) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+	for (i = 0; i < sq->n_runs; i++) {
+		if (sq->tmp_fd != -1) {
+			sq->runs[i].buf = malloc(SQUASH_READ_RECORDS * sizeof(*sq->runs[i].buf));
+			if (!sq->runs[i].buf) {
+				fputs("Out of memory.\n", stderr);
+				exit(10);
+			}
+		}
+		if (squash_run_peek(sq, &sq->runs[i]))
+			sq->merge[sq->n_merge++] = i;
+	}
+	for (i = sq->n_merge / 2 - 1; i >= 0; i--)
+		squash_merge_down(sq, i);
+}
+
+/* The record with the lowest begin of all runs, NULL once all are done */
+static struct squash_record *squash_merge_peek(struct squash *sq)
+{
+	return sq->n_merge ? squash_run_peek(sq, &sq->runs[sq->merge[0]]) : NULL;
+}
+
+static void squash_merge_pop(struct squash *sq)
+{
+	struct squash_run *run = &sq->runs[sq->merge[0]];
+
+	run->i_buf++;
+	if (!squash_run_peek(sq, run))
+		sq->merge[0] = sq->merge[--sq->n_merge];
+	squash_merge_down(sq, 0);
+}
+
+static void squash_active_swap(struct squash *sq, size_t a, size_t b)
+{
+	struct squash_record tmp = sq->active[a];
 
-			fprintf(stderr, "unmap(,%zd,%zu) failed: %s%s\n",
-				byte_offset, byte_length, strerror(errno),
-				ignore ? "" : " -- ignored\n");
-			if (!ignore)
-				exit(10);
-		}
-		offset += chunk;
-		bytes_left -= chunk;
-	}
+	sq->active[a] = sq->active[b];
+	sq->active[b] = tmp;
 }
 
-static void verify_end_stream(struct stream_context *ctx, uint64_t offset, uint64_t length)
+static void squash_activate(struct squash *sq, const struct squash_record *r)
 {
-	/* offset does not carry meaning (yet), expected to be 0.
-	 * length is expected to be sizeof(stream_stats).
-	 * "Forward compat" could allow larger length to add additional info,
-	 * but I think those should rather be added in "optional chunks" just
-	 * before the END_STREAM marker.
-	 * Treat them as additional magic numbers. */
+	size_t i;
 
-	struct stream_stats stats;
-	size_t count;
-	if (!(offset == 0 && length == sizeof(stats))) {
-		fprintf(stderr, "Cannot verify END_STREAM marker chunk: o: %"PRIu64", l: %"PRIu64"\n",
-			offset, length);
-		exit(10);
-	}
-	errno = 0;
-	count = read_complete(ctx, &stats, sizeof(stats));
-	if (count != sizeof(stats)) {
-		fprintf(stderr, "Cannot verify END_STREAM marker, incomplete stats: expected %zu bytes, got %zu\n",
-			sizeof(stats), count);
-		exit(10);
+	/* hidden by the top one for all of its length */
+	if (sq->n_active && r->seq < sq->active[0].seq && r->end <= sq->active[0].end)
+		return;
+
+	if (sq->n_active == sq->size_active) {
+		sq->size_active = sq->size_active ? sq->size_active * 2 : 64;
+		sq->active = realloc(sq->active, sq->size_active * sizeof(*sq->active));
+		if (!sq->active) {
+			fputs("Out of memory.\n", stderr);
+			exit(10);
+		}
 	}
-	stats.n_chunks = be64toh(stats.n_chunks);
-	stats.n_unmap = be64toh(stats.n_unmap);
-	stats.n_data = be64toh(stats.n_data);
-	if (ctx->n_chunks != stats.n_chunks
-	||  ctx->n_unmap != stats.n_unmap
-	||  ctx->n_data != stats.n_data) {
-		fprintf(stderr,
-			"END_STREAM marker mismatch: chunks/unmap/data: stream: %"PRIu64"/%"PRIu64"/%"PRIu64", marker: %"PRIu64"/%"PRIu64"/%"PRIu64"\n",
-			ctx->n_chunks, ctx->n_unmap, ctx->n_data,
-			stats.n_chunks, stats.n_unmap, stats.n_data
-			);
-		exit(10);
+	i = sq->n_active++;
+	sq->active[i] = *r;
+	while (i && sq->active[(i - 1) / 2].seq < sq->active[i].seq) {
+		squash_active_swap(sq, i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
 }
 
-static bool process_input(struct stream_context *ctx)
+static void squash_active_pop(struct squash *sq)
 {
-	int in_fd = ctx->in_fd;
-	int out_fd = ctx->out_fd;
-	struct chunk chunk;
-	uint64_t recv_magic_value;
-	off_t offset;
-	size_t length;
-	enum cmd cmd;
-	int ret;
-
-	ret = read_complete(ctx, &chunk, sizeof(chunk));
-	if (ret == 0)
-		return false;
-	assert(ret == sizeof(chunk));
+	size_t i = 0;
 
-	ctx->n_chunks++;
-	if (ctx->n_end_stream) {
-		fprintf(stderr, "Stream continued beyond END_STREAM marker\n");
-		exit(10);
+	sq->active[0] = sq->active[--sq->n_active];
+	while (true) {
+		size_t max = i, l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < sq->n_active && sq->active[l].seq > sq->active[max].seq)
+			max = l;
+		if (r < sq->n_active && sq->active[r].seq > sq->active[max].seq)
+			max = r;
+		if (max == i)
+			return;
+		squash_active_swap(sq, i, max);
+		i = max;
 	}
+}
 
-	recv_magic_value = be64toh(chunk.magic);
-	offset = be64toh(chunk.offset);
-	length = be64toh(chunk.length);
-	cmd = be32toh(chunk.cmd);
+static void squash_send_data(struct squash *sq, const char *buf, size_t len, loff_t offset)
+{
+	struct stream_context *ctx = sq->out;
 
-	if (ctx->n_chunks == 1) {
-		if (recv_magic_value == MAGIC_VALUE_1_1) {
-			if (stream_format == STREAM_FORMAT_1_1
-			||  stream_format == STREAM_FORMAT_AUTO) {
-				expect_magic = MAGIC_VALUE_1_1;
-			} else {
-				fprintf(stderr, "Found current version magic, but was told to only accept older version magic.\n");
-			}
-		} else if (recv_magic_value == OLD_MAGIC) {
-			fputs("Received data contains the magic value of a previous version of this program.\n"
-			      "Make sure that the version of this program that is used on the sending side matches\n"
-			      "the version of this program used on the receiving side.\n",
-			      stderr);
-		} else if (recv_magic_value == MAGIC_VALUE_1_0) {
-			if (stream_format == STREAM_FORMAT_1_0
-			||  stream_format == STREAM_FORMAT_AUTO) {
-				/* silently accept previous format stream */
-				expect_magic = MAGIC_VALUE_1_0;
-			} else {
-				fprintf(stderr, "Found old version magic, but was told to only accept current version magic.\n");
-			}
-		} else {
-			fprintf(stderr, "Magic value mismatch, encountered unknown value 0x%llX\n",
-				(unsigned long long) recv_magic_value);
-		}
+	if (checksum) {
+		struct chunk_checksum cs = {
+			.length = htobe64(len),
+			.crc32c = htobe32(~crc32c(~0U, buf, len)),
+		};
 
-		if (!expect_magic)
-			exit(10);
+		send_header(ctx->out_fd, offset, sizeof(cs), CMD_CHECKSUM);
+		write_all(ctx->out_fd, (const char *)&cs, sizeof(cs));
+		ctx->n_chunks++;
 	}
+	send_header(ctx->out_fd, offset, len, CMD_DATA);
+	write_all(ctx->out_fd, buf, len);
+	ctx->n_data++;
+	ctx->bytes_data += len;
+	ctx->n_chunks++;
+}
 
-	if (expect_magic != recv_magic_value) {
-		fprintf(stderr, "Magic value mismatch, expected 0x%llX, found 0x%llX\n",
-			(unsigned long long) expect_magic,
-			(unsigned long long) recv_magic_value);
-		exit(10);
+/* A whole DATA chunk has its checksum verified on the way */
+static void squash_data(struct squash *sq, const struct squash_record *r, uint64_t begin, uint64_t end)
+{
+	const bool verify = r->has_crc && begin == r->begin && end == r->end;
+	uint32_t crc = ~0U;
+	uint64_t pos;
+
+	for (pos = begin; pos < end; ) {
+		size_t len = end - pos < max_io_size ? end - pos : max_io_size;
+
+		pread_archive(sq->fds[r->file], sq->buf, len, r->pos + (pos - r->begin));
+		if (verify)
+			crc = crc32c(crc, sq->buf, len);
+		squash_send_data(sq, sq->buf, len, pos);
+		pos += len;
 	}
+	if (verify)
+		verify_checksum(r->crc, ~crc, r->begin, end - begin);
+}
 
-	if (ctx->n_chunks == 1 && cmd != CMD_BEGIN_STREAM && expect_magic != MAGIC_VALUE_1_0) {
-		fprintf(stderr, "Stream does not start with BEGIN_STREAM\n");
+/* Passed through as it is if all of it is needed; its checksum too, which thin_recv verifies */
+static void squash_compressed(struct squash *sq, const struct squash_record *r,
+			      uint64_t begin, uint64_t end)
+{
+	struct stream_context *ctx = sq->out;
+	const struct compressed_data *hdr;
+	uint32_t crc;
+	char *buf, *mem;
+	uint64_t pos;
+
+	buf = malloc(r->length);
+	if (!buf) {
+		fputs("Out of memory.\n", stderr);
 		exit(10);
 	}
+	pread_archive(sq->fds[r->file], buf, r->length, r->pos);
+	hdr = (const struct compressed_data *)buf;
+
+	if (begin == r->begin && end == r->end && (!checksum || r->has_crc)) {
+		if (checksum) {
+			struct chunk_checksum cs = {
+				.length = htobe64(end - begin),
+				.crc32c = htobe32(r->crc),
+			};
+
+			send_header(ctx->out_fd, begin, sizeof(cs), CMD_CHECKSUM);
+			write_all(ctx->out_fd, (const char *)&cs, sizeof(cs));
+			ctx->n_chunks++;
+		}
+		send_header(ctx->out_fd, begin, r->length, CMD_DATA_COMPRESSED);
+		if (stream_index)
+			index_raw_length(end - begin);
+		write_all(ctx->out_fd, buf, r->length);
+		ctx->n_data++;
+		ctx->bytes_data += end - begin;
+		ctx->n_chunks++;
+		free(buf);
+		return;
+	}
 
-	if (expect_magic == MAGIC_VALUE_1_0 && cmd != CMD_DATA && cmd != CMD_UNMAP) {
-		fprintf(stderr, "Old format stream containing unknown cmd chunk: %u\n", cmd);
-		exit(10);
-		/*
-		 * FIXME: rather silently accept, for bug to bug compat?
-		 * Previous version would ignore unknown cmd values.
-		 */
+	crc = r->crc;
+	mem = decompress_verified(be32toh(hdr->algo), buf + sizeof(*hdr), r->length - sizeof(*hdr),
+				  r->begin, r->end - r->begin, r->has_crc ? &crc : NULL);
+	for (pos = begin; pos < end; ) {
+		size_t len = end - pos < max_io_size ? end - pos : max_io_size;
+
+		squash_send_data(sq, mem + r->begin % DIRECT_ALIGN + (pos - r->begin), len, pos);
+		pos += len;
 	}
+	free(mem);
+	free(buf);
+}
 
-	switch (cmd) {
-	case CMD_DATA:
-		copy_data(in_fd, NULL, out_fd, &offset, length);
-		ctx->n_data++;
-		break;
+static void squash_flush(struct squash *sq)
+{
+	struct stream_context *ctx = sq->out;
+	const struct squash_record *r = &sq->pending;
+	const uint64_t begin = sq->pending_begin, end = sq->pending_end;
 
-	case CMD_UNMAP:
-		/* we'd like to "punch hole".
-		 * But the VFS layer will not allow us to use FALLOC_FL_NO_HIDE_STALE.
-		 * And without that, this translates to blockdev_issue_zeroout,
-		 * but the block layer rejects "efficient zeroout", because
-		 * device mapper thin does not implement it.
-		ret = fallocate(out_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE|FALLOC_FL_NO_HIDE_STALE, offset, length);
-		if (ret == -1) {
-			perror("fallocate(, FALLOC_FL_PUNCH_HOLE,) failed");
-			exit(10);
-		}
-		 */
-		cmd_unmap(out_fd, offset, length);
-		ctx->n_unmap++;
-		break;
+	if (begin == end)
+		return;
+	sq->pending_end = begin;
 
-	/* below is not even reached for MAGIC_VALUE_1_0 */
-	case CMD_BEGIN_STREAM:
-		/* TODO store something useful in it, do something useful with it? */
-		if (ctx->n_chunks != 1) {
-			fprintf(stderr, "BEGIN_STREAM must occur only once, at the start of the stream\n");
-			exit(10);
-		}
-		ctx->n_begin_stream++;
+	switch (r->cmd) {
+	case CMD_DATA:
+		squash_data(sq, r, begin, end);
 		break;
-	case CMD_END_STREAM:
-		/* TODO store something useful in it, do something useful with it? */
-		if (ctx->n_begin_stream != 1) {
-			fprintf(stderr, "END_STREAM without BEGIN_STREAM!?\n");
-			exit(10);
-		}
-		verify_end_stream(ctx, offset, length);
-		ctx->n_end_stream++;
+	case CMD_DATA_COMPRESSED:
+		squash_compressed(sq, r, begin, end);
+		break;
+	case CMD_ZERO:
+		send_header(ctx->out_fd, begin, end - begin, CMD_ZERO);
+		ctx->n_zero++;
+		ctx->bytes_zero += end - begin;
+		ctx->n_chunks++;
 		break;
 	default:
-		if (cmd & CMD_FLAG_OPTIONAL_INFO) {
-			size_t remaining = length;
+		send_header(ctx->out_fd, begin, end - begin, CMD_UNMAP);
+		ctx->n_unmap++;
+		ctx->n_chunks++;
+	}
+	progress_done(r->cmd != CMD_UNMAP, end - begin);
+}
 
-			fprintf(stderr, "Unrecognized optional chunk 0x%x, length %zu\n", cmd, length);
-			while (remaining > 0) {
-				char sink[512];
-				size_t skip = sizeof(sink);
-
-				if (skip > remaining)
-					skip = remaining;
-				if (read_complete(ctx, sink, skip) != skip) {
-					fputs("Truncated input.\n", stderr);
-					exit(10);
-				}
-				remaining -= skip;
-			}
-		} else {
-			fprintf(stderr, "Unrecognized chunk 0x%x, length %zu\n", cmd, length);
+static void squash_emit(struct squash *sq, const struct squash_record *r, uint64_t begin, uint64_t end)
+{
+	const struct squash_record *p = &sq->pending;
+
+	if (sq->pending_begin != sq->pending_end && sq->pending_end == begin &&
+	    (p->seq == r->seq || (p->cmd == r->cmd && (r->cmd == CMD_ZERO || r->cmd == CMD_UNMAP)))) {
+		sq->pending_end = end;
+		return;
+	}
+	squash_flush(sq);
+	sq->pending = *r;
+	sq->pending_begin = begin;
+	sq->pending_end = end;
+}
+
+/* Emits what the target ends up with, in offset order */
+static void squash_sweep(struct squash *sq)
+{
+	struct squash_record *next = squash_merge_peek(sq);
+	uint64_t pos = 0, end;
+
+	while (next || sq->n_active) {
+		if (!sq->n_active)
+			pos = next->begin;
+		while (next && next->begin <= pos) {
+			squash_activate(sq, next);
+			squash_merge_pop(sq);
+			next = squash_merge_peek(sq);
+		}
+		while (sq->n_active && sq->active[0].end <= pos)
+			squash_active_pop(sq);
+		if (!sq->n_active)
+			continue;
+
+		end = sq->active[0].end;
+		if (next && next->begin < end)
+			end = next->begin;
+		squash_emit(sq, &sq->active[0], pos, end);
+		pos = end;
+	}
+	squash_flush(sq);
+}
+
+/*
+ * thin_send --squash: one stream out of a full stream and the incremental
+ * ones on top of it, as if they were received in order; with only the
+ * data written last and the UNMAPs nothing wrote over later.
+ */
+static void thin_send_squash(const char *const *paths, int n_paths, int out_fd)
+{
+	struct stream_context ctx = { 0, };
+	struct squash sq = { .paths = paths, .n_files = n_paths, .tmp_fd = -1 };
+	struct stat sb;
+	int i;
+
+	sq.fds = calloc(n_paths, sizeof(*sq.fds));
+	sq.sizes = calloc(n_paths, sizeof(*sq.sizes));
+	sq.records = malloc(SQUASH_RUN_RECORDS * sizeof(*sq.records));
+	if (posix_memalign((void **)&sq.buf, 4096, max_io_size) ||
+	    !sq.fds || !sq.sizes || !sq.records) {
+		fputs("Out of memory.\n", stderr);
+		exit(10);
+	}
+
+	for (i = 0; i < n_paths; i++) {
+		sq.fds[i] = open(paths[i], O_RDONLY | O_CLOEXEC);
+		if (sq.fds[i] == -1 || fstat(sq.fds[i], &sb)) {
+			fprintf(stderr, "failed to open %s: %s\n", paths[i], strerror(errno));
 			exit(10);
 		}
+		sq.sizes[i] = sb.st_size;
+		squash_scan(&sq, i);
 	}
+	squash_merge_start(&sq);
 
-	return true;
+	ctx.out_fd = out_fd;
+	ctx.n_chunks = 2; /* begin and end marker count */
+	sq.out = &ctx;
+	send_begin_stream(out_fd);
+	squash_sweep(&sq);
+	send_end_stream(&ctx);
+
+	for (i = 0; i < sq.n_runs; i++)
+		if (sq.tmp_fd != -1)
+			free(sq.runs[i].buf);
+	for (i = 0; i < n_paths; i++)
+		close(sq.fds[i]);
+	if (sq.tmp_fd != -1)
+		close(sq.tmp_fd);
+	free(sq.runs);
+	free(sq.merge);
+	free(sq.active);
+	free(sq.records);
+	free(sq.buf);
+	free(sq.fds);
+	free(sq.sizes);
 }
 
 static int checked_asprintf(char **strp, const char *fmt, ...)
@@ -1099,47 +6379,110 @@ static int system_fmt(const char *fmt, ...)
 	return 0;
 }
 
-static int lockfile_lock(void)
+/*
+ * Per pool, two lock files coordinate the senders sharing its metadata
+ * snapshot. The ".lock" file serializes reserving and releasing it.
+ * Every user of the reservation holds a shared lock on the ".users"
+ * file, so whoever gets an exclusive lock on it is the only user. It
+ * also records the pool's transaction id at the time of the reservation.
+ */
+static int open_pool_lockfile(const char *thin_pool_dm_path, const char *suffix)
 {
-	int lockfile_fd = open(LOCKFILE_PATH, O_CREAT | O_RDONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (lockfile_fd != -1) {
-		const int lock_rc = flock(lockfile_fd, LOCK_EX);
-		if (lock_rc != 0) {
-			const char* const error_msg = strerror(errno);
-			fprintf(stderr, "%s: Cannot obtain a lock on lock file %s\n",
-			        PGM_NAME, LOCKFILE_PATH);
-			fprintf(stderr, "    Error: %s\n", error_msg);
-			close(lockfile_fd);
-			lockfile_fd = -1;
-		}
-	} else {
+	const char *pool = strrchr(thin_pool_dm_path, '/');
+	char *path;
+	int fd;
+
+	pool = pool ? pool + 1 : thin_pool_dm_path;
+	checked_asprintf(&path, "%s/thin-send-recv-%s.%s", LOCKFILE_DIR, pool, suffix);
+	fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
 		const char* const error_msg = strerror(errno);
 		fprintf(stderr, "%s: Cannot open lock file %s\n",
-		        PGM_NAME, LOCKFILE_PATH);
+		        PGM_NAME, path);
 		fprintf(stderr, "    Error: %s\n", error_msg);
 	}
-	return lockfile_fd;
+	free(path);
+	return fd;
 }
 
-static void lockfile_unlock(const int lockfile_fd)
+static int flock_retry(int fd, int operation)
 {
-	if (lockfile_fd != -1) {
-		flock(lockfile_fd, LOCK_UN);
-		close(lockfile_fd);
-	}
+	int ret;
+
+	do {
+		ret = flock(fd, operation);
+	} while (ret == -1 && errno == EINTR);
+	if (ret && !(operation & LOCK_NB))
+		fprintf(stderr, "%s: Cannot obtain a lock on lock file\n    Error: %s\n",
+			PGM_NAME, strerror(errno));
+	return ret;
+}
+
+static void write_reserved_transaction_id(int users_fd, const char *thin_pool_dm_path)
+{
+	uint64_t trans_id;
+	char buf[32];
+	int len = 0;
+
+	if (!pool_transaction_id(thin_pool_dm_path, &trans_id))
+		len = snprintf(buf, sizeof(buf), "%llu\n", (unsigned long long)trans_id);
+	if (ftruncate(users_fd, 0) || pwrite(users_fd, buf, len, 0) != len)
+		fprintf(stderr, "%s: writing the users file failed: %s\n", PGM_NAME, strerror(errno));
+}
+
+/* Joining is only safe if the pool did not change since the snapshot was taken */
+static bool reservation_is_current(int users_fd, const char *thin_pool_dm_path)
+{
+	unsigned long long reserved;
+	uint64_t trans_id;
+	char buf[32];
+	ssize_t len;
+
+	len = pread(users_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return false;
+	buf[len] = 0;
+	if (sscanf(buf, "%llu", &reserved) != 1)
+		return false;
+
+	return !pool_transaction_id(thin_pool_dm_path, &trans_id) && trans_id == reserved;
 }
 
+/* Releases the snapshots we are the last user of, then terminates */
 static void release_metadata_upon_signal(int signal)
 {
+	struct reservation *r;
 	char *tpool;
+	pid_t pid;
+
+	for (r = reservations; r < reservations + MAX_RESERVATIONS; r++) {
+		if (!r->thin_pool_dm_path)
+			continue;
+
+		/* the same open file as in reserve_metadata_snap(), so this never waits for ourselves */
+		flock(r->lock_fd, LOCK_EX);
+		flock(r->users_fd, LOCK_UN);
+		if (flock(r->users_fd, LOCK_EX | LOCK_NB)) {
+			fprintf(stderr, "%s: Terminated by signal %s %d, metadata-snap of %s still used by others\n",
+				PGM_NAME, strsignal(signal), signal, r->thin_pool_dm_path);
+			continue;
+		}
 
-	fprintf(stderr, "%s: Terminated by signal %s %d, relasing metadata-snap\n",
-		PGM_NAME, strsignal(signal), signal);
-
-	asprintf(&tpool, "%s-tpool", data_for_signal_handler);
-	execlp("dmsetup", "dmsetup", "message", tpool, "0", "release_metadata_snap", NULL);
-	/* if execlp returned there was an error, errno should be set here. */
-	fprintf(stderr, "%s: execlp() returned %d %s\n", PGM_NAME, errno, strerror(errno));
+		fprintf(stderr, "%s: Terminated by signal %s %d, relasing metadata-snap of %s\n",
+			PGM_NAME, strsignal(signal), signal, r->thin_pool_dm_path);
+
+		asprintf(&tpool, "%s-tpool", r->thin_pool_dm_path);
+		/* the child shares our open files, the locks are held until it is done */
+		pid = fork();
+		if (pid == 0) {
+			execlp("dmsetup", "dmsetup", "message", tpool, "0", "release_metadata_snap", NULL);
+			/* if execlp returned there was an error, errno should be set here. */
+			fprintf(stderr, "%s: execlp() returned %d %s\n", PGM_NAME, errno, strerror(errno));
+			_exit(10);
+		}
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+	}
 	_exit(10);
 }
 
@@ -1163,27 +6506,157 @@ static void set_signals(void (*handler)(int))
 	}
 }
 
-static int reserve_metadata_snap(const char *thin_pool_dm_path)
+/* A parse error while the metadata tool still runs exits with the snapshot reserved */
+static void release_metadata_at_exit(void)
 {
-	int err;
+	struct reservation *r;
+
+	for (r = reservations; r < reservations + MAX_RESERVATIONS; r++)
+		if (r->thin_pool_dm_path)
+			release_metadata_snap(r->thin_pool_dm_path);
+}
+
+/* Makes the reservation known to the signal and exit handlers */
+static struct reservation *add_reservation(const char *thin_pool_dm_path, int lock_fd, int users_fd)
+{
+	static bool atexit_registered;
+	struct reservation *r;
 
-	data_for_signal_handler = thin_pool_dm_path;
+	pthread_mutex_lock(&reservations_mutex);
+	if (!atexit_registered) {
+		atexit(release_metadata_at_exit);
+		atexit_registered = true;
+	}
+	for (r = reservations; r < reservations + MAX_RESERVATIONS; r++)
+		if (!r->thin_pool_dm_path)
+			break;
+	if (r == reservations + MAX_RESERVATIONS) {
+		pthread_mutex_unlock(&reservations_mutex);
+		fputs("Too many metadata snapshot reservations.\n", stderr);
+		exit(10);
+	}
+	r->lock_fd = lock_fd;
+	r->users_fd = users_fd;
+	r->since = report_now();
+	/* last, the signal handler only looks at slots with a pool */
+	r->thin_pool_dm_path = thin_pool_dm_path;
 	set_signals(&release_metadata_upon_signal);
+	pthread_mutex_unlock(&reservations_mutex);
+
+	return r;
+}
+
+static void remove_reservation(struct reservation *r)
+{
+	bool in_use = false;
+	int i;
+
+	pthread_mutex_lock(&reservations_mutex);
+	r->thin_pool_dm_path = NULL;
+	for (i = 0; i < MAX_RESERVATIONS; i++)
+		in_use |= reservations[i].thin_pool_dm_path != NULL;
+	if (!in_use)
+		set_signals(SIG_DFL);
+	pthread_mutex_unlock(&reservations_mutex);
+}
+
+static struct reservation *find_reservation(const char *thin_pool_dm_path)
+{
+	struct reservation *r, *found = NULL;
+
+	pthread_mutex_lock(&reservations_mutex);
+	for (r = reservations; r < reservations + MAX_RESERVATIONS; r++) {
+		if (r->thin_pool_dm_path && !strcmp(r->thin_pool_dm_path, thin_pool_dm_path)) {
+			found = r;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&reservations_mutex);
+
+	return found;
+}
+
+/*
+ * Reserves the pool's metadata snapshot, or joins the reservation of
+ * concurrent senders if the pool has not changed since it was taken.
+ * If it has, waits for them to finish and takes a fresh one.
+ */
+static int reserve_metadata_snap(const char *thin_pool_dm_path)
+{
+	struct reservation *r;
+	uint64_t start = report_now();
+	int lock_fd, users_fd, err;
+
+	lock_fd = open_pool_lockfile(thin_pool_dm_path, "lock");
+	users_fd = open_pool_lockfile(thin_pool_dm_path, "users");
+	if (lock_fd == -1 || users_fd == -1 || flock_retry(lock_fd, LOCK_EX))
+		exit(10);
+
+	while (flock_retry(users_fd, LOCK_EX | LOCK_NB)) {
+		if (reservation_is_current(users_fd, thin_pool_dm_path)) {
+			if (flock_retry(users_fd, LOCK_SH))
+				exit(10);
+			phase_add(PHASE_LOCK_WAIT, start, 0);
+			add_reservation(thin_pool_dm_path, lock_fd, users_fd);
+			flock(lock_fd, LOCK_UN);
+			return 0;
+		}
+
+		/* stale, wait until the last user of it released it */
+		flock(lock_fd, LOCK_UN);
+		if (flock_retry(users_fd, LOCK_EX))
+			exit(10);
+		flock(users_fd, LOCK_UN);
+		if (flock_retry(lock_fd, LOCK_EX))
+			exit(10);
+	}
+
+	/* nobody else uses the pool's metadata snapshot */
+	phase_add(PHASE_LOCK_WAIT, start, 0);
+	r = add_reservation(thin_pool_dm_path, lock_fd, users_fd);
 	err = system_fmt("dmsetup message %s-tpool 0 reserve_metadata_snap",
 			 thin_pool_dm_path);
-	if (err)
+	if (err) {
 		fprintf(stderr, "LVM metadata_snap is reserved. You can free it by running:\n\n"
 			"dmsetup message %s-tpool 0 release_metadata_snap\n\n"
 			"Only do that if nothing else is using it.\n",
 			thin_pool_dm_path);
+		remove_reservation(r);
+		close(users_fd);
+		close(lock_fd);
+		return err;
+	}
 
-	return err;
+	write_reserved_transaction_id(users_fd, thin_pool_dm_path);
+	flock_retry(users_fd, LOCK_SH);
+	flock(lock_fd, LOCK_UN);
+	return 0;
 }
 
+/* Leaves the reservation; the last user releases the metadata snapshot */
 static void release_metadata_snap(const char *thin_pool_dm_path)
 {
-	system_fmt("dmsetup message %s-tpool 0 release_metadata_snap",
-		   thin_pool_dm_path);
-	set_signals(SIG_DFL);
-	data_for_signal_handler = NULL;
+	struct reservation *r = find_reservation(thin_pool_dm_path);
+	int lock_fd, users_fd;
+
+	if (!r)
+		return;
+	lock_fd = r->lock_fd;
+	users_fd = r->users_fd;
+	phase_add(PHASE_MD_SNAP_HOLD, r->since, 0);
+
+	flock_retry(lock_fd, LOCK_EX);
+	flock(users_fd, LOCK_UN);
+	if (!flock_retry(users_fd, LOCK_EX | LOCK_NB)) {
+		system_fmt("dmsetup message %s-tpool 0 release_metadata_snap",
+			   thin_pool_dm_path);
+		if (ftruncate(users_fd, 0))
+			perror("truncating the users file failed");
+	}
+	remove_reservation(r);
+
+	flock(users_fd, LOCK_UN);
+	flock(lock_fd, LOCK_UN);
+	close(users_fd);
+	close(lock_fd);
 }
@@ -12,7 +12,7 @@ Requires: /bin/sh
 
 Source0: %{name}-%{version}.tar.gz
 BuildRoot: %{_tmppath}/%{name}-%{version}-root
-BuildRequires: flex make gcc
+BuildRequires: make gcc pkgconfig lz4-devel libzstd-devel
 
 %description
 thin_send serializes a thin volume into a stream. It is more efficient than
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "report.h"
+#include "throttle.h"
+
+#define NSEC 1000000000ULL
+/* A bucket fills up to a tenth of a second of its rate */
+#define BURST_NS (NSEC / 10)
+/* The latency target is checked on the average over this long */
+#define WINDOW_NS (NSEC / 5)
+/* Added to the byte rate after each window within the target */
+#define ADAPT_STEP (4ULL << 20)
+#define ADAPT_MIN (1ULL << 20)
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+struct bucket {
+	uint64_t rate;		/* per second, 0 for unlimited */
+	double tokens;		/* negative while in debt */
+};
+
+static struct {
+	bool enabled;
+	bool adaptive;
+	pthread_mutex_t mutex;
+	uint64_t last;		/* buckets were filled up to here */
+	struct bucket bytes;
+	struct bucket ios;
+	uint64_t rate_limit;	/* bytes.rate stays below it while adapting */
+	uint64_t latency_target;
+
+	uint64_t window_start;
+	uint64_t window_ns;
+	uint64_t window_ios;
+	uint64_t window_bytes;
+
+	const char *control_path;
+	struct timespec control_mtime;
+	uint64_t control_checked;
+} throttle = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void fill(struct bucket *b, uint64_t elapsed)
+{
+	const double burst = (double)b->rate * BURST_NS / NSEC;
+
+	b->tokens += (double)b->rate * elapsed / NSEC;
+	if (b->tokens > burst)
+		b->tokens = burst;
+}
+
+/* Returns how long to wait until the debt is paid */
+static uint64_t take(struct bucket *b, uint64_t n)
+{
+	if (!b->rate)
+		return 0;
+	b->tokens -= n;
+	return b->tokens < 0 ? -b->tokens * NSEC / b->rate : 0;
+}
+
+static void set_limits(uint64_t rate, uint64_t iops, uint64_t latency_target)
+{
+	throttle.rate_limit = rate;
+	throttle.bytes.rate = rate;
+	throttle.bytes.tokens = 0;
+	throttle.ios.rate = iops;
+	throttle.ios.tokens = 0;
+	throttle.latency_target = latency_target;
+	throttle.window_start = report_now();
+	throttle.window_ns = 0;
+	throttle.window_ios = 0;
+	throttle.window_bytes = 0;
+}
+
+static bool parse_number(const char *s, uint64_t *val)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(s, &end, 10);
+	if (errno || end == s)
+		return false;
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	case 'g': case 'G': v <<= 30; end++; break;
+	}
+	*val = v;
+	return !*end;
+}
+
+/* Errors leave the limits as they were, the transfer goes on */
+static void control_read(void)
+{
+	uint64_t rate = throttle.rate_limit, iops = throttle.ios.rate;
+	uint64_t latency_ms = throttle.latency_target / 1000000;
+	char line[256], key[32], value[32];
+	bool ok = true;
+	FILE *f;
+
+	f = fopen(throttle.control_path, "re");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %m\n", throttle.control_path);
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		uint64_t *val;
+
+		if (line[0] == '#' || sscanf(line, "%31s %31s", key, value) != 2)
+			continue;
+		if (!strcmp(key, "rate"))
+			val = &rate;
+		else if (!strcmp(key, "iops"))
+			val = &iops;
+		else if (!strcmp(key, "latency-target"))
+			val = &latency_ms;
+		else
+			val = NULL;
+		if (!val || !parse_number(value, val)) {
+			fprintf(stderr, "%s: can not use \"%s %s\"\n", throttle.control_path, key, value);
+			ok = false;
+		}
+	}
+	fclose(f);
+	if (!ok)
+		return;
+
+	set_limits(rate, iops, latency_ms * 1000000);
+	fprintf(stderr, "throttle: rate %"PRIu64" bytes/s, %"PRIu64" IOPS, latency target %"PRIu64" ms\n",
+		rate, iops, latency_ms);
+}
+
+static void control_check(void)
+{
+	struct stat sb;
+
+	if (stat(throttle.control_path, &sb))
+		return;	/* gone, keep the limits */
+	if (sb.st_mtim.tv_sec == throttle.control_mtime.tv_sec &&
+	    sb.st_mtim.tv_nsec == throttle.control_mtime.tv_nsec)
+		return;
+	throttle.control_mtime = sb.st_mtim;
+	control_read();
+}
+
+void throttle_setup(uint64_t rate, uint64_t iops, uint64_t latency_target,
+		    const char *control_path)
+{
+	throttle.enabled = rate || iops || latency_target || control_path;
+	throttle.adaptive = latency_target || control_path;
+	throttle.control_path = control_path;
+	throttle.last = report_now();
+	set_limits(rate, iops, latency_target);
+	if (control_path)
+		control_check();
+}
+
+bool throttle_enabled(void)
+{
+	return throttle.enabled;
+}
+
+bool throttle_adaptive(void)
+{
+	return throttle.adaptive;
+}
+
+void throttle_io(uint64_t bytes)
+{
+	uint64_t now, wait, wait_ios;
+
+	if (!throttle.enabled)
+		return;
+
+	pthread_mutex_lock(&throttle.mutex);
+	now = report_now();
+	if (throttle.control_path && now - throttle.control_checked >= NSEC) {
+		throttle.control_checked = now;
+		control_check();
+	}
+	fill(&throttle.bytes, now - throttle.last);
+	fill(&throttle.ios, now - throttle.last);
+	throttle.last = now;
+	wait = take(&throttle.bytes, bytes);
+	wait_ios = take(&throttle.ios, 1);
+	pthread_mutex_unlock(&throttle.mutex);
+
+	if (wait_ios > wait)
+		wait = wait_ios;
+	if (wait) {
+		struct timespec ts = { .tv_sec = wait / NSEC, .tv_nsec = wait % NSEC };
+
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+}
+
+/* AIMD: halve what went through when the device got slow, else add a step */
+static void adapt(uint64_t now)
+{
+	const uint64_t latency = throttle.window_ns / throttle.window_ios;
+	const uint64_t seen = throttle.window_bytes * NSEC / (now - throttle.window_start);
+	uint64_t rate = throttle.bytes.rate;
+
+	if (latency > throttle.latency_target) {
+		rate = (rate && rate < seen ? rate : seen) / 2;
+		if (rate < ADAPT_MIN)
+			rate = ADAPT_MIN;
+	} else if (rate) {
+		rate += ADAPT_STEP;
+		if (throttle.rate_limit && rate > throttle.rate_limit)
+			rate = throttle.rate_limit;
+	}
+	throttle.bytes.rate = rate;
+	/* what went before was let through at the old rate */
+	if (throttle.bytes.tokens < 0)
+		throttle.bytes.tokens = 0;
+
+	throttle.window_start = now;
+	throttle.window_ns = 0;
+	throttle.window_ios = 0;
+	throttle.window_bytes = 0;
+}
+
+void throttle_done(uint64_t start, uint64_t bytes)
+{
+	uint64_t now;
+
+	if (!throttle.adaptive)
+		return;
+
+	pthread_mutex_lock(&throttle.mutex);
+	now = report_now();
+	throttle.window_ns += now - start;
+	throttle.window_ios++;
+	throttle.window_bytes += bytes;
+	if (throttle.latency_target && now - throttle.window_start >= WINDOW_NS)
+		adapt(now);
+	pthread_mutex_unlock(&throttle.mutex);
+}
+
+int set_ioprio(enum ioprio_class class, int level)
+{
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, class << IOPRIO_CLASS_SHIFT | level)) {
+		fprintf(stderr, "ioprio_set(): %m\n");
+		return -1;
+	}
+	return 0;
+}
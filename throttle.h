@@ -0,0 +1,36 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Limits the device I/O of the process, in bytes/s and I/Os per second,
+ * with a token bucket each; 0 is unlimited. With a latency target (in ns)
+ * the byte rate follows the device: halved when the I/Os of a window took
+ * longer on average, raised step by step while they did not.
+ *
+ * The control file, if any, is re-read when it changes, checked once a
+ * second. Lines of "rate SIZE", "iops N" and "latency-target MS" replace
+ * the limits given here.
+ */
+extern void throttle_setup(uint64_t rate, uint64_t iops, uint64_t latency_target,
+			   const char *control_path);
+extern bool throttle_enabled(void);
+/* Device time must be measured apart from stream time */
+extern bool throttle_adaptive(void);
+
+/* Waits until an I/O of that size may go */
+extern void throttle_io(uint64_t bytes);
+/* The I/O started at start, see report_now(), is complete */
+extern void throttle_done(uint64_t start, uint64_t bytes);
+
+enum ioprio_class {
+	IOPRIO_CLASS_RT = 1,
+	IOPRIO_CLASS_BE = 2,
+	IOPRIO_CLASS_IDLE = 3,
+};
+/* For the calling thread, and the threads and processes it creates afterwards */
+extern int set_ioprio(enum ioprio_class class, int level);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls,
+ * so that we do not need liburing at build or run time.
+ */
+struct uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;	/* local, published to *sq_tail on submit */
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/* All functions returning int return 0 or a negative errno */
+extern int uring_init(struct uring *ring, unsigned entries);
+extern void uring_exit(struct uring *ring);
+extern int uring_register_buffers(struct uring *ring, const struct iovec *iov, unsigned nr);
+
+/* Returns NULL if the submission queue is full */
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+extern int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+/* Returns NULL if no completion is pending */
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+extern void uring_cqe_seen(struct uring *ring);
+
+#endif
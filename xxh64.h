@@ -0,0 +1,10 @@
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* XXH64, compatible with the reference implementation's output */
+extern uint64_t xxh64(const void *buf, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "zero.h"
+
+static bool buf_is_zero_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = 0, v;
+
+	for (; len >= sizeof(v); p += sizeof(v), len -= sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		acc |= v;
+		/* bail out early, but do not branch for every word */
+		if (((uintptr_t)p & 4095) == 4096 - sizeof(v) && acc)
+			return false;
+	}
+	for (; len; p++, len--)
+		acc |= *p;
+
+	return acc == 0;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static bool buf_is_zero_sse2(const void *buf, size_t len)
+{
+	const char *p = buf;
+	__m128i acc = _mm_setzero_si128();
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)p));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(p + 48)));
+		if (((uintptr_t)p & 4095) == 4096 - 64 &&
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+		return false;
+
+	return buf_is_zero_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static bool buf_is_zero_avx2(const void *buf, size_t len)
+{
+	const char *p = buf;
+	__m256i acc = _mm256_setzero_si256();
+
+	for (; len >= 128; p += 128, len -= 128) {
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)p));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + 32)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + 64)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)(p + 96)));
+		if (((uintptr_t)p & 4095) == 4096 - 128 && !_mm256_testz_si256(acc, acc))
+			return false;
+	}
+	if (!_mm256_testz_si256(acc, acc))
+		return false;
+
+	return buf_is_zero_scalar(p, len);
+}
+#endif
+
+static bool (*buf_is_zero_impl)(const void *buf, size_t len) = buf_is_zero_scalar;
+
+/* Picked once before main(), so threads never race on it */
+__attribute__((constructor))
+static void buf_is_zero_init(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		buf_is_zero_impl = buf_is_zero_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		buf_is_zero_impl = buf_is_zero_sse2;
+#endif
+}
+
+bool buf_is_zero(const void *buf, size_t len)
+{
+	return buf_is_zero_impl(buf, len);
+}
@@ -0,0 +1,10 @@
+#ifndef ZERO_H
+#define ZERO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Uses AVX2 or SSE2 if the CPU has it; buf needs no particular alignment */
+extern bool buf_is_zero(const void *buf, size_t len);
+
+#endif